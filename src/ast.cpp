@@ -1,23 +1,97 @@
 #include "ast.h"
 
+#include <algorithm>
 #include <cassert>
 #include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <optional>
+#include <string>
 
 bool kind_is_function(NodeKind kind) {
   return kind >= NodeKind::_FUNCTIONS_START;
 }
 bool kind_is_array_like(NodeKind kind) {
-  return kind_is_function(kind) || (kind == NodeKind::OBJECT) ||
-         (kind == NodeKind::ARRAY);
+  return (kind_is_function(kind) && kind != NodeKind::Identifier &&
+          kind != NodeKind::Param) ||
+         (kind == NodeKind::OBJECT) || (kind == NodeKind::ARRAY);
+}
+
+const char *function_name(NodeKind kind) {
+  switch (kind) {
+  case NodeKind::Add:
+    return "Add";
+  case NodeKind::Sub:
+    return "Sub";
+  case NodeKind::Mul:
+    return "Mul";
+  case NodeKind::Div:
+    return "Div";
+  case NodeKind::Eq:
+    return "Eq";
+  case NodeKind::Ne:
+    return "Ne";
+  case NodeKind::Lt:
+    return "Lt";
+  case NodeKind::Le:
+    return "Le";
+  case NodeKind::Gt:
+    return "Gt";
+  case NodeKind::Ge:
+    return "Ge";
+  case NodeKind::And:
+    return "And";
+  case NodeKind::Or:
+    return "Or";
+  case NodeKind::Max:
+    return "Max";
+  case NodeKind::Min:
+    return "Min";
+  case NodeKind::Size:
+    return "Size";
+  case NodeKind::Sum:
+    return "Sum";
+  case NodeKind::Distinct:
+    return "Distinct";
+  case NodeKind::Sort:
+    return "Sort";
+  case NodeKind::SortBy:
+    return "SortBy";
+  case NodeKind::TopK:
+    return "TopK";
+  case NodeKind::BottomK:
+    return "BottomK";
+  case NodeKind::Subscript:
+    return "Subscript";
+  case NodeKind::Slice:
+    return "Slice";
+  case NodeKind::Filter:
+    return "Filter";
+  case NodeKind::Field:
+    return "Field";
+  case NodeKind::Identifier:
+    return "Identifier";
+  case NodeKind::Param:
+    return "Param";
+  default:
+    assert(0 && "Not a function");
+    return "";
+  }
 }
 
 AstNode::AstNode(NodeKind kind, size_t data, AstData value)
-    : packed((data << 5) | (size_t)kind), value(value) {
-  assert((int)kind < (1 << 5));
-  assert(data < (1L << 59));
+    : packed((data << DATA_SHIFT) | (size_t)kind), value(value) {
+  assert((size_t)kind <= KIND_MASK);
+  assert(data < ((size_t)1 << (sizeof(size_t) * 8 - DATA_SHIFT)));
+}
+
+AstNode AstNode::inline_string(std::string_view chars) {
+  assert(chars.size() <= INLINE_STRING_MAX);
+  AstData data{.nodes_start = 0};
+  std::memcpy(data.chars, chars.data(), chars.size());
+  AstNode node(NodeKind::STRING, chars.size(), data);
+  node.packed |= INLINE_FLAG;
+  return node;
 }
 
 StringIndex Arena::string_position() const {
@@ -54,103 +128,351 @@ std::span<AstNode> Arena::get_node_stack_between(NodeStackIndex start,
   return std::span(node_stack.data() + start.raw(), len);
 }
 
-std::pair<NodeIndex, size_t> Arena::node_stack_finish(NodeStackIndex start) {
+// FNV-1a
+static uint64_t hash_bytes(const void *data, size_t len) {
+  const unsigned char *bytes = (const unsigned char *)data;
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+std::pair<NodeIndex, size_t> Arena::node_stack_finish(NodeStackIndex start,
+                                                      NodeKind kind) {
   std::span<AstNode> children =
       get_node_stack_between(start, node_stack_position());
   size_t children_len = children.size();
 
+  uint64_t key = 0;
+  if (options.dedup && children_len > 0) {
+    key = hash_bytes(children.data(), children_len * sizeof(AstNode)) ^
+          ((uint64_t)kind << 56);
+    auto range = dedup.equal_range(key);
+    for (auto it = range.first; it != range.second; ++it) {
+      AstNode stored = it->second;
+      NodeIndex stored_start = stored.get_value().nodes_start;
+      if (stored.get_kind() == kind && stored.get_data() == children_len &&
+          memcmp(node_arena.data() + stored_start.raw(), children.data(),
+                 children_len * sizeof(AstNode)) == 0) {
+        node_stack_truncate(start);
+        dedup_stats.nodes += children_len;
+        return {stored_start, children_len};
+      }
+    }
+  }
+
   NodeIndex new_start(node_arena.size());
   for (AstNode node : children) {
     node_arena.push_back(node);
   }
 
   node_stack_truncate(start);
+  if (options.hashes) {
+    container_hashes.resize(node_arena.size());
+  }
+  if (options.dedup && children_len > 0) {
+    dedup.insert({key, kind == NodeKind::OBJECT
+                           ? AstNode::object(new_start, children_len)
+                           : AstNode::array(new_start, children_len)});
+  }
 
   return {new_start, children_len};
 }
 
-void Arena::debug_print_array(AstNode node, const char *name, int depth) {
-  printf("%s\n", name);
-  std::span<AstNode> children = as_array_like(node).value();
-  for (AstNode node : children) {
-    debug_print_impl(node, depth + 1);
+AstNode Arena::finish_string(StringIndex start) {
+  size_t len = string_arena.size() - start.raw();
+  if (len <= INLINE_STRING_MAX) {
+    AstNode node = AstNode::inline_string(get_string(start, len));
+    string_truncate(start);
+    return node;
+  }
+  if (!options.dedup) {
+    return AstNode::string(start, len);
   }
+
+  const char *chars = string_arena.data() + start.raw();
+  // strings and child lists never compare equal, they have different kinds
+  uint64_t key = hash_bytes(chars, len) ^ 1;
+  auto range = dedup.equal_range(key);
+  for (auto it = range.first; it != range.second; ++it) {
+    AstNode stored = it->second;
+    if (stored.get_kind() == NodeKind::STRING && stored.get_data() == len &&
+        memcmp(string_arena.data() + stored.get_value().string_start.raw(),
+               chars, len) == 0) {
+      string_truncate(start);
+      dedup_stats.string_bytes += len;
+      return stored;
+    }
+  }
+
+  AstNode node = AstNode::string(start, len);
+  dedup.insert({key, node});
+  return node;
 }
 
-void Arena::debug_print_impl(AstNode node, int depth) {
-  for (int i = 0; i < depth; i++) {
-    printf("  ");
+AstNode Arena::finish_container(NodeKind kind, NodeStackIndex start) {
+  auto pair = node_stack_finish(start, kind);
+  AstNode node = kind == NodeKind::OBJECT
+                     ? AstNode::object(pair.first, pair.second)
+                     : AstNode::array(pair.first, pair.second);
+  if (options.hashes && pair.second > 0) {
+    container_hashes[pair.first.raw()] = hash_children(node);
   }
-  auto kind = node.get_kind();
-  switch (kind) {
-  case NodeKind::ERROR:
-    printf("Error\n");
-    break;
+  return node;
+}
+
+AstNode Arena::finish_reserved(NodeKind kind, NodeIndex start, size_t len) {
+  AstNode node = kind == NodeKind::OBJECT ? AstNode::object(start, len)
+                                          : AstNode::array(start, len);
+  if (options.hashes && len > 0) {
+    container_hashes[start.raw()] = hash_children(node);
+  }
+  return node;
+}
+
+// splitmix64 finalizer
+static uint64_t mix(uint64_t x) {
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ull;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebull;
+  x ^= x >> 31;
+  return x;
+}
+
+uint64_t Arena::hash(AstNode node) {
+  uint64_t kind = (uint64_t)node.get_kind() << 56;
+  switch (node.get_kind()) {
   case NodeKind::STRING: {
-    std::cout << '"' << as_string_like(node).value() << '"' << std::endl;
-    break;
+    std::string_view string = as_string_like(node).value();
+    return mix(hash_bytes(string.data(), string.size()) ^ kind);
   }
-  case NodeKind::NUMBER:
-    std::cout << as_number(node).value() << std::endl;
-    break;
-  case NodeKind::BOOLEAN:
-    if (as_boolean(node).value())
-      printf("true\n");
-    else
-      printf("false\n");
-    break;
-  case NodeKind::OBJECT: {
-    debug_print_array(node, "{Object}", depth);
-    break;
+  case NodeKind::NUMBER: {
+    // 0 and -0 are equal
+    double number = node.get_value().number == 0 ? 0 : node.get_value().number;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    return mix(bits ^ kind);
   }
+  case NodeKind::BOOLEAN:
+    return mix(node.get_value().boolean ^ kind);
+  case NodeKind::OBJECT:
   case NodeKind::ARRAY: {
-    debug_print_array(node, "[Array]", depth);
-    break;
+    std::optional<uint64_t> stored = stored_hash(node);
+    return stored.has_value() ? *stored : hash_children(node);
   }
-  case NodeKind::NIL:
-    printf("null\n");
-    break;
-  case NodeKind::Add:
-    debug_print_array(node, "(Add)", depth);
-    break;
-  case NodeKind::Sub:
-    debug_print_array(node, "(Sub)", depth);
-    break;
-  case NodeKind::Mul:
-    debug_print_array(node, "(Mul)", depth);
-    break;
-  case NodeKind::Div:
-    debug_print_array(node, "(Div)", depth);
-    break;
-  case NodeKind::Eq:
-    debug_print_array(node, "(Eq)", depth);
-    break;
-  case NodeKind::Max:
-    debug_print_array(node, "(Max)", depth);
-    break;
-  case NodeKind::Min:
-    debug_print_array(node, "(Min)", depth);
-    break;
-  case NodeKind::Size:
-    debug_print_array(node, "(Size)", depth);
-    break;
-  case NodeKind::Subscript:
-    debug_print_array(node, "(Subscript)", depth);
-    break;
-  case NodeKind::Field:
-    debug_print_array(node, "(Field)", depth);
-    break;
-  case NodeKind::Identifier:
-    std::cout << as_string_like(node).value() << std::endl;
-    break;
   default:
-    assert(0 && "Unhandled variant");
+    return mix(kind);
   }
 }
 
-void Arena::debug_print(AstNode node) { debug_print_impl(node, 0); }
+uint64_t Arena::hash_children(AstNode node) {
+  // the containers being hashed, the document can be nested deeper than the
+  // call stack allows
+  struct Frame {
+    AstNode node;
+    std::span<AstNode> children;
+    size_t next;
+    uint64_t hash;
+    // objects: the sum of the pair hashes and the hash of the last key
+    uint64_t pairs;
+    uint64_t key;
+  };
+  std::vector<Frame> stack;
+  auto open = [&](AstNode container) {
+    std::span<AstNode> children = as_array_like(container).value();
+    uint64_t seed =
+        mix(((uint64_t)container.get_kind() << 56) ^ children.size());
+    stack.push_back({container, children, 0, seed, 0, 0});
+  };
+  // adds the hash of the child before `frame.next`
+  auto add = [](Frame &frame, uint64_t child) {
+    if (frame.node.get_kind() == NodeKind::ARRAY) {
+      frame.hash = mix(frame.hash + child);
+    } else if ((frame.next - 1) % 2 == 0) {
+      frame.key = child;
+    } else {
+      // the pairs are summed up so that their order doesn't matter
+      frame.pairs += mix(frame.key ^ mix(child));
+    }
+  };
 
-std::optional<std::string_view> Arena::as_string_like(AstNode node) {
+  open(node);
+  while (true) {
+    Frame &frame = stack.back();
+    if (frame.next == frame.children.size()) {
+      uint64_t hash = frame.node.get_kind() == NodeKind::ARRAY
+                          ? frame.hash
+                          : mix(frame.hash ^ frame.pairs);
+      stack.pop_back();
+      if (stack.empty()) {
+        return hash;
+      }
+      add(stack.back(), hash);
+      continue;
+    }
+
+    AstNode child = frame.children[frame.next++];
+    NodeKind kind = child.get_kind();
+    if ((kind == NodeKind::OBJECT || kind == NodeKind::ARRAY) &&
+        !stored_hash(child).has_value()) {
+      open(child);
+    } else {
+      add(frame, hash(child));
+    }
+  }
+}
+
+AstNode Arena::copy_tree(Arena &from, AstNode node) {
+  auto copy_leaf = [&](AstNode leaf) {
+    if (leaf.get_kind() != NodeKind::STRING || leaf.is_inline()) {
+      return leaf;
+    }
+    std::string_view string = from.as_string_like(leaf).value();
+    StringIndex start = string_position();
+    string_append(string.data(), string.size());
+    return finish_string(start);
+  };
+  auto is_container = [](AstNode any) {
+    return any.get_kind() == NodeKind::OBJECT ||
+           any.get_kind() == NodeKind::ARRAY;
+  };
+  if (!is_container(node)) {
+    return copy_leaf(node);
+  }
+
+  // the containers being copied, their children go on the node stack. The
+  // document can be nested deeper than the call stack allows.
+  struct Frame {
+    NodeKind kind;
+    // `from` is never appended to, so its nodes stay in place
+    std::span<AstNode> children;
+    size_t next;
+    NodeStackIndex start;
+  };
+  std::vector<Frame> stack;
+  stack.push_back({node.get_kind(), from.as_array_like(node).value(), 0,
+                   node_stack_position()});
+  while (true) {
+    Frame &frame = stack.back();
+    if (frame.next == frame.children.size()) {
+      AstNode copy = finish_container(frame.kind, frame.start);
+      stack.pop_back();
+      if (stack.empty()) {
+        return copy;
+      }
+      node_stack_push(copy);
+      continue;
+    }
+    AstNode child = frame.children[frame.next++];
+    if (is_container(child)) {
+      stack.push_back({child.get_kind(), from.as_array_like(child).value(), 0,
+                       node_stack_position()});
+    } else {
+      node_stack_push(copy_leaf(child));
+    }
+  }
+}
+
+void Arena::clear(ArenaOptions new_options) {
+  options = new_options;
+  string_arena.clear();
+  node_arena.clear();
+  node_stack.clear();
+  container_hashes.clear();
+  dedup.clear();
+  dedup_stats = {0, 0};
+}
+
+AstNode Arena::compact(AstNode root) {
+  Arena fresh(options);
+  AstNode new_root = fresh.copy_tree(*this, root);
+  *this = std::move(fresh);
+  return new_root;
+}
+
+// the deepest level debug_print() indents
+constexpr int MAX_INDENT = 64;
+
+void Arena::debug_print(AstNode node) {
+  // the children left to print of the containers being printed, the document
+  // can be nested deeper than the call stack allows
+  struct Pending {
+    std::span<AstNode> children;
+    int depth;
+  };
+  std::vector<Pending> pending;
+  int depth = 0;
+  while (true) {
+    // lines deeper than MAX_INDENT levels are marked with their depth instead
+    // of being indented further, or the dump of a deep document would grow
+    // with the square of its depth
+    for (int i = 0; i < std::min(depth, MAX_INDENT); i++) {
+      printf("  ");
+    }
+    if (depth > MAX_INDENT) {
+      printf("<%d> ", depth);
+    }
+    auto kind = node.get_kind();
+    switch (kind) {
+    case NodeKind::ERROR:
+      printf("Error\n");
+      break;
+    case NodeKind::STRING: {
+      std::cout << '"' << as_string_like(node).value() << '"' << std::endl;
+      break;
+    }
+    case NodeKind::NUMBER:
+      std::cout << as_number(node).value() << std::endl;
+      break;
+    case NodeKind::BOOLEAN:
+      if (as_boolean(node).value())
+        printf("true\n");
+      else
+        printf("false\n");
+      break;
+    case NodeKind::OBJECT:
+      printf("{Object}\n");
+      break;
+    case NodeKind::ARRAY:
+      printf("[Array]\n");
+      break;
+    case NodeKind::NIL:
+      printf("null\n");
+      break;
+    case NodeKind::Identifier:
+      std::cout << as_string_like(node).value() << std::endl;
+      break;
+    case NodeKind::Param:
+      printf("$%zu\n", node.get_data());
+      break;
+    default:
+      printf("(%s)\n", function_name(kind));
+      break;
+    }
+    if (kind_is_array_like(kind) && node.get_data() > 0) {
+      pending.push_back({as_array_like(node).value(), depth + 1});
+    }
+
+    while (!pending.empty() && pending.back().children.empty()) {
+      pending.pop_back();
+    }
+    if (pending.empty()) {
+      return;
+    }
+    node = pending.back().children.front();
+    depth = pending.back().depth;
+    pending.back().children = pending.back().children.subspan(1);
+  }
+}
+
+std::optional<std::string_view>
+Arena::as_string_like(const AstNode &node) {
+  if (node.is_inline()) {
+    return std::string_view(node.inline_chars(), node.get_data());
+  }
   if ((node.get_kind() == NodeKind::STRING) ||
       (node.get_kind() == NodeKind::Identifier)) {
     return get_string(node.get_value().string_start, node.get_data());
@@ -1,7 +1,12 @@
+#pragma once
+
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <optional>
 #include <span>
 #include <string_view>
+#include <unordered_map>
 #include <vector>
 
 enum class NodeKind {
@@ -22,16 +27,40 @@ enum class NodeKind {
   Mul,
   Div,
   Eq,
+  Ne,
+  Lt,
+  Le,
+  Gt,
+  Ge,
+  And,
+  Or,
   Max,
   Min,
   Size,
+  Sum,
+  // array of the distinct elements
+  Distinct,
+  // the elements in ascending order, by themselves or by a key expression
+  // evaluated on each of them
+  Sort,
+  SortBy,
+  // the k largest elements in descending order, the k smallest in ascending
+  // order
+  TopK,
+  BottomK,
   Subscript,
+  Slice,
+  Filter,
   Field,
-  Identifier
+  Identifier,
+  // positional parameter $1, $2, ... the index is stored in the data
+  Param
 };
 
 bool kind_is_function(NodeKind kind);
 bool kind_is_array_like(NodeKind kind);
+// "Add", "Field", ... for the kinds from _FUNCTIONS_START on
+const char *function_name(NodeKind kind);
 
 // typed wrappers of integer offsets into the arena
 
@@ -62,13 +91,27 @@ public:
   size_t raw() const { return index; }
 };
 
+// Strings up to this long are stored in the node instead of the string arena
+constexpr size_t INLINE_STRING_MAX = 8;
+
 union AstData {
   StringIndex string_start;
   NodeIndex nodes_start;
   double number;
   bool boolean;
+  // the characters of an inline string, zero padded
+  char chars[INLINE_STRING_MAX];
 };
 
+// The kind is stored in the low bits of AstNode::packed, followed by the
+// inline flag, the rest holds the data (lengths, parameter numbers)
+constexpr size_t KIND_BITS = 6;
+constexpr size_t KIND_MASK = (1 << KIND_BITS) - 1;
+static_assert((size_t)NodeKind::Param <= KIND_MASK);
+// Set on STRING nodes whose characters are in AstData::chars
+constexpr size_t INLINE_FLAG = 1 << KIND_BITS;
+constexpr size_t DATA_SHIFT = KIND_BITS + 1;
+
 class AstNode {
   size_t packed;
   AstData value;
@@ -77,18 +120,34 @@ public:
   AstNode() = default;
   AstNode(NodeKind kind, size_t data, AstData value);
 
-  NodeKind get_kind() const { return (NodeKind)(packed & 31); }
-  size_t get_data() const { return packed >> 5; }
+  NodeKind get_kind() const { return (NodeKind)(packed & KIND_MASK); }
+  size_t get_data() const { return packed >> DATA_SHIFT; }
   AstData get_value() const { return value; }
+  bool is_inline() const { return packed & INLINE_FLAG; }
+  const char *inline_chars() const { return value.chars; }
+
+  // Same kind, data and value, which for two strings means the same
+  // characters if one of them is inline
+  bool same_bytes(const AstNode &other) const {
+    return packed == other.packed &&
+           std::memcmp(&value, &other.value, sizeof(value)) == 0;
+  }
 
+  // Strings are made by Arena::finish_string(), which stores every string up
+  // to INLINE_STRING_MAX long inline, so that equal short strings are equal
+  // bytes
   static AstNode string(StringIndex start, size_t len) {
     return AstNode(NodeKind::STRING, len, {.string_start = start});
   }
+  static AstNode inline_string(std::string_view chars);
   static AstNode number(double value) {
     return AstNode(NodeKind::NUMBER, {}, {.number = value});
   }
   static AstNode boolean(bool value) {
-    return AstNode(NodeKind::BOOLEAN, {}, {.boolean = value});
+    // the rest of the word is zeroed, so equal nodes are equal bytes
+    AstData data{.nodes_start = 0};
+    data.boolean = value;
+    return AstNode(NodeKind::BOOLEAN, {}, data);
   }
   // Json objects are conceptually arrays of pairs of (string, json value),
   // since we don't have enough space in JsonNode for the entire pair, and want
@@ -113,6 +172,9 @@ public:
   static AstNode identifier(StringIndex start, size_t len) {
     return AstNode(NodeKind::Identifier, len, {.string_start = start});
   }
+  static AstNode param(size_t index) {
+    return AstNode(NodeKind::Param, index, {});
+  }
 };
 
 struct Function {
@@ -120,13 +182,54 @@ struct Function {
   std::span<AstNode> arguments;
 };
 
+struct ArenaOptions {
+  // Keep a structural hash of every container, see Arena::hash()
+  bool hashes = false;
+  // Store identical strings and child lists only once, see Arena::dedup
+  bool dedup = false;
+};
+
+// What deduplication saved so far
+struct DedupStats {
+  size_t nodes;
+  size_t string_bytes;
+};
+
+// Bytes in use and allocated by each part of an arena
+struct ArenaUsage {
+  size_t nodes;
+  size_t nodes_reserved;
+  size_t strings;
+  size_t strings_reserved;
+  size_t hashes;
+  size_t node_stack_reserved;
+};
+
 class Arena {
+  ArenaOptions options;
   std::vector<char> string_arena;
   std::vector<AstNode> node_arena;
   std::vector<AstNode> node_stack;
+  // with options.hashes, the hash of each non-empty container at the index of
+  // its first child, the same size as node_arena
+  std::vector<uint64_t> container_hashes;
+  // With options.dedup, the strings and the non-empty child lists stored so
+  // far by the hash of their contents. A child list equal to one which is
+  // already stored reuses its range, children are deduplicated before their
+  // parents so equal subtrees have byte-identical child lists. Ranges are
+  // never modified after they are stored, so sharing them is invisible to
+  // everything reading the arena.
+  std::unordered_multimap<uint64_t, AstNode> dedup;
+  DedupStats dedup_stats{0, 0};
 
 public:
   Arena() = default;
+  explicit Arena(ArenaOptions options) : options(options) {}
+
+  const ArenaOptions &get_options() const { return options; }
+
+  // Empties the arena for another document, the memory stays allocated
+  void clear(ArenaOptions new_options);
 
   StringIndex string_position() const;
 
@@ -136,6 +239,10 @@ public:
 
   void string_push(char c) { string_arena.push_back(c); }
 
+  void string_append(const char *chars, size_t len) {
+    string_arena.insert(string_arena.end(), chars, chars + len);
+  }
+
   // This method is dangerous!
   // Use it only if you are sure there is no StringIndex to the truncated
   // position remaining
@@ -145,6 +252,11 @@ public:
 
   std::span<AstNode> get_nodes(NodeIndex start, size_t len);
 
+  // Raw storage, for code which walks the arena without going through the
+  // accessors. Invalidated by any push.
+  const AstNode *node_data() const { return node_arena.data(); }
+  const char *string_data() const { return string_arena.data(); }
+
   NodeStackIndex node_stack_position() const {
     return NodeStackIndex(node_stack.size());
   }
@@ -163,12 +275,102 @@ public:
   NodeIndex nodes_push(AstNode node) {
     NodeIndex index(node_arena.size());
     node_arena.push_back(node);
+    if (options.hashes) {
+      container_hashes.push_back(0);
+    }
     return index;
   }
 
-  std::pair<NodeIndex, size_t> node_stack_finish(NodeStackIndex start);
+  // Appends `len` slots for the children of a container whose size is known
+  // up front, they are filled with nodes_set() instead of going through the
+  // node stack
+  NodeIndex nodes_reserve(size_t len) {
+    NodeIndex index(node_arena.size());
+    node_arena.resize(node_arena.size() + len);
+    if (options.hashes) {
+      container_hashes.resize(node_arena.size());
+    }
+    return index;
+  }
+
+  void nodes_set(NodeIndex index, AstNode node) {
+    node_arena[index.raw()] = node;
+  }
+
+  // Moves the node stack from `start` into the node arena. With dedup, only
+  // child lists of the same `kind` share a range, an OBJECT and an ARRAY
+  // keep hashes of their own at the index of their first child.
+  std::pair<NodeIndex, size_t>
+  node_stack_finish(NodeStackIndex start, NodeKind kind = NodeKind::ARRAY);
+
+  // A STRING of the characters pushed since `start`
+  AstNode finish_string(StringIndex start);
+
+  const DedupStats &get_dedup_stats() const { return dedup_stats; }
+
+  // Moves the node stack from `start` into an OBJECT or ARRAY, keeping its
+  // hash when they are enabled
+  AstNode finish_container(NodeKind kind, NodeStackIndex start);
+
+  // An OBJECT or ARRAY of slots from nodes_reserve() which are filled in. The
+  // children aren't deduplicated.
+  AstNode finish_reserved(NodeKind kind, NodeIndex start, size_t len);
+
+  // Structural hash of a json value, equal values have equal hashes. The
+  // order of the keys of an object doesn't matter. Containers are looked up
+  // when hashes are kept, and walked otherwise.
+  uint64_t hash(AstNode node);
+
+  // The kept hash of a container, if there is one
+  std::optional<uint64_t> stored_hash(AstNode node) const {
+    if (!options.hashes ||
+        (node.get_kind() != NodeKind::OBJECT &&
+         node.get_kind() != NodeKind::ARRAY) ||
+        node.get_data() == 0) {
+      return {};
+    }
+    return container_hashes[node.get_value().nodes_start.raw()];
+  }
+
+  size_t node_count() const { return node_arena.size(); }
+
+  ArenaUsage usage() const {
+    return {node_arena.size() * sizeof(AstNode),
+            node_arena.capacity() * sizeof(AstNode),
+            string_arena.size(),
+            string_arena.capacity(),
+            container_hashes.capacity() * sizeof(uint64_t),
+            node_stack.capacity() * sizeof(AstNode)};
+  }
+
+  // Whether `nodes` and `bytes` more can be appended without moving the
+  // storage, so that other threads can keep reading what is already there
+  bool has_room(size_t nodes, size_t bytes) const {
+    return node_arena.capacity() - node_arena.size() >= nodes &&
+           string_arena.capacity() - string_arena.size() >= bytes &&
+           (!options.hashes ||
+            container_hashes.capacity() - container_hashes.size() >= nodes);
+  }
+
+  void reserve(size_t nodes, size_t bytes) {
+    node_arena.reserve(node_arena.size() + nodes);
+    string_arena.reserve(string_arena.size() + bytes);
+    if (options.hashes) {
+      container_hashes.reserve(container_hashes.size() + nodes);
+    }
+  }
+
+  // Deep copy of a json value living in another arena
+  AstNode copy_tree(Arena &from, AstNode node);
+
+  // Replaces the arena with a copy of only what is reachable from `root`,
+  // returns the new root. Every other node and string index is invalidated.
+  AstNode compact(AstNode root);
 
-  std::optional<std::string_view> as_string_like(AstNode node);
+  // Inline strings are viewed in the node itself, so the view lives only as
+  // long as `node` does
+  std::optional<std::string_view> as_string_like(const AstNode &node);
+  std::optional<std::string_view> as_string_like(AstNode &&node) = delete;
   std::optional<double> as_number(AstNode node) const;
   std::optional<bool> as_boolean(AstNode node) const;
   std::optional<std::span<AstNode>> as_array_like(AstNode node);
@@ -176,6 +378,5 @@ public:
   void debug_print(AstNode node);
 
 private:
-  void debug_print_impl(AstNode node, int depth);
-  void debug_print_array(AstNode node, const char *name, int depth);
+  uint64_t hash_children(AstNode node);
 };
@@ -0,0 +1,609 @@
+#include "codegen.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <type_traits>
+#include <unistd.h>
+
+extern char **environ;
+
+// the generated code relies on this layout
+static_assert(std::is_standard_layout_v<AstNode>);
+static_assert(sizeof(AstNode) == sizeof(size_t) + sizeof(AstData));
+static_assert(std::is_standard_layout_v<CompiledInput>);
+static_assert(std::is_standard_layout_v<CompiledResult>);
+
+static void append_format(std::string &out, const char *format, ...) {
+  char buffer[512];
+  va_list args;
+  va_start(args, format);
+  int len = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  assert(len >= 0 && (size_t)len < sizeof(buffer));
+  out.append(buffer, len);
+}
+
+static void append_string_literal(std::string &out, std::string_view string) {
+  out.push_back('"');
+  for (char c : string) {
+    if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+        ('0' <= c && c <= '9') || c == '_' || c == ' ') {
+      out.push_back(c);
+    } else {
+      append_format(out, "\\%03o", (unsigned char)c);
+    }
+  }
+  out.push_back('"');
+}
+
+static void append_double_literal(std::string &out, double number) {
+  if (std::isnan(number)) {
+    out.append("__builtin_nan(\"\")");
+  } else if (std::isinf(number)) {
+    out.append(number < 0 ? "-__builtin_inf()" : "__builtin_inf()");
+  } else {
+    append_format(out, "%.17g", number);
+  }
+}
+
+// Everything the generated functions share. The kinds and the layout are
+// filled in from this build, so a change to them changes the hash of the
+// source as well.
+static const char *PRELUDE = R"(#include <cstddef>
+#include <cstring>
+
+namespace {
+
+union Data {
+  size_t index;
+  double number;
+  bool boolean;
+  char chars[INLINE_STRING_MAX];
+};
+
+struct Node {
+  size_t packed;
+  Data value;
+};
+
+struct Input {
+  const Node *nodes;
+  const char *strings;
+  Node root;
+};
+
+enum Kind : int { NUMBER = 1, BOOLEAN, JSON };
+
+struct Result {
+  Kind kind;
+  double number;
+  Node node;
+};
+
+static_assert(sizeof(Node) == SIZEOF_NODE, "AstNode layout changed");
+
+inline size_t kind_of(Node node) { return node.packed & KIND_MASK; }
+inline size_t data_of(Node node) { return node.packed >> DATA_SHIFT; }
+
+inline bool number(const Result &value, double &out) {
+  if (value.kind == NUMBER) {
+    out = value.number;
+    return true;
+  }
+  if (value.kind == JSON && kind_of(value.node) == K_NUMBER) {
+    out = value.node.value.number;
+    return true;
+  }
+  return false;
+}
+
+inline bool field(const Input &in, Node object, const char *key, size_t len,
+                  Node &out) {
+  if (kind_of(object) != K_OBJECT) {
+    return false;
+  }
+  const Node *children = in.nodes + object.value.index;
+  size_t count = data_of(object);
+  if (len <= INLINE_STRING_MAX) {
+    // short keys are stored inline, `len` is a constant so this folds into
+    // two words
+    Node wanted{(len << DATA_SHIFT) | INLINE_FLAG | K_STRING, {0}};
+    std::memcpy(wanted.value.chars, key, len);
+    for (size_t i = 0; i < count; i += 2) {
+      if (children[i].packed == wanted.packed &&
+          std::memcmp(&children[i].value, &wanted.value, sizeof(Data)) == 0) {
+        out = children[i + 1];
+        return true;
+      }
+    }
+    return false;
+  }
+  for (size_t i = 0; i < count; i += 2) {
+    Node child = children[i];
+    if (kind_of(child) == K_STRING && data_of(child) == len &&
+        std::memcmp(in.strings + child.value.index, key, len) == 0) {
+      out = children[i + 1];
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool element(const Input &in, Node array, double index, Node &out) {
+  if (kind_of(array) != K_ARRAY ||
+      !(index >= 0 && index < (double)data_of(array))) {
+    return false;
+  }
+  out = in.nodes[array.value.index + (size_t)index];
+  return true;
+}
+
+// Folds a number, or the elements of an array which must all be numbers
+template <typename F>
+inline bool fold(const Input &in, const Result &value, double &acc, bool &any,
+                 F f) {
+  if (value.kind == JSON && kind_of(value.node) == K_ARRAY) {
+    const Node *elements = in.nodes + value.node.value.index;
+    size_t len = data_of(value.node);
+    for (size_t i = 0; i < len; i++) {
+      if (kind_of(elements[i]) != K_NUMBER) {
+        return false;
+      }
+      double next = elements[i].value.number;
+      acc = any ? f(acc, next) : next;
+      any = true;
+    }
+    return true;
+  }
+  double next;
+  if (!number(value, next)) {
+    return false;
+  }
+  acc = any ? f(acc, next) : next;
+  any = true;
+  return true;
+}
+
+} // namespace
+
+)";
+
+namespace {
+
+struct Generator {
+  Arena &arena;
+  std::string code;
+  size_t count = 0;
+
+  // Appends the function evaluating `node` and returns its number, the
+  // functions of the arguments come first
+  size_t emit(AstNode node);
+};
+
+const char *arithmetic_operator(NodeKind kind) {
+  switch (kind) {
+  case NodeKind::Add:
+    return "+";
+  case NodeKind::Sub:
+    return "-";
+  case NodeKind::Mul:
+    return "*";
+  case NodeKind::Div:
+    return "/";
+  default:
+    return nullptr;
+  }
+}
+
+// Same as compare_values() for two numbers
+const char *comparison(NodeKind kind) {
+  switch (kind) {
+  case NodeKind::Eq:
+    return "a == b";
+  case NodeKind::Ne:
+    return "a != b";
+  case NodeKind::Lt:
+    return "order < 0";
+  case NodeKind::Le:
+    return "order <= 0";
+  case NodeKind::Gt:
+    return "order > 0";
+  case NodeKind::Ge:
+    return "order >= 0";
+  default:
+    return nullptr;
+  }
+}
+
+// Same as Value::max, Value::min and Value::add for two numbers
+const char *reduction(NodeKind kind) {
+  switch (kind) {
+  case NodeKind::Max:
+    return "a < b ? b : a";
+  case NodeKind::Min:
+    return "a > b ? b : a";
+  case NodeKind::Sum:
+    return "a + b";
+  default:
+    return nullptr;
+  }
+}
+
+size_t Generator::emit(AstNode node) {
+  std::vector<size_t> args;
+  if (kind_is_array_like(node.get_kind())) {
+    std::span<AstNode> children = arena.as_array_like(node).value();
+    for (AstNode child : children) {
+      // the key of a field access is baked into the parent
+      if (node.get_kind() == NodeKind::Field &&
+          child.get_kind() == NodeKind::Identifier && args.size() == 1) {
+        break;
+      }
+      args.push_back(emit(child));
+    }
+  }
+
+  size_t id = count++;
+  std::string &out = code;
+  append_format(out, "static bool e%zu(const Input &in, Result &r) {\n", id);
+
+  NodeKind kind = node.get_kind();
+  switch (kind) {
+  case NodeKind::NUMBER:
+    out.append("  r.kind = NUMBER;\n  r.number = ");
+    append_double_literal(out, arena.as_number(node).value());
+    out.append(";\n  return true;\n");
+    break;
+  case NodeKind::BOOLEAN:
+    append_format(out, "  r.kind = BOOLEAN;\n  r.number = %d;\n  return true;\n",
+                  (int)arena.as_boolean(node).value());
+    break;
+  case NodeKind::Identifier: {
+    std::string_view key = arena.as_string_like(node).value();
+    out.append("  r.kind = JSON;\n  return field(in, in.root, ");
+    append_string_literal(out, key);
+    append_format(out, ", %zu, r.node);\n", key.size());
+    break;
+  }
+  case NodeKind::Field: {
+    std::string_view key =
+        arena.as_string_like(arena.as_array_like(node).value()[1]).value();
+    append_format(out, "  if (!e%zu(in, r) || r.kind != JSON) {\n", args[0]);
+    out.append("    return false;\n  }\n  return field(in, r.node, ");
+    append_string_literal(out, key);
+    append_format(out, ", %zu, r.node);\n", key.size());
+    break;
+  }
+  case NodeKind::Subscript:
+    append_format(out,
+                  "  Result index;\n"
+                  "  double i;\n"
+                  "  if (!e%zu(in, r) || r.kind != JSON || !e%zu(in, index) ||\n"
+                  "      !number(index, i)) {\n"
+                  "    return false;\n"
+                  "  }\n"
+                  "  return element(in, r.node, i, r.node);\n",
+                  args[0], args[1]);
+    break;
+  case NodeKind::Add:
+  case NodeKind::Sub:
+  case NodeKind::Mul:
+  case NodeKind::Div:
+    out.append("  Result arg;\n  double acc, next;\n");
+    for (size_t i = 0; i < args.size(); i++) {
+      append_format(out,
+                    "  if (!e%zu(in, arg) || !number(arg, %s)) {\n"
+                    "    return false;\n"
+                    "  }\n",
+                    args[i], i == 0 ? "acc" : "next");
+      if (i > 0) {
+        append_format(out, "  acc %s= next;\n", arithmetic_operator(kind));
+      }
+    }
+    out.append("  r.kind = NUMBER;\n  r.number = acc;\n  return true;\n");
+    break;
+  case NodeKind::Eq:
+  case NodeKind::Ne:
+  case NodeKind::Lt:
+  case NodeKind::Le:
+  case NodeKind::Gt:
+  case NodeKind::Ge:
+    append_format(out,
+                  "  Result arg;\n"
+                  "  double a, b;\n"
+                  "  if (!e%zu(in, arg) || !number(arg, a) || !e%zu(in, arg) ||\n"
+                  "      !number(arg, b)) {\n"
+                  "    return false;\n"
+                  "  }\n"
+                  "  int order = (a > b) - (a < b);\n"
+                  "  (void)order;\n"
+                  "  r.kind = BOOLEAN;\n"
+                  "  r.number = %s;\n"
+                  "  return true;\n",
+                  args[0], args[1], comparison(kind));
+    break;
+  case NodeKind::Max:
+  case NodeKind::Min:
+  case NodeKind::Sum:
+    append_format(out,
+                  "  auto f = [](double a, double b) { return %s; };\n"
+                  "  Result arg;\n"
+                  "  double acc = 0;\n"
+                  "  bool any = false;\n",
+                  reduction(kind));
+    for (size_t arg : args) {
+      append_format(out,
+                    "  if (!e%zu(in, arg) || !fold(in, arg, acc, any, f)) {\n"
+                    "    return false;\n"
+                    "  }\n",
+                    arg);
+    }
+    // an empty reduction is null
+    out.append("  r.kind = NUMBER;\n  r.number = acc;\n  return any;\n");
+    break;
+  case NodeKind::Size:
+    append_format(out,
+                  "  if (!e%zu(in, r) || r.kind != JSON) {\n"
+                  "    return false;\n"
+                  "  }\n"
+                  "  size_t len = data_of(r.node);\n"
+                  "  switch (kind_of(r.node)) {\n"
+                  "  case K_ARRAY:\n"
+                  "  case K_STRING:\n"
+                  "    break;\n"
+                  "  case K_OBJECT:\n"
+                  "    len /= 2;\n"
+                  "    break;\n"
+                  "  default:\n"
+                  "    return false;\n"
+                  "  }\n"
+                  "  r.kind = NUMBER;\n"
+                  "  r.number = (double)len;\n"
+                  "  return true;\n",
+                  args[0]);
+    break;
+  default:
+    assert(0 && "Unsupported node");
+  }
+
+  out.append("}\n\n");
+  return id;
+}
+
+} // namespace
+
+bool CompiledQuery::supported(AstNode expression, Arena &arena) {
+  NodeKind kind = expression.get_kind();
+  switch (kind) {
+  case NodeKind::NUMBER:
+  case NodeKind::BOOLEAN:
+  case NodeKind::Identifier:
+    return true;
+  case NodeKind::Field: {
+    std::span<AstNode> args = arena.as_array_like(expression).value();
+    return args.size() == 2 && args[1].get_kind() == NodeKind::Identifier &&
+           supported(args[0], arena);
+  }
+  case NodeKind::Subscript:
+  case NodeKind::Add:
+  case NodeKind::Sub:
+  case NodeKind::Mul:
+  case NodeKind::Div:
+  case NodeKind::Eq:
+  case NodeKind::Ne:
+  case NodeKind::Lt:
+  case NodeKind::Le:
+  case NodeKind::Gt:
+  case NodeKind::Ge:
+  case NodeKind::Max:
+  case NodeKind::Min:
+  case NodeKind::Sum:
+  case NodeKind::Size: {
+    std::span<AstNode> args = arena.as_array_like(expression).value();
+    if (args.empty() ||
+        ((kind == NodeKind::Subscript || comparison(kind) != nullptr) &&
+         args.size() != 2) ||
+        (kind == NodeKind::Size && args.size() != 1)) {
+      return false;
+    }
+    for (AstNode arg : args) {
+      if (!supported(arg, arena)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+std::string CompiledQuery::generate(AstNode expression, Arena &arena) {
+  std::string source;
+  append_format(source,
+                "// generated by json_eval " JSON_EVAL_VERSION "\n"
+                "#define KIND_MASK %zu\n"
+                "#define INLINE_FLAG %zu\n"
+                "#define DATA_SHIFT %zu\n"
+                "#define INLINE_STRING_MAX %zu\n"
+                "#define SIZEOF_NODE %zu\n"
+                "#define K_STRING %d\n"
+                "#define K_NUMBER %d\n"
+                "#define K_OBJECT %d\n"
+                "#define K_ARRAY %d\n",
+                KIND_MASK, INLINE_FLAG, DATA_SHIFT,
+                INLINE_STRING_MAX, sizeof(AstNode), (int)NodeKind::STRING,
+                (int)NodeKind::NUMBER, (int)NodeKind::OBJECT,
+                (int)NodeKind::ARRAY);
+  source.append(PRELUDE);
+
+  Generator generator{arena, {}};
+  size_t root = generator.emit(expression);
+  source.append(generator.code);
+  append_format(source,
+                "extern \"C\" int json_eval_query(const Input *in, Result "
+                "*out) {\n"
+                "  return e%zu(*in, *out);\n"
+                "}\n",
+                root);
+  return source;
+}
+
+// FNV-1a
+static uint64_t hash_source(std::string_view source) {
+  uint64_t hash = 14695981039346656037ull;
+  for (char c : source) {
+    hash ^= (unsigned char)c;
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+static std::string cache_directory() {
+  const char *xdg = std::getenv("XDG_CACHE_HOME");
+  if (xdg != nullptr && *xdg != '\0') {
+    return std::string(xdg) + "/json_eval";
+  }
+  const char *home = std::getenv("HOME");
+  if (home != nullptr && *home != '\0') {
+    return std::string(home) + "/.cache/json_eval";
+  }
+  return "";
+}
+
+static bool make_directories(const std::string &path) {
+  for (size_t i = 1; i <= path.size(); i++) {
+    if (i == path.size() || path[i] == '/') {
+      std::string prefix = path.substr(0, i);
+      if (mkdir(prefix.c_str(), 0755) != 0 && errno != EEXIST) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// Runs the compiler without going through a shell, its output is discarded
+static bool run_compiler(const char *compiler, const std::string &source,
+                         const std::string &output) {
+  const char *argv[] = {compiler,      "-std=c++17", "-O2",
+                        "-shared",     "-fPIC",      "-o",
+                        output.c_str(), source.c_str(), nullptr};
+
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, "/dev/null",
+                                   O_WRONLY, 0);
+  pid_t pid;
+  int spawned = posix_spawnp(&pid, compiler, &actions, nullptr,
+                             (char *const *)argv, environ);
+  posix_spawn_file_actions_destroy(&actions);
+  if (spawned != 0) {
+    return false;
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return false;
+    }
+  }
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+std::unique_ptr<CompiledQuery>
+CompiledQuery::compile(AstNode expression, Arena &arena, const char *&error) {
+  if (!supported(expression, arena)) {
+    error = "Expression can't be compiled";
+    return nullptr;
+  }
+
+  const char *compiler = std::getenv("CXX");
+  if (compiler == nullptr || *compiler == '\0') {
+    compiler = "c++";
+  }
+
+  std::string source = generate(expression, arena);
+  std::string directory = cache_directory();
+  if (directory.empty() || !make_directories(directory)) {
+    error = "No cache directory for compiled queries";
+    return nullptr;
+  }
+
+  char name[64];
+  snprintf(name, sizeof(name), "/%016llx-%s.so",
+           (unsigned long long)hash_source(source + compiler),
+           JSON_EVAL_VERSION);
+  std::string library_path = directory + name;
+
+  if (access(library_path.c_str(), R_OK) != 0) {
+    // compile next to the final path and rename it into place, so concurrent
+    // runs never load a half written library
+    std::string temporary = library_path + "." + std::to_string(getpid());
+    std::string source_path = temporary + ".cpp";
+    FILE *file = fopen(source_path.c_str(), "w");
+    if (file == nullptr) {
+      error = "Can't write the source of the compiled query";
+      return nullptr;
+    }
+    bool written = fwrite(source.data(), 1, source.size(), file) ==
+                   source.size();
+    written = fclose(file) == 0 && written;
+
+    bool compiled =
+        written && run_compiler(compiler, source_path, temporary) &&
+        rename(temporary.c_str(), library_path.c_str()) == 0;
+    unlink(source_path.c_str());
+    if (!compiled) {
+      unlink(temporary.c_str());
+      error = "Compiling the query failed";
+      return nullptr;
+    }
+  }
+
+  void *library = dlopen(library_path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (library == nullptr) {
+    error = "Loading the compiled query failed";
+    return nullptr;
+  }
+  auto function = (Function)dlsym(library, "json_eval_query");
+  if (function == nullptr) {
+    dlclose(library);
+    error = "Loading the compiled query failed";
+    return nullptr;
+  }
+  return std::unique_ptr<CompiledQuery>(new CompiledQuery(library, function));
+}
+
+CompiledQuery::~CompiledQuery() { dlclose(library); }
+
+bool CompiledQuery::run(Arena &document, AstNode root, Value &out) const {
+  CompiledInput input{document.node_data(), document.string_data(), root};
+  CompiledResult result;
+  if (!function(&input, &result)) {
+    return false;
+  }
+
+  switch (result.kind) {
+  case CompiledKind::NUMBER:
+    out = Value::number(result.number);
+    break;
+  case CompiledKind::BOOLEAN:
+    out = Value::boolean(result.number != 0);
+    break;
+  case CompiledKind::JSON:
+    out = from_json(result.node, document);
+    break;
+  }
+  return true;
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+// Ahead of time compilation of expressions into native code.
+//
+// The optimized expression is translated into C++ which walks the arena of a
+// document directly, every node of the expression becomes its own function
+// with field names and constants baked in. The source is built with the system
+// compiler into a shared object which is loaded with dlopen. Shared objects
+// are cached under $XDG_CACHE_HOME/json_eval, keyed by a hash of the generated
+// source and the version of json_eval, so each query is only compiled once.
+//
+// Only paths, arithmetic and comparisons on numbers, min, max, sum and size
+// are compiled. The generated code gives up on anything else it meets at
+// runtime (a missing field, a string operand, ...) and the caller evaluates
+// the query with the interpreter instead, so results and errors are always
+// the same as the interpreter's.
+
+#include "eval.h"
+
+#include <memory>
+#include <string>
+
+// Arguments and results of the generated function, the generated source has
+// its own copy of these with the same layout
+struct CompiledInput {
+  const AstNode *nodes;
+  const char *strings;
+  AstNode root;
+};
+
+enum class CompiledKind : int {
+  NUMBER = 1,
+  BOOLEAN,
+  // a node of the document
+  JSON,
+};
+
+struct CompiledResult {
+  CompiledKind kind;
+  double number;
+  AstNode node;
+};
+
+class CompiledQuery {
+  using Function = int (*)(const CompiledInput *, CompiledResult *);
+
+  void *library;
+  Function function;
+
+  CompiledQuery(void *library, Function function)
+      : library(library), function(function) {}
+
+public:
+  CompiledQuery(const CompiledQuery &) = delete;
+  CompiledQuery &operator=(const CompiledQuery &) = delete;
+  ~CompiledQuery();
+
+  // Whether every node of the expression can be compiled
+  static bool supported(AstNode expression, Arena &arena);
+
+  // The C++ source for the expression, which must be supported
+  static std::string generate(AstNode expression, Arena &arena);
+
+  // Loads the query from the cache, compiling it first if needed. Returns
+  // nullptr and sets `error` if the expression isn't supported or there is no
+  // working compiler.
+  static std::unique_ptr<CompiledQuery>
+  compile(AstNode expression, Arena &arena, const char *&error);
+
+  // Returns false if the query has to be evaluated by the interpreter for
+  // this document
+  bool run(Arena &document, AstNode root, Value &out) const;
+};
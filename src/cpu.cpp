@@ -0,0 +1,635 @@
+#include "cpu.h"
+
+#include <cassert>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_X86 1
+#endif
+
+static_assert(sizeof(AstNode) == 16, "the vector kernels load nodes as words");
+
+CpuFeatures detect_cpu() {
+  CpuFeatures features{};
+#ifdef CPU_X86
+  __builtin_cpu_init();
+  features.sse42 = __builtin_cpu_supports("sse4.2");
+  features.avx2 = __builtin_cpu_supports("avx2");
+  // BMI1 and 2, they came with AVX2
+  features.bmi2 =
+      __builtin_cpu_supports("bmi") && __builtin_cpu_supports("bmi2");
+  features.avx512 = __builtin_cpu_supports("avx512f") &&
+                    __builtin_cpu_supports("avx512bw");
+#endif
+  return features;
+}
+
+static bool is_whitespace(char c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static bool is_string_char(char c) {
+  return (unsigned char)c >= 0x20 && c != '"' && c != '\\';
+}
+
+static bool is_digit(char c) { return '0' <= c && c <= '9'; }
+
+template <typename F>
+static size_t scan_while(const char *chars, size_t len, F accept) {
+  size_t i = 0;
+  while (i < len && accept(chars[i])) {
+    i++;
+  }
+  return i;
+}
+
+static size_t skip_whitespace_generic(const char *chars, size_t len) {
+  return scan_while(chars, len, is_whitespace);
+}
+
+Utf8Lead utf8_lead(int lead) {
+  if (lead >= 0xc2 && lead <= 0xdf) {
+    return {2, 0x80, 0xbf};
+  } else if (lead == 0xe0) {
+    return {3, 0xa0, 0xbf};
+  } else if (lead == 0xed) {
+    return {3, 0x80, 0x9f};
+  } else if (lead >= 0xe1 && lead <= 0xef) {
+    return {3, 0x80, 0xbf};
+  } else if (lead == 0xf0) {
+    return {4, 0x90, 0xbf};
+  } else if (lead == 0xf4) {
+    return {4, 0x80, 0x8f};
+  } else if (lead >= 0xf1 && lead <= 0xf3) {
+    return {4, 0x80, 0xbf};
+  }
+  return {0, 0, 0};
+}
+
+// Length of the valid sequence of non ascii bytes at the start, 0 if it's
+// invalid or cut off
+static size_t utf8_sequence(const char *chars, size_t len) {
+  Utf8Lead lead = utf8_lead((unsigned char)chars[0]);
+  if (lead.len == 0 || (size_t)lead.len > len) {
+    return 0;
+  }
+  int lower = lead.lower;
+  int upper = lead.upper;
+  for (int i = 1; i < lead.len; i++) {
+    int c = (unsigned char)chars[i];
+    if (c < lower || c > upper) {
+      return 0;
+    }
+    lower = 0x80;
+    upper = 0xbf;
+  }
+  return lead.len;
+}
+
+// The start of the sequence which crosses `i`, or `i`. The bytes before `i`
+// are valid UTF-8 apart from the last sequence, which may be invalid or cut
+// off.
+static size_t sequence_start(const char *chars, size_t i) {
+  for (size_t back = 1; back <= 3 && back <= i; back++) {
+    int c = (unsigned char)chars[i - back];
+    if (c < 0x80) {
+      return i;
+    }
+    if ((c & 0xc0) != 0x80) {
+      size_t n = utf8_lead(c).len;
+      return n == 0 || n > back ? i - back : i;
+    }
+  }
+  return i;
+}
+
+static size_t scan_string_generic(const char *chars, size_t len) {
+  size_t i = 0;
+  while (i < len) {
+    if ((unsigned char)chars[i] < 0x80) {
+      if (!is_string_char(chars[i])) {
+        break;
+      }
+      i++;
+      continue;
+    }
+    size_t n = utf8_sequence(chars + i, len - i);
+    if (n == 0) {
+      break;
+    }
+    i += n;
+  }
+  return i;
+}
+
+static size_t count_digits_generic(const char *chars, size_t len) {
+  return scan_while(chars, len, is_digit);
+}
+
+static bool is_number(const AstNode &node) {
+  return node.get_kind() == NodeKind::NUMBER;
+}
+
+// Same as Value::max, Value::min and Value::add for two numbers
+static double combine(Reduction op, double a, double b) {
+  switch (op) {
+  case Reduction::Max:
+    return a < b ? b : a;
+  case Reduction::Min:
+    return a > b ? b : a;
+  case Reduction::Sum:
+    return a + b;
+  }
+  assert(0 && "Unhandled case");
+  return a;
+}
+
+static size_t fold_numbers_generic(const AstNode *nodes, size_t len,
+                                   Reduction op, double &acc) {
+  if (len == 0 || !is_number(nodes[0])) {
+    return 0;
+  }
+  acc = nodes[0].get_value().number;
+  size_t i = 1;
+  for (; i < len && is_number(nodes[i]); i++) {
+    acc = combine(op, acc, nodes[i].get_value().number);
+  }
+  return i;
+}
+
+// Folds the lanes of a vector kernel in order and goes on with the nodes
+// from `i`. Lanes keep the first of equal values like the scalar loop does,
+// but across lanes a later one can win. Equal numbers only differ in the sign
+// of zero, so zeros are folded again in order.
+static size_t finish_fold(const double *lanes, size_t lane_count,
+                          const AstNode *nodes, size_t i, size_t len,
+                          Reduction op, double &acc) {
+  acc = lanes[0];
+  for (size_t lane = 1; lane < lane_count; lane++) {
+    acc = combine(op, acc, lanes[lane]);
+  }
+  for (; i < len && is_number(nodes[i]); i++) {
+    acc = combine(op, acc, nodes[i].get_value().number);
+  }
+  if (acc == 0) {
+    return fold_numbers_generic(nodes, len, op, acc);
+  }
+  return i;
+}
+
+#ifdef CPU_X86
+
+// SSE 4.2 string compares, PCMPESTRI finds the first byte in or out of a set
+// of characters or ranges
+
+#define SSE42 __attribute__((target("sse4.2")))
+
+SSE42 static size_t skip_whitespace_sse42(const char *chars, size_t len) {
+  const __m128i set = _mm_setr_epi8(' ', '\t', '\n', '\r', 0, 0, 0, 0, 0, 0,
+                                    0, 0, 0, 0, 0, 0);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(chars + i));
+    int index = _mm_cmpestri(set, 4, block, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY |
+                                 _SIDD_NEGATIVE_POLARITY);
+    if (index < 16) {
+      return i + index;
+    }
+  }
+  return i + skip_whitespace_generic(chars + i, len - i);
+}
+
+// Multibyte sequences are checked one at a time
+SSE42 static size_t scan_string_sse42(const char *chars, size_t len) {
+  const __m128i ranges =
+      _mm_setr_epi8(0, 0x1f, '"', '"', '\\', '\\', (char)0x80, (char)0xff, 0,
+                    0, 0, 0, 0, 0, 0, 0);
+  size_t i = 0;
+  while (i + 16 <= len) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(chars + i));
+    int index = _mm_cmpestri(ranges, 8, block, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES);
+    i += index;
+    if (index == 16) {
+      continue;
+    }
+    if ((unsigned char)chars[i] < 0x80) {
+      return i;
+    }
+    size_t n = utf8_sequence(chars + i, len - i);
+    if (n == 0) {
+      return i;
+    }
+    i += n;
+  }
+  return i + scan_string_generic(chars + i, len - i);
+}
+
+SSE42 static size_t count_digits_sse42(const char *chars, size_t len) {
+  const __m128i range =
+      _mm_setr_epi8('0', '9', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+  size_t i = 0;
+  for (; i + 16 <= len; i += 16) {
+    __m128i block = _mm_loadu_si128((const __m128i *)(chars + i));
+    int index = _mm_cmpestri(range, 2, block, 16,
+                             _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                                 _SIDD_NEGATIVE_POLARITY);
+    if (index < 16) {
+      return i + index;
+    }
+  }
+  return i + count_digits_generic(chars + i, len - i);
+}
+
+// AVX2, 32 bytes at a time with a bit per byte in a mask
+
+#define AVX2 __attribute__((target("avx2,bmi,bmi2")))
+
+AVX2 static size_t skip_whitespace_avx2(const char *chars, size_t len) {
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(chars + i));
+    __m256i space =
+        _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(' ')),
+                        _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\t')));
+    __m256i line =
+        _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\r')));
+    uint32_t other =
+        ~(uint32_t)_mm256_movemask_epi8(_mm256_or_si256(space, line));
+    if (other != 0) {
+      return i + __builtin_ctz(other);
+    }
+  }
+  return i + skip_whitespace_generic(chars + i, len - i);
+}
+
+// UTF-8 validation with table lookups, after "Validating UTF-8 In Less Than
+// One Instruction Per Byte" (Keiser, Lemire). Every pair of bytes is looked
+// up by the nibbles of the first byte and the high nibble of the second, and
+// the bits of the three tables say which errors the pair could be part of.
+// The errors are flagged at the byte where they show, the byte after a
+// lead which isn't followed by enough continuation bytes for example.
+
+enum : uint8_t {
+  // 11______ 0_______, 11______ 11______
+  TOO_SHORT = 1 << 0,
+  // 0_______ 10______
+  TOO_LONG = 1 << 1,
+  // 11100000 100_____
+  OVERLONG_3 = 1 << 2,
+  // 11110100 1001____ and above
+  TOO_LARGE = 1 << 3,
+  // 11101101 101_____
+  SURROGATE = 1 << 4,
+  // 1100000_ 10______
+  OVERLONG_2 = 1 << 5,
+  // 11110000 1000____, 11110101 1000____ and above
+  TOO_LARGE_1000 = 1 << 6,
+  OVERLONG_4 = 1 << 6,
+  // 10______ 10______
+  TWO_CONTS = 1 << 7,
+  // the high nibble of the first byte decides these
+  CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+};
+
+AVX2 static inline __m256i lookup16(__m256i nibbles, const uint8_t *table) {
+  __m128i half = _mm_loadu_si128((const __m128i *)table);
+  return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(half), nibbles);
+}
+
+// The bytes of `input` moved back by N, with the end of `prev` in front
+template <int N>
+AVX2 static inline __m256i prev_bytes(__m256i input, __m256i prev) {
+  return _mm256_alignr_epi8(
+      input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - N);
+}
+
+// Non zero bytes where `input` isn't valid UTF-8, `prev` is the block before
+// it, all zero at the start
+AVX2 static __m256i utf8_errors(__m256i input, __m256i prev) {
+  static const uint8_t byte_1_high[16] = {
+      // ascii
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+      TOO_LONG,
+      // continuation
+      TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+      // 1100____
+      TOO_SHORT | OVERLONG_2,
+      // 1101____
+      TOO_SHORT,
+      // 1110____
+      TOO_SHORT | OVERLONG_3 | SURROGATE,
+      // 1111____
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4};
+  static const uint8_t byte_1_low[16] = {
+      // ____0000
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+      // ____0001
+      CARRY | OVERLONG_2,
+      // ____001_
+      CARRY, CARRY,
+      // ____0100
+      CARRY | TOO_LARGE,
+      // ____0101 to ____1100
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      // ____1101
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+      // ____111_
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000};
+  static const uint8_t byte_2_high[16] = {
+      // ascii
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+      TOO_SHORT, TOO_SHORT,
+      // 1000____
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 |
+          OVERLONG_4,
+      // 1001____
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+      // 101_____
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+      // 11______
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT};
+
+  const __m256i low_nibble = _mm256_set1_epi8(0x0f);
+  __m256i prev1 = prev_bytes<1>(input, prev);
+  __m256i special = _mm256_and_si256(
+      _mm256_and_si256(
+          lookup16(_mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble),
+                   byte_1_high),
+          lookup16(_mm256_and_si256(prev1, low_nibble), byte_1_low)),
+      lookup16(_mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble),
+               byte_2_high));
+
+  // the third and fourth bytes of a sequence have to be continuations, which
+  // TWO_CONTS flagged
+  __m256i third =
+      _mm256_subs_epu8(prev_bytes<2>(input, prev), _mm256_set1_epi8(0x60));
+  __m256i fourth = _mm256_subs_epu8(prev_bytes<3>(input, prev),
+                                    _mm256_set1_epi8((char)0x70));
+  __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                           _mm256_set1_epi8((char)0x80));
+  return _mm256_xor_si256(must_continue, special);
+}
+
+// Blocks of ascii only check for the characters which end the run. Other
+// blocks are validated as a whole, an error up to the end of the run means
+// the exact end is found with the scalar code.
+AVX2 static size_t scan_string_avx2(const char *chars, size_t len) {
+  const __m256i control = _mm256_set1_epi8(0x1f);
+  __m256i prev = _mm256_setzero_si256();
+  bool prev_ascii = true;
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(chars + i));
+    __m256i special =
+        _mm256_or_si256(_mm256_cmpeq_epi8(c, _mm256_set1_epi8('"')),
+                        _mm256_cmpeq_epi8(c, _mm256_set1_epi8('\\')));
+    // unsigned c <= 0x1f
+    __m256i low = _mm256_cmpeq_epi8(_mm256_max_epu8(c, control), control);
+    uint32_t stop =
+        (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(special, low));
+    uint32_t high = (uint32_t)_mm256_movemask_epi8(c);
+    if (high != 0 || !prev_ascii) {
+      __m256i errors = utf8_errors(c, prev);
+      uint32_t bad = ~(uint32_t)_mm256_movemask_epi8(
+          _mm256_cmpeq_epi8(errors, _mm256_setzero_si256()));
+      // up to and including the first stop, sequences cut off by it are
+      // flagged there
+      uint32_t run = stop != 0 ? _blsmsk_u32(stop) : ~0u;
+      if ((bad & run) != 0) {
+        size_t start = sequence_start(chars, i);
+        return start + scan_string_generic(chars + start, len - start);
+      }
+    }
+    if (stop != 0) {
+      return i + __builtin_ctz(stop);
+    }
+    prev = c;
+    prev_ascii = high == 0;
+  }
+  size_t start = sequence_start(chars, i);
+  return start + scan_string_generic(chars + start, len - start);
+}
+
+AVX2 static size_t count_digits_avx2(const char *chars, size_t len) {
+  const __m256i nine = _mm256_set1_epi8(9);
+  size_t i = 0;
+  for (; i + 32 <= len; i += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(chars + i));
+    __m256i d = _mm256_sub_epi8(c, _mm256_set1_epi8('0'));
+    // unsigned d <= 9
+    __m256i digit = _mm256_cmpeq_epi8(_mm256_min_epu8(d, nine), d);
+    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(digit);
+    if (other != 0) {
+      return i + __builtin_ctz(other);
+    }
+  }
+  return i + count_digits_generic(chars + i, len - i);
+}
+
+// Four nodes at a time, the kinds and the numbers are split into separate
+// vectors. Sums aren't split into lanes, they would round differently.
+AVX2 static size_t fold_numbers_avx2(const AstNode *nodes, size_t len,
+                                     Reduction op, double &acc) {
+  if (op == Reduction::Sum || len < 4) {
+    return fold_numbers_generic(nodes, len, op, acc);
+  }
+  const __m256i kind_mask = _mm256_set1_epi64x(KIND_MASK);
+  const __m256i number = _mm256_set1_epi64x((long long)NodeKind::NUMBER);
+
+  __m256d lanes = _mm256_setzero_pd();
+  size_t i = 0;
+  for (; i + 4 <= len; i += 4) {
+    // packed and value of two nodes each
+    __m256i a = _mm256_loadu_si256((const __m256i *)(nodes + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(nodes + i + 2));
+    __m256i kinds =
+        _mm256_and_si256(_mm256_unpacklo_epi64(a, b), kind_mask);
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi64(kinds, number)) != -1) {
+      break;
+    }
+    __m256d values = _mm256_castsi256_pd(_mm256_unpackhi_epi64(a, b));
+    // a NaN would stick in its lane where the scalar loop skips it, the
+    // scalar loop goes on from this block
+    if (_mm256_movemask_pd(_mm256_cmp_pd(values, values, _CMP_UNORD_Q)) != 0) {
+      break;
+    }
+    if (i == 0) {
+      lanes = values;
+      continue;
+    }
+    __m256d replace = op == Reduction::Max
+                          ? _mm256_cmp_pd(lanes, values, _CMP_LT_OQ)
+                          : _mm256_cmp_pd(lanes, values, _CMP_GT_OQ);
+    lanes = _mm256_blendv_pd(lanes, values, replace);
+  }
+  if (i == 0) {
+    return fold_numbers_generic(nodes, len, op, acc);
+  }
+  double stored[4];
+  _mm256_storeu_pd(stored, lanes);
+  return finish_fold(stored, 4, nodes, i, len, op, acc);
+}
+
+// AVX-512, 64 bytes at a time, the tail is read with a masked load which
+// doesn't touch the bytes past the end
+
+#define AVX512 __attribute__((target("avx512f,avx512bw,avx2,bmi,bmi2")))
+
+template <typename F>
+AVX512 static inline size_t scan_avx512(const char *chars, size_t len,
+                                        F stop_mask) {
+  size_t i = 0;
+  for (; i < len; i += 64) {
+    size_t n = len - i < 64 ? len - i : 64;
+    __mmask64 valid = _bzhi_u64(~0ull, (unsigned)n);
+    __m512i c = _mm512_maskz_loadu_epi8(valid, chars + i);
+    uint64_t stop = stop_mask(c) & valid;
+    if (stop != 0) {
+      return i + __builtin_ctzll(stop);
+    }
+  }
+  return len;
+}
+
+AVX512 static size_t skip_whitespace_avx512(const char *chars, size_t len) {
+  return scan_avx512(chars, len, [](__m512i c) AVX512 {
+    __mmask64 ws = _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8(' ')) |
+                   _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8('\t')) |
+                   _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8('\n')) |
+                   _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8('\r'));
+    return (uint64_t)~ws;
+  });
+}
+
+// Validating takes byte shuffles across the whole vector, so from the first
+// non ascii byte on the rest is left to the AVX2 code
+AVX512 static size_t scan_string_avx512(const char *chars, size_t len) {
+  size_t i = 0;
+  for (; i < len; i += 64) {
+    size_t n = len - i < 64 ? len - i : 64;
+    __mmask64 valid = _bzhi_u64(~0ull, (unsigned)n);
+    __m512i c = _mm512_maskz_loadu_epi8(valid, chars + i);
+    if ((_mm512_movepi8_mask(c) & valid) != 0) {
+      return i + scan_string_avx2(chars + i, len - i);
+    }
+    uint64_t stop = _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8('"')) |
+                    _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8('\\')) |
+                    _mm512_cmple_epu8_mask(c, _mm512_set1_epi8(0x1f));
+    stop &= valid;
+    if (stop != 0) {
+      return i + __builtin_ctzll(stop);
+    }
+  }
+  return len;
+}
+
+AVX512 static size_t count_digits_avx512(const char *chars, size_t len) {
+  return scan_avx512(chars, len, [](__m512i c) AVX512 {
+    __m512i d = _mm512_sub_epi8(c, _mm512_set1_epi8('0'));
+    return (uint64_t)~_mm512_cmple_epu8_mask(d, _mm512_set1_epi8(9));
+  });
+}
+
+// Eight nodes at a time, like fold_numbers_avx2()
+AVX512 static size_t fold_numbers_avx512(const AstNode *nodes, size_t len,
+                                         Reduction op, double &acc) {
+  if (op == Reduction::Sum || len < 8) {
+    return fold_numbers_avx2(nodes, len, op, acc);
+  }
+  const __m512i kind_mask = _mm512_set1_epi64(KIND_MASK);
+  const __m512i number = _mm512_set1_epi64((long long)NodeKind::NUMBER);
+
+  __m512d lanes = _mm512_setzero_pd();
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    __m512i a = _mm512_loadu_si512(nodes + i);
+    __m512i b = _mm512_loadu_si512(nodes + i + 4);
+    // the unmasked unpacks trip -Wmaybe-uninitialized in gcc's headers
+    __m512i kinds = _mm512_and_si512(
+        _mm512_maskz_unpacklo_epi64(0xff, a, b), kind_mask);
+    if (_mm512_cmpeq_epi64_mask(kinds, number) != 0xff) {
+      break;
+    }
+    __m512d values =
+        _mm512_castsi512_pd(_mm512_maskz_unpackhi_epi64(0xff, a, b));
+    if (_mm512_cmp_pd_mask(values, values, _CMP_UNORD_Q) != 0) {
+      break;
+    }
+    if (i == 0) {
+      lanes = values;
+      continue;
+    }
+    __mmask8 replace = op == Reduction::Max
+                           ? _mm512_cmp_pd_mask(lanes, values, _CMP_LT_OQ)
+                           : _mm512_cmp_pd_mask(lanes, values, _CMP_GT_OQ);
+    lanes = _mm512_mask_blend_pd(replace, lanes, values);
+  }
+  if (i == 0) {
+    return fold_numbers_avx2(nodes, len, op, acc);
+  }
+  double stored[8];
+  _mm512_storeu_pd(stored, lanes);
+  return finish_fold(stored, 8, nodes, i, len, op, acc);
+}
+
+#endif
+
+static const Kernels GENERIC{"generic", skip_whitespace_generic,
+                             scan_string_generic, count_digits_generic,
+                             fold_numbers_generic};
+
+#ifdef CPU_X86
+// the numbers only benefit from wider vectors
+static const Kernels SSE42_KERNELS{"sse42", skip_whitespace_sse42,
+                                   scan_string_sse42, count_digits_sse42,
+                                   fold_numbers_generic};
+static const Kernels AVX2_KERNELS{"avx2", skip_whitespace_avx2,
+                                  scan_string_avx2, count_digits_avx2,
+                                  fold_numbers_avx2};
+static const Kernels AVX512_KERNELS{"avx512", skip_whitespace_avx512,
+                                    scan_string_avx512, count_digits_avx512,
+                                    fold_numbers_avx512};
+#endif
+
+std::vector<const Kernels *> supported_kernels() {
+  std::vector<const Kernels *> result{&GENERIC};
+#ifdef CPU_X86
+  CpuFeatures features = detect_cpu();
+  if (features.sse42) {
+    result.push_back(&SSE42_KERNELS);
+  }
+  if (features.avx2 && features.bmi2) {
+    result.push_back(&AVX2_KERNELS);
+    if (features.avx512) {
+      result.push_back(&AVX512_KERNELS);
+    }
+  }
+#endif
+  return result;
+}
+
+const Kernels *active_kernels = supported_kernels().back();
+
+bool select_kernels(const char *name, const char *&error) {
+  for (const Kernels *variant : supported_kernels()) {
+    if (strcmp(variant->name, name) == 0) {
+      active_kernels = variant;
+      return true;
+    }
+  }
+  bool known = false;
+  for (const char *variant : {"generic", "sse42", "avx2", "avx512"}) {
+    known |= strcmp(variant, name) == 0;
+  }
+  error =
+      known ? "The cpu doesn't support this variant" : "Unknown cpu variant";
+  return false;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+// Vectorized kernels for the hot loops, picked for the cpu at runtime.
+//
+// The build targets the baseline instruction set, so one binary runs on every
+// machine. Each kernel is compiled once more per instruction set with target
+// attributes, and the best set the cpu supports is selected on startup. All
+// variants give the same results, down to the bit.
+
+#include "ast.h"
+
+#include <cstddef>
+#include <vector>
+
+struct CpuFeatures {
+  bool sse42;
+  bool avx2;
+  bool bmi2;
+  // AVX-512 F and BW, the byte compares need BW
+  bool avx512;
+};
+
+CpuFeatures detect_cpu();
+
+enum class Reduction { Max, Min, Sum };
+
+struct Kernels {
+  const char *name;
+  // Length of the prefix of json whitespace
+  size_t (*skip_whitespace)(const char *chars, size_t len);
+  // Length of the prefix which is copied into a string as it is, up to a
+  // quote, a backslash, a control character or bytes which aren't valid
+  // UTF-8. The prefix only has whole UTF-8 sequences, one which is cut off by
+  // the end isn't included.
+  size_t (*scan_string)(const char *chars, size_t len);
+  // Length of the prefix of decimal digits
+  size_t (*count_digits)(const char *chars, size_t len);
+  // Reduces the leading number nodes into `acc` and returns how many there
+  // were, `acc` is only set if there was one. Sums are added in order in every
+  // variant.
+  size_t (*fold_numbers)(const AstNode *nodes, size_t len, Reduction op,
+                         double &acc);
+};
+
+// The length of the UTF-8 sequence starting with `lead`, 0 if no sequence
+// starts with it, and the range of the byte after it. The ranges leave out
+// overlong encodings, surrogates and code points past U+10FFFF.
+struct Utf8Lead {
+  int len;
+  int lower;
+  int upper;
+};
+
+Utf8Lead utf8_lead(int lead);
+
+// The variants the cpu can run, the best one last
+std::vector<const Kernels *> supported_kernels();
+
+extern const Kernels *active_kernels;
+
+inline const Kernels &kernels() { return *active_kernels; }
+
+// Uses the variant called `name` instead of the detected one, e.g. to test
+// each of them. Must be called before any parsing or evaluation starts.
+// Returns false and sets `error` if there is no such variant or the cpu
+// doesn't support it.
+bool select_kernels(const char *name, const char *&error);
@@ -0,0 +1,241 @@
+#include "decompress.h"
+
+#include <cstdint>
+#include <cstring>
+
+#ifdef JSON_EVAL_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef JSON_EVAL_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+Compression detect_compression(std::span<const char> start) {
+  static const uint8_t gzip_magic[] = {0x1f, 0x8b};
+  static const uint8_t zstd_magic[] = {0x28, 0xb5, 0x2f, 0xfd};
+
+  if (start.size() >= sizeof(gzip_magic) &&
+      std::memcmp(start.data(), gzip_magic, sizeof(gzip_magic)) == 0) {
+    return Compression::GZIP;
+  }
+  if (start.size() >= sizeof(zstd_magic) &&
+      std::memcmp(start.data(), zstd_magic, sizeof(zstd_magic)) == 0) {
+    return Compression::ZSTD;
+  }
+  return Compression::NONE;
+}
+
+bool compression_supported(Compression compression) {
+  switch (compression) {
+  case Compression::NONE:
+    return true;
+  case Compression::GZIP:
+#ifdef JSON_EVAL_HAVE_ZLIB
+    return true;
+#else
+    return false;
+#endif
+  case Compression::ZSTD:
+#ifdef JSON_EVAL_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+  }
+  return false;
+}
+
+DecompressSource::DecompressSource(std::unique_ptr<InputSource> upstream,
+                                   std::span<const char> first,
+                                   Compression compression,
+                                   ReadAheadOptions options)
+    : upstream(std::move(upstream)), first(first), compression(compression),
+      ring(options.buffers, options.buffer_size), decompress_error(nullptr) {
+  worker = std::thread([this]() {
+    if (this->compression == Compression::GZIP) {
+      gzip_main();
+    } else {
+      zstd_main();
+    }
+    ring.finish();
+  });
+}
+
+DecompressSource::~DecompressSource() {
+  ring.close();
+  worker.join();
+}
+
+const char *DecompressSource::error() const {
+  if (decompress_error != nullptr) {
+    return decompress_error;
+  }
+  return upstream->error();
+}
+
+std::span<const char> DecompressSource::next_input() {
+  if (!first.empty()) {
+    std::span<const char> chunk = first;
+    first = {};
+    return chunk;
+  }
+  return upstream->next_chunk();
+}
+
+void DecompressSource::gzip_main() {
+#ifdef JSON_EVAL_HAVE_ZLIB
+  z_stream stream{};
+  // +32 detects both gzip and zlib headers
+  if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+    decompress_error = "Failed to initialize zlib";
+    return;
+  }
+
+  std::span<char> out = ring.begin_write();
+  size_t out_len = 0;
+  bool in_member = true;
+
+  while (!out.empty()) {
+    if (stream.avail_in == 0) {
+      std::span<const char> input = next_input();
+      if (input.empty()) {
+        if (in_member) {
+          decompress_error = "Unexpected end of gzip stream";
+        }
+        break;
+      }
+      stream.next_in = (Bytef *)input.data();
+      stream.avail_in = (uInt)input.size();
+      if (!in_member) {
+        // concatenated gzip members are a valid gzip file
+        inflateReset(&stream);
+        in_member = true;
+      }
+    }
+
+    stream.next_out = (Bytef *)out.data() + out_len;
+    stream.avail_out = (uInt)(out.size() - out_len);
+    int ret = inflate(&stream, Z_NO_FLUSH);
+    out_len = out.size() - stream.avail_out;
+
+    if (ret == Z_STREAM_END) {
+      in_member = false;
+      if (stream.avail_in > 0) {
+        inflateReset(&stream);
+        in_member = true;
+      }
+    } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+      decompress_error = "Invalid gzip data";
+      break;
+    }
+
+    if (out_len == out.size()) {
+      ring.end_write(out_len);
+      out = ring.begin_write();
+      out_len = 0;
+    }
+  }
+
+  if (out_len > 0) {
+    ring.end_write(out_len);
+  }
+  inflateEnd(&stream);
+#else
+  decompress_error = "This build doesn't support gzip";
+#endif
+}
+
+void DecompressSource::zstd_main() {
+#ifdef JSON_EVAL_HAVE_ZSTD
+  ZSTD_DStream *stream = ZSTD_createDStream();
+  ZSTD_initDStream(stream);
+
+  std::span<char> out = ring.begin_write();
+  ZSTD_outBuffer output = {out.data(), out.size(), 0};
+  ZSTD_inBuffer input = {nullptr, 0, 0};
+  // zero once a frame has been completely decoded
+  size_t hint = 1;
+
+  while (!out.empty()) {
+    if (input.pos == input.size) {
+      std::span<const char> chunk = next_input();
+      if (chunk.empty()) {
+        if (hint != 0) {
+          decompress_error = "Unexpected end of zstd stream";
+        }
+        break;
+      }
+      input = {chunk.data(), chunk.size(), 0};
+    }
+
+    hint = ZSTD_decompressStream(stream, &output, &input);
+    if (ZSTD_isError(hint)) {
+      decompress_error = "Invalid zstd data";
+      break;
+    }
+
+    if (output.pos == output.size) {
+      ring.end_write(output.pos);
+      out = ring.begin_write();
+      output = {out.data(), out.size(), 0};
+    }
+  }
+
+  if (!out.empty() && output.pos > 0) {
+    ring.end_write(output.pos);
+  }
+  ZSTD_freeDStream(stream);
+#else
+  decompress_error = "This build doesn't support zstd";
+#endif
+}
+
+namespace {
+// Hands out a chunk which was already taken from the upstream to look at it,
+// then continues with the upstream
+class PeekedSource : public InputSource {
+  std::unique_ptr<InputSource> upstream;
+  std::span<const char> first;
+
+public:
+  PeekedSource(std::unique_ptr<InputSource> upstream,
+               std::span<const char> first)
+      : upstream(std::move(upstream)), first(first) {}
+
+  std::span<const char> next_chunk() override {
+    if (!first.empty()) {
+      std::span<const char> chunk = first;
+      first = {};
+      return chunk;
+    }
+    return upstream->next_chunk();
+  }
+  const char *error() const override { return upstream->error(); }
+};
+} // namespace
+
+std::unique_ptr<InputSource> open_input(const char *path,
+                                        ReadAheadOptions options,
+                                        const char *&error) {
+  std::unique_ptr<InputSource> file = ReadAheadSource::open(path, options);
+  if (!file) {
+    error = "Couldn't open file";
+    return nullptr;
+  }
+
+  // read ahead buffers are always filled completely and are longer than the
+  // magic bytes, unless the whole file is shorter
+  std::span<const char> first = file->next_chunk();
+  Compression compression = detect_compression(first);
+  if (compression == Compression::NONE) {
+    return std::make_unique<PeekedSource>(std::move(file), first);
+  }
+  if (!compression_supported(compression)) {
+    error = compression == Compression::GZIP
+                ? "The file is gzip compressed, this build has no zlib"
+                : "The file is zstd compressed, this build has no zstd";
+    return nullptr;
+  }
+  return std::make_unique<DecompressSource>(std::move(file), first,
+                                            compression, options);
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "input.h"
+
+#include <memory>
+#include <span>
+#include <thread>
+
+enum class Compression {
+  NONE,
+  GZIP,
+  ZSTD,
+};
+
+// Recognizes the magic bytes at the start of a compressed stream
+Compression detect_compression(std::span<const char> start);
+
+// Whether this build can decompress the format
+bool compression_supported(Compression compression);
+
+// Decompresses another source on a separate thread, into a ring of buffers
+// which the parser consumes while the next ones are being decompressed.
+class DecompressSource : public InputSource {
+  std::unique_ptr<InputSource> upstream;
+  // already read from the upstream when detecting the format
+  std::span<const char> first;
+  Compression compression;
+  ChunkRing ring;
+  const char *decompress_error;
+  std::thread worker;
+
+  void gzip_main();
+  void zstd_main();
+
+  // The next piece of compressed input, empty at the end
+  std::span<const char> next_input();
+
+public:
+  DecompressSource(std::unique_ptr<InputSource> upstream,
+                   std::span<const char> first, Compression compression,
+                   ReadAheadOptions options = {});
+  ~DecompressSource() override;
+
+  std::span<const char> next_chunk() override { return ring.next_read(); }
+  const char *error() const override;
+};
+
+// Opens a file for parsing, read ahead on a separate thread. Compressed files
+// are recognized by their magic bytes and decompressed on the fly. Returns
+// nullptr and sets `error` if the file can't be opened or read.
+std::unique_ptr<InputSource> open_input(const char *path,
+                                        ReadAheadOptions options,
+                                        const char *&error);
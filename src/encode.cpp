@@ -0,0 +1,192 @@
+#include "encode.h"
+
+#include <cassert>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+static void append_big_endian(std::string &out, uint64_t value, int bytes) {
+  for (int i = bytes - 1; i >= 0; i--) {
+    out.push_back((char)(value >> (i * 8)));
+  }
+}
+
+void Encoder::cbor_head(int major, uint64_t argument) {
+  int type = major << 5;
+  if (argument < 24) {
+    out.push_back((char)(type | (int)argument));
+  } else if (argument <= UINT8_MAX) {
+    out.push_back((char)(type | 24));
+    append_big_endian(out, argument, 1);
+  } else if (argument <= UINT16_MAX) {
+    out.push_back((char)(type | 25));
+    append_big_endian(out, argument, 2);
+  } else if (argument <= UINT32_MAX) {
+    out.push_back((char)(type | 26));
+    append_big_endian(out, argument, 4);
+  } else {
+    out.push_back((char)(type | 27));
+    append_big_endian(out, argument, 8);
+  }
+}
+
+void Encoder::msgpack_uint(uint64_t value) {
+  if (value <= 0x7f) {
+    out.push_back((char)value);
+  } else if (value <= UINT8_MAX) {
+    out.push_back((char)0xcc);
+    append_big_endian(out, value, 1);
+  } else if (value <= UINT16_MAX) {
+    out.push_back((char)0xcd);
+    append_big_endian(out, value, 2);
+  } else if (value <= UINT32_MAX) {
+    out.push_back((char)0xce);
+    append_big_endian(out, value, 4);
+  } else {
+    out.push_back((char)0xcf);
+    append_big_endian(out, value, 8);
+  }
+}
+
+void Encoder::msgpack_int(int64_t value) {
+  if (value >= 0) {
+    msgpack_uint((uint64_t)value);
+  } else if (value >= -32) {
+    out.push_back((char)value);
+  } else if (value >= INT8_MIN) {
+    out.push_back((char)0xd0);
+    append_big_endian(out, (uint64_t)value, 1);
+  } else if (value >= INT16_MIN) {
+    out.push_back((char)0xd1);
+    append_big_endian(out, (uint64_t)value, 2);
+  } else if (value >= INT32_MIN) {
+    out.push_back((char)0xd2);
+    append_big_endian(out, (uint64_t)value, 4);
+  } else {
+    out.push_back((char)0xd3);
+    append_big_endian(out, (uint64_t)value, 8);
+  }
+}
+
+void Encoder::msgpack_sized(int type16, uint64_t len) {
+  if (len <= UINT16_MAX) {
+    out.push_back((char)type16);
+    append_big_endian(out, len, 2);
+  } else {
+    out.push_back((char)(type16 + 1));
+    append_big_endian(out, len, 4);
+  }
+}
+
+void Encoder::nil() {
+  out.push_back(format == OutputFormat::CBOR ? (char)0xf6 : (char)0xc0);
+}
+
+void Encoder::boolean(bool value) {
+  if (format == OutputFormat::CBOR) {
+    out.push_back(value ? (char)0xf5 : (char)0xf4);
+  } else {
+    out.push_back(value ? (char)0xc3 : (char)0xc2);
+  }
+}
+
+void Encoder::number(double value) {
+  // integers which a double holds exactly, -0 stays a double
+  if (value == std::trunc(value) && std::fabs(value) < 9007199254740992.0 &&
+      !(value == 0 && std::signbit(value))) {
+    int64_t integer = (int64_t)value;
+    if (format == OutputFormat::MSGPACK) {
+      msgpack_int(integer);
+    } else if (integer >= 0) {
+      cbor_head(0, (uint64_t)integer);
+    } else {
+      cbor_head(1, (uint64_t)(-1 - integer));
+    }
+    return;
+  }
+
+  uint64_t bits;
+  std::memcpy(&bits, &value, sizeof(bits));
+  out.push_back(format == OutputFormat::CBOR ? (char)0xfb : (char)0xcb);
+  append_big_endian(out, bits, 8);
+}
+
+void Encoder::string(std::string_view value) {
+  if (format == OutputFormat::CBOR) {
+    cbor_head(3, value.size());
+  } else if (value.size() < 32) {
+    out.push_back((char)(0xa0 | value.size()));
+  } else if (value.size() <= UINT8_MAX) {
+    out.push_back((char)0xd9);
+    append_big_endian(out, value.size(), 1);
+  } else {
+    msgpack_sized(0xda, value.size());
+  }
+  out.append(value);
+}
+
+void Encoder::array(size_t len) {
+  if (format == OutputFormat::CBOR) {
+    cbor_head(4, len);
+  } else if (len < 16) {
+    out.push_back((char)(0x90 | len));
+  } else {
+    msgpack_sized(0xdc, len);
+  }
+}
+
+void Encoder::map(size_t pairs) {
+  if (format == OutputFormat::CBOR) {
+    cbor_head(5, pairs);
+  } else if (pairs < 16) {
+    out.push_back((char)(0x80 | pairs));
+  } else {
+    msgpack_sized(0xde, pairs);
+  }
+}
+
+void Encoder::json(AstNode node, Arena &arena) {
+  // the children left to write of the containers being written, the
+  // document can be nested deeper than the call stack allows
+  std::vector<std::span<AstNode>> pending;
+  while (true) {
+    switch (node.get_kind()) {
+    case NodeKind::STRING:
+      string(arena.as_string_like(node).value());
+      break;
+    case NodeKind::NUMBER:
+      number(node.get_value().number);
+      break;
+    case NodeKind::BOOLEAN:
+      boolean(node.get_value().boolean);
+      break;
+    case NodeKind::OBJECT:
+    case NodeKind::ARRAY: {
+      // an object's length counts keys and values
+      if (node.get_kind() == NodeKind::OBJECT) {
+        map(node.get_data() / 2);
+      } else {
+        array(node.get_data());
+      }
+      std::span<AstNode> children = arena.as_array_like(node).value();
+      if (!children.empty()) {
+        pending.push_back(children);
+      }
+      break;
+    }
+    default:
+      // null, and error nodes of documents with syntax errors
+      nil();
+      break;
+    }
+
+    while (!pending.empty() && pending.back().empty()) {
+      pending.pop_back();
+    }
+    if (pending.empty()) {
+      return;
+    }
+    node = pending.back().front();
+    pending.back() = pending.back().subspan(1);
+  }
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+// Binary encodings of results, so that consumers don't have to parse text.
+//
+// Json values are written straight from the arena, the length prefixes of
+// containers and strings are the lengths the nodes already have. Numbers
+// which are integers are written as integers, others as doubles.
+
+#include "ast.h"
+
+#include <string>
+#include <string_view>
+
+enum class OutputFormat {
+  // the debug output of the cli
+  TEXT,
+  // RFC 8949
+  CBOR,
+  MSGPACK,
+};
+
+// Appends values to `out`, the format is CBOR or MSGPACK
+class Encoder {
+  OutputFormat format;
+  std::string &out;
+
+  void cbor_head(int major, uint64_t argument);
+  void msgpack_uint(uint64_t value);
+  void msgpack_int(int64_t value);
+  // the 16 bit type with its length, or the 32 bit one which follows it
+  void msgpack_sized(int type16, uint64_t len);
+
+public:
+  Encoder(OutputFormat format, std::string &out) : format(format), out(out) {}
+
+  void nil();
+  void boolean(bool value);
+  void number(double value);
+  void string(std::string_view value);
+  // the header of an array, the elements follow
+  void array(size_t len);
+  // the header of a map, the keys and values follow
+  void map(size_t pairs);
+
+  // A json value of the arena with everything below it
+  void json(AstNode node, Arena &arena);
+};
@@ -1,9 +1,15 @@
 #include "eval.h"
+#include "cpu.h"
+#include "sequence.h"
+#include "sort.h"
+
 #include <iostream>
+#include <optional>
+#include <unordered_map>
 
 template <typename F>
 Value fold(AstNode expression, Evaluator &ev, F function) {
-  std::span<AstNode> args = ev.arena.as_array_like(expression).value();
+  std::span<AstNode> args = ev.query.as_array_like(expression).value();
   auto begin = args.begin();
   auto end = args.end();
 
@@ -11,25 +17,270 @@ Value fold(AstNode expression, Evaluator &ev, F function) {
     return Value::nil();
   }
 
+  auto is_collection = [](const Value &value) {
+    return value.get_kind() == ValueKind::SEQUENCE ||
+           value.get_kind() == ValueKind::LIST;
+  };
+
   Value first = eval(*begin++, ev);
-  for (; begin != end; ++begin) {
+  for (; begin != end && !ev.over_budget; ++begin) {
     Value next = eval(*begin, ev);
+    // sequences would be returned unchanged, or dropped on the right
+    if (is_collection(first) || is_collection(next)) {
+      ev.error("Arithmetic can't be applied to a sequence");
+      return Value::error();
+    }
+    if (next.get_kind() == ValueKind::STRING) {
+      // concatenation copies it once more
+      ev.allocate(next.get_data().string.size());
+    }
     function(first, next);
   }
 
   return first;
 }
 
-Value eval(AstNode expression, Evaluator &ev) {
+struct PartialResult {
+  std::optional<Value> value;
+  std::vector<EvalError> errors;
+};
+
+template <typename F>
+void accumulate(std::optional<Value> &acc, Value next, F function) {
+  if (acc.has_value()) {
+    function(*acc, next);
+  } else {
+    acc = std::move(next);
+  }
+}
+
+// Reduces the nodes produced by `visit(begin, end, ev, emit)` for the range
+// [0, len), large ranges are split into chunks which are reduced on the
+// thread pool.
+template <typename F, typename Visit>
+std::optional<Value> reduce_nodes(size_t len, Evaluator &ev, Visit visit,
+                                  F function) {
+  auto map = [&](size_t begin, size_t end) {
+    Evaluator local = ev.fork();
+    PartialResult partial;
+    auto emit = [&](AstNode node) {
+      Value value = from_json(node, local.arena);
+      if (value.get_kind() == ValueKind::STRING) {
+        local.pending.allocated++;
+        local.allocate(value.get_data().string.size());
+      }
+      accumulate(partial.value, std::move(value), function);
+    };
+    visit(begin, end, local, emit);
+    local.flush_profile();
+    local.flush_budget();
+    partial.errors = std::move(local.errors);
+    return partial;
+  };
+  auto combine = [&](PartialResult &acc, PartialResult &next) {
+    if (next.value.has_value()) {
+      accumulate(acc.value, std::move(*next.value), function);
+    }
+    acc.errors.insert(acc.errors.end(), next.errors.begin(), next.errors.end());
+  };
+
+  PartialResult result =
+      parallel_reduce<PartialResult>(ev.parallel, len, map, combine);
+
+  ev.errors.insert(ev.errors.end(), result.errors.begin(), result.errors.end());
+  return std::move(result.value);
+}
+
+// Runs of numbers are reduced by the kernel for `op` if it's given, which is
+// the same as `function` for numbers
+template <typename F>
+std::optional<Value> reduce_array(AstNode array, Evaluator &ev, F function,
+                                  std::optional<Reduction> op) {
+  std::span<AstNode> elements = ev.arena.as_array_like(array).value();
+  auto visit = [&](size_t begin, size_t end, Evaluator &local, auto &emit) {
+    for (size_t i = begin; i < end;) {
+      // sums only from the start of the chunk, later runs would be added in a
+      // different order
+      if (op.has_value() && (*op != Reduction::Sum || i == begin)) {
+        double acc;
+        size_t n = kernels().fold_numbers(elements.data() + i, end - i, *op,
+                                          acc);
+        if (n > 0) {
+          emit(AstNode::number(acc));
+          i += n;
+          // a whole run counts at once, budgets are checked between runs
+          if (!local.step(n)) {
+            return;
+          }
+          continue;
+        }
+      }
+      if (!local.step()) {
+        return;
+      }
+      emit(elements[i++]);
+    }
+  };
+  return reduce_nodes(elements.size(), ev, visit, function);
+}
+
+// The whole projection runs as a single pass over the source array, the
+// reduction is applied directly to the nodes coming out of the pipeline.
+template <typename F>
+std::optional<Value> reduce_sequence(AstNode sequence, Evaluator &ev,
+                                     F function) {
+  std::optional<Pipeline> pipeline = compile_pipeline(sequence, ev);
+  if (!pipeline.has_value()) {
+    return {};
+  }
+  std::optional<PipelineSource> source = pipeline_source(*pipeline, ev);
+  if (!source.has_value()) {
+    return {};
+  }
+
+  auto visit = [&](size_t begin, size_t end, Evaluator &local, auto &emit) {
+    run_slice(*pipeline, 0, source->elements, source->bounds, begin, end,
+              local, emit);
+  };
+  return reduce_nodes(source->bounds.count, ev, visit, function);
+}
+
+// Number of nodes produced by a sequence, nothing if walking it reported an
+// error such as a budget running out
+std::optional<size_t> sequence_count(AstNode sequence, Evaluator &ev) {
+  std::optional<Pipeline> pipeline = compile_pipeline(sequence, ev);
+  if (!pipeline.has_value()) {
+    return {};
+  }
+  std::optional<PipelineSource> source = pipeline_source(*pipeline, ev);
+  if (!source.has_value()) {
+    return {};
+  }
+
+  // no need to walk anything if the slice is the only step
+  if (pipeline->steps.size() == 1) {
+    return source->bounds.count;
+  }
+
+  struct PartialCount {
+    size_t count = 0;
+    std::vector<EvalError> errors;
+  };
+  auto map = [&](size_t begin, size_t end) {
+    Evaluator local = ev.fork();
+    PartialCount partial;
+    auto emit = [&](AstNode) { partial.count++; };
+    run_slice(*pipeline, 0, source->elements, source->bounds, begin, end,
+              local, emit);
+    local.flush_profile();
+    local.flush_budget();
+    partial.errors = std::move(local.errors);
+    return partial;
+  };
+  auto combine = [](PartialCount &acc, PartialCount &next) {
+    acc.count += next.count;
+    acc.errors.insert(acc.errors.end(), next.errors.begin(), next.errors.end());
+  };
+
+  PartialCount result = parallel_reduce<PartialCount>(
+      ev.parallel, source->bounds.count, map, combine);
+  if (!result.errors.empty()) {
+    ev.errors.insert(ev.errors.end(), result.errors.begin(),
+                     result.errors.end());
+    return {};
+  }
+  return result.count;
+}
+
+// The vector kernel reduction of Max, Min and Sum
+static std::optional<Reduction> number_reduction(NodeKind kind) {
+  switch (kind) {
+  case NodeKind::Max:
+    return Reduction::Max;
+  case NodeKind::Min:
+    return Reduction::Min;
+  case NodeKind::Sum:
+    return Reduction::Sum;
+  default:
+    return {};
+  }
+}
+
+// Like fold, but arguments which evaluate to json arrays or sequences
+// contribute their elements instead of the array itself, `max(a.b)` is the
+// largest element.
+template <typename F>
+Value fold_elements(AstNode expression, Evaluator &ev, F function) {
+  std::span<AstNode> args = ev.query.as_array_like(expression).value();
+  std::optional<Reduction> op = number_reduction(expression.get_kind());
+
+  std::optional<Value> acc;
+  for (AstNode arg : args) {
+    Value value = eval(arg, ev);
+    std::optional<Value> partial;
+    if (value.get_kind() == ValueKind::SEQUENCE) {
+      partial = reduce_sequence(value.get_data().sequence, ev, function);
+    } else if (value.get_kind() == ValueKind::JSON &&
+               value.get_data().json.get_kind() == NodeKind::ARRAY) {
+      partial = reduce_array(value.get_data().json, ev, function, op);
+    } else if (value.get_kind() == ValueKind::LIST) {
+      for (AstNode node : value.get_data().list) {
+        if (!ev.step()) {
+          break;
+        }
+        accumulate(partial, json_value(node, ev), function);
+      }
+    } else {
+      accumulate(acc, std::move(value), function);
+      continue;
+    }
+    if (partial.has_value()) {
+      accumulate(acc, std::move(*partial), function);
+    }
+  }
+
+  if (acc.has_value()) {
+    return std::move(*acc);
+  }
+  return Value::nil();
+}
+
+Value json_value(AstNode node, Evaluator &ev) {
+  if (node.get_kind() == NodeKind::STRING) {
+    ev.allocate(node.get_data());
+  }
+  return from_json(node, ev.arena);
+}
+
+Value from_json(AstNode node, Arena &arena) {
+  switch (node.get_kind()) {
+  case NodeKind::STRING:
+    return Value::string(arena.as_string_like(node).value());
+  case NodeKind::NUMBER:
+    return Value::number(node.get_value().number);
+  case NodeKind::BOOLEAN:
+    return Value::boolean(node.get_value().boolean);
+  case NodeKind::OBJECT:
+  case NodeKind::ARRAY:
+    return Value::json(node);
+  case NodeKind::NIL:
+    return Value::nil();
+  default:
+    return Value::error();
+  }
+}
+
+static Value eval_node(AstNode expression, Evaluator &ev) {
   switch (expression.get_kind()) {
   case NodeKind::ERROR:
     return Value::error();
   case NodeKind::STRING:
-    return Value::string(ev.arena.as_string_like(expression).value());
+    ev.allocate(expression.get_data());
+    return Value::string(ev.query.as_string_like(expression).value());
   case NodeKind::NUMBER:
-    return Value::number(ev.arena.as_number(expression).value());
+    return Value::number(ev.query.as_number(expression).value());
   case NodeKind::BOOLEAN:
-    return Value::boolean(ev.arena.as_boolean(expression).value());
+    return Value::boolean(ev.query.as_boolean(expression).value());
   case NodeKind::OBJECT:
   case NodeKind::ARRAY:
     return Value::json(expression);
@@ -40,36 +291,129 @@ Value eval(AstNode expression, Evaluator &ev) {
   case NodeKind::Sub:
     return fold(expression, ev, Value::sub);
   case NodeKind::Mul:
-    return fold(expression, ev, Value::sub);
+    return fold(expression, ev, Value::mul);
   case NodeKind::Div:
-    return fold(expression, ev, Value::sub);
+    return fold(expression, ev, Value::div);
   case NodeKind::Eq:
-    return fold(expression, ev, Value::eq);
+  case NodeKind::Ne:
+  case NodeKind::Lt:
+  case NodeKind::Le:
+  case NodeKind::Gt:
+  case NodeKind::Ge:
+    return builtin_compare(expression, ev);
+  case NodeKind::And:
+  case NodeKind::Or:
+    return builtin_logical(expression, ev);
   case NodeKind::Max:
-    return fold(expression, ev, Value::max);
+    return fold_elements(expression, ev, Value::max);
   case NodeKind::Min:
-    return fold(expression, ev, Value::min);
+    return fold_elements(expression, ev, Value::min);
+  case NodeKind::Sum:
+    return fold_elements(expression, ev, Value::add);
   case NodeKind::Size:
     return builtin_size(expression, ev);
+  case NodeKind::Distinct:
+    return builtin_distinct(expression, ev);
+  case NodeKind::Sort:
+  case NodeKind::SortBy:
+    return builtin_sort(expression, ev);
+  case NodeKind::TopK:
+  case NodeKind::BottomK:
+    return builtin_topk(expression, ev);
   case NodeKind::Subscript:
     return builtin_subscript(expression, ev);
+  case NodeKind::Slice:
+  case NodeKind::Filter:
+    return Value::sequence(expression);
   case NodeKind::Field:
     return builtin_field(expression, ev);
   case NodeKind::Identifier:
-    return map_lookup(ev.json_root, ev.arena.as_string_like(expression).value(),
+    return map_lookup(ev.json_root, ev.query.as_string_like(expression).value(),
                       ev);
+  case NodeKind::Param: {
+    size_t index = expression.get_data();
+    if (index == 0 || index > ev.params.size()) {
+      ev.error("Parameter is not bound");
+      return Value::error();
+    }
+    const Value &param = ev.params[index - 1];
+    if (param.get_kind() == ValueKind::STRING) {
+      ev.allocate(param.get_data().string.size());
+    }
+    return param;
+  }
   default:
     assert(0 && "Unhandled case");
   }
 }
 
+static Value eval_profiled(AstNode expression, Evaluator &ev) {
+  NodeProfile *node = ev.profile->find(expression);
+  if (node == nullptr) {
+    return eval_node(expression, ev);
+  }
+  node->calls.fetch_add(1, std::memory_order_relaxed);
+  ProfileScope scope(ev, node);
+  Value value = eval_node(expression, ev);
+  ev.pending.allocated += value.get_kind() == ValueKind::STRING ||
+                          value.get_kind() == ValueKind::LIST;
+  return value;
+}
+
+Value eval(AstNode expression, Evaluator &ev) {
+  if (ev.budget == nullptr) {
+    return ev.profile != nullptr ? eval_profiled(expression, ev)
+                                 : eval_node(expression, ev);
+  }
+
+  if (!ev.step()) {
+    return Value::error();
+  }
+  return ev.profile != nullptr ? eval_profiled(expression, ev)
+                               : eval_node(expression, ev);
+}
+
+BudgetState::BudgetState(EvalBudget limits) : limits(limits), deadline(0) {
+  if (limits.milliseconds > 0) {
+    deadline = Profile::now() + limits.milliseconds * 1000000;
+  }
+}
+
+std::optional<EvalError> BudgetState::add(size_t step_count,
+                                          size_t byte_count) {
+  size_t total_steps =
+      steps.fetch_add(step_count, std::memory_order_relaxed) + step_count;
+  size_t total_bytes =
+      bytes.fetch_add(byte_count, std::memory_order_relaxed) + byte_count;
+
+  EvalError error{EvalError::Kind::Runtime, nullptr};
+  if (limits.steps > 0 && total_steps > limits.steps) {
+    error = {EvalError::Kind::StepBudget, "Step budget exceeded"};
+  } else if (limits.bytes > 0 && total_bytes > limits.bytes) {
+    error = {EvalError::Kind::ByteBudget, "Memory budget exceeded"};
+  } else if (deadline > 0 && Profile::now() > deadline) {
+    error = {EvalError::Kind::TimeBudget, "Time budget exceeded"};
+  } else {
+    return {};
+  }
+
+  EvalError::Kind none = EvalError::Kind::Runtime;
+  if (exceeded.compare_exchange_strong(none, error.kind)) {
+    return error;
+  }
+  return {};
+}
+
 Value builtin_field(AstNode expression, Evaluator &ev) {
-  auto args = ev.arena.as_array_like(expression).value();
+  auto args = ev.query.as_array_like(expression).value();
+  if (is_sequence_expression(args[0], ev.query)) {
+    return Value::sequence(expression);
+  }
 
   Value l = eval(args[0], ev);
   Value r;
   if (args[1].get_kind() == NodeKind::Identifier) {
-    r = Value::string(ev.arena.as_string_like(args[1]).value());
+    r = Value::string(ev.query.as_string_like(args[1]).value());
   } else {
     r = eval(args[1], ev);
   }
@@ -97,16 +441,10 @@ Value map_lookup(AstNode json_map, std::string_view key, Evaluator &ev) {
     return Value::error();
   }
 
-  auto children = ev.arena.as_array_like(json_map).value();
-  for (size_t i = 0; i < children.size(); i += 2) {
-    AstNode child = children[i];
-    if (child.get_kind() == NodeKind::STRING) {
-      std::string_view name = ev.arena.as_string_like(child).value();
-      if (name.compare(key) == 0) {
-        AstNode value = children[i + 1];
-        return eval(value, ev);
-      }
-    }
+  std::optional<AstNode> value =
+      find_field(json_map, key, ev.arena, &ev.pending.visited);
+  if (value.has_value()) {
+    return json_value(*value, ev);
   }
 
   ev.error("Element not found in map");
@@ -114,11 +452,25 @@ Value map_lookup(AstNode json_map, std::string_view key, Evaluator &ev) {
 }
 
 Value builtin_subscript(AstNode expression, Evaluator &ev) {
-  auto args = ev.arena.as_array_like(expression).value();
+  auto args = ev.query.as_array_like(expression).value();
+  if (is_sequence_expression(args[0], ev.query)) {
+    return Value::sequence(expression);
+  }
 
   Value l = eval(args[0], ev);
   Value r = eval(args[1], ev);
 
+  if (l.get_kind() == ValueKind::LIST && r.get_kind() == ValueKind::NUMBER) {
+    std::vector<AstNode> &list = l.get_data().list;
+    double number = r.get_data().number;
+    if (!(number >= 0 && number < (double)list.size())) {
+      ev.error("Subscript out of range");
+      return Value::error();
+    }
+    ev.pending.visited++;
+    return json_value(list[(size_t)number], ev);
+  }
+
   if (l.get_kind() != ValueKind::JSON) {
     ev.error("Subscript can only be applied on json trees");
     return Value::error();
@@ -130,17 +482,221 @@ Value builtin_subscript(AstNode expression, Evaluator &ev) {
   }
 
   AstNode json = l.get_data().json;
-  size_t offset = (size_t)r.get_data().number;
+  double number = r.get_data().number;
 
   if (json.get_kind() == NodeKind::ARRAY) {
+    if (!(number >= 0 && number < (double)json.get_data())) {
+      ev.error("Subscript out of range");
+      return Value::error();
+    }
+    size_t offset = (size_t)number;
+    ev.pending.visited++;
     AstNode node = ev.arena.as_array_like(json).value()[offset];
-    return eval(node, ev);
+    return json_value(node, ev);
   } else {
     ev.error("Subscript can only be applied on json arrays");
     return Value::error();
   }
 }
 
+// False if the containers certainly differ, only kept hashes are used
+static bool same_hash(AstNode a, AstNode b, Arena &arena) {
+  std::optional<uint64_t> left = arena.stored_hash(a);
+  std::optional<uint64_t> right = arena.stored_hash(b);
+  return !left.has_value() || !right.has_value() || *left == *right;
+}
+
+bool json_equal(AstNode a, AstNode b, Arena &arena) {
+  // the pairs of nodes left to compare, the documents can be nested deeper
+  // than the call stack allows
+  std::vector<std::pair<AstNode, AstNode>> pending{{a, b}};
+  while (!pending.empty()) {
+    auto [left, right] = pending.back();
+    pending.pop_back();
+    if (left.get_kind() != right.get_kind()) {
+      return false;
+    }
+    // the same node, or the same range of children with dedup
+    if (left.same_bytes(right) && left.get_kind() != NodeKind::NUMBER) {
+      continue;
+    }
+    switch (left.get_kind()) {
+    case NodeKind::STRING:
+      if (arena.as_string_like(left).value() !=
+          arena.as_string_like(right).value()) {
+        return false;
+      }
+      break;
+    case NodeKind::NUMBER:
+      if (left.get_value().number != right.get_value().number) {
+        return false;
+      }
+      break;
+    case NodeKind::BOOLEAN:
+      if (left.get_value().boolean != right.get_value().boolean) {
+        return false;
+      }
+      break;
+    case NodeKind::NIL:
+      break;
+    case NodeKind::ARRAY: {
+      if (left.get_data() != right.get_data() ||
+          !same_hash(left, right, arena)) {
+        return false;
+      }
+      auto first = arena.as_array_like(left).value();
+      auto second = arena.as_array_like(right).value();
+      // pushed backwards so the elements are compared front to back
+      for (size_t i = first.size(); i-- > 0;) {
+        pending.push_back({first[i], second[i]});
+      }
+      break;
+    }
+    case NodeKind::OBJECT: {
+      if (left.get_data() != right.get_data() ||
+          !same_hash(left, right, arena)) {
+        return false;
+      }
+      // key order doesn't matter
+      auto children = arena.as_array_like(left).value();
+      for (size_t i = 0; i < children.size(); i += 2) {
+        std::string_view key = arena.as_string_like(children[i]).value();
+        std::optional<AstNode> other = find_field(right, key, arena);
+        if (!other.has_value()) {
+          return false;
+        }
+        pending.push_back({children[i + 1], *other});
+      }
+      break;
+    }
+    default:
+      return false;
+    }
+  }
+  return true;
+}
+
+bool compare_values(NodeKind op, const Value &a, const Value &b,
+                    Arena &arena) {
+  if (op == NodeKind::Eq) {
+    return Value::equal(a, b, arena);
+  }
+  if (op == NodeKind::Ne) {
+    return !Value::equal(a, b, arena);
+  }
+
+  int order;
+  if (Value::same_kind(a, b, ValueKind::NUMBER)) {
+    double l = a.get_data().number;
+    double r = b.get_data().number;
+    order = (l > r) - (l < r);
+  } else if (Value::same_kind(a, b, ValueKind::STRING)) {
+    order = a.get_data().string.compare(b.get_data().string);
+  } else {
+    return false;
+  }
+
+  switch (op) {
+  case NodeKind::Lt:
+    return order < 0;
+  case NodeKind::Le:
+    return order <= 0;
+  case NodeKind::Gt:
+    return order > 0;
+  case NodeKind::Ge:
+    return order >= 0;
+  default:
+    assert(0 && "Not a comparison");
+    return false;
+  }
+}
+
+Value builtin_compare(AstNode expression, Evaluator &ev) {
+  auto args = ev.query.as_array_like(expression).value();
+  Value l = eval(args[0], ev);
+  Value r = eval(args[1], ev);
+  return Value::boolean(compare_values(expression.get_kind(), l, r, ev.arena));
+}
+
+bool is_truthy(const Value &value) {
+  switch (value.get_kind()) {
+  case ValueKind::BOOLEAN:
+    return value.get_data().boolean;
+  case ValueKind::NUMBER:
+    return value.get_data().number != 0;
+  case ValueKind::STRING:
+    return !value.get_data().string.empty();
+  case ValueKind::JSON:
+  case ValueKind::SEQUENCE:
+  case ValueKind::LIST:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// `&&` and `||`, the right side is only evaluated when it decides the result
+Value builtin_logical(AstNode expression, Evaluator &ev) {
+  auto args = ev.query.as_array_like(expression).value();
+  bool left = is_truthy(eval(args[0], ev));
+  if (expression.get_kind() == NodeKind::And ? !left : left) {
+    return Value::boolean(left);
+  }
+  return Value::boolean(is_truthy(eval(args[1], ev)));
+}
+
+// The elements of the argument in order of their first occurrence. Elements
+// are bucketed by their hash, so only elements with equal hashes are compared,
+// which is cheap when the document keeps hashes.
+Value builtin_distinct(AstNode expression, Evaluator &ev) {
+  auto args = ev.query.as_array_like(expression).value();
+  if (args.size() != 1) {
+    ev.error("distinct expects one argument");
+    return Value::error();
+  }
+
+  Value value = eval(args[0], ev);
+  std::vector<AstNode> elements;
+  if (value.get_kind() == ValueKind::JSON &&
+      value.get_data().json.get_kind() == NodeKind::ARRAY) {
+    std::span<AstNode> array =
+        ev.arena.as_array_like(value.get_data().json).value();
+    elements.assign(array.begin(), array.end());
+  } else if (value.get_kind() == ValueKind::SEQUENCE) {
+    if (!collect_sequence(value.get_data().sequence, ev, elements)) {
+      return Value::error();
+    }
+  } else if (value.get_kind() == ValueKind::LIST) {
+    elements = std::move(value.get_data().list);
+  } else {
+    ev.error("distinct expects an array");
+    return Value::error();
+  }
+
+  std::unordered_map<uint64_t, std::vector<AstNode>> seen;
+  std::vector<AstNode> distinct;
+  // one step per element, charged up front
+  if (!ev.step(elements.size())) {
+    return Value::error();
+  }
+  for (AstNode element : elements) {
+    std::vector<AstNode> &bucket = seen[ev.arena.hash(element)];
+    bool duplicate = false;
+    for (AstNode other : bucket) {
+      if (json_equal(element, other, ev.arena)) {
+        duplicate = true;
+        break;
+      }
+    }
+    if (!duplicate) {
+      bucket.push_back(element);
+      distinct.push_back(element);
+    }
+  }
+  ev.allocate(distinct.size() * sizeof(AstNode));
+  return Value::list(std::move(distinct));
+}
+
 Value builtin_size_json(AstNode json, Evaluator &ev) {
   switch (json.get_kind()) {
   case NodeKind::ARRAY:
@@ -158,13 +714,23 @@ Value builtin_size_json(AstNode json, Evaluator &ev) {
 }
 
 Value builtin_size(AstNode expression, Evaluator &ev) {
-  auto args = ev.arena.as_array_like(expression).value();
+  auto args = ev.query.as_array_like(expression).value();
   Value first = eval(args[0], ev);
   switch (first.get_kind()) {
   case ValueKind::JSON:
     return builtin_size_json(first.get_data().json, ev);
   case ValueKind::STRING:
     return Value::number(first.get_data().string.size());
+  case ValueKind::LIST:
+    return Value::number((double)first.get_data().list.size());
+  case ValueKind::SEQUENCE: {
+    std::optional<size_t> count =
+        sequence_count(first.get_data().sequence, ev);
+    if (!count.has_value()) {
+      return Value::error();
+    }
+    return Value::number((double)*count);
+  }
   default:
     ev.error("Size is not applicable");
     return Value::error();
@@ -210,9 +776,37 @@ bool Value::div(Value &a, Value &b) {
   }
   return false;
 }
-bool Value::eq(Value &a, Value &b) {
-  a.data.boolean = a.kind != b.kind;
-  return true;
+bool Value::equal(const Value &a, const Value &b, Arena &arena) {
+  if (a.kind != b.kind) {
+    return false;
+  }
+  switch (a.kind) {
+  case ValueKind::JSON:
+    return json_equal(a.data.json, b.data.json, arena);
+  case ValueKind::STRING:
+    return a.data.string == b.data.string;
+  case ValueKind::NUMBER:
+    return a.data.number == b.data.number;
+  case ValueKind::BOOLEAN:
+    return a.data.boolean == b.data.boolean;
+  case ValueKind::NIL:
+    return true;
+  case ValueKind::LIST: {
+    const std::vector<AstNode> &left = a.data.list;
+    const std::vector<AstNode> &right = b.data.list;
+    if (left.size() != right.size()) {
+      return false;
+    }
+    for (size_t i = 0; i < left.size(); i++) {
+      if (!json_equal(left[i], right[i], arena)) {
+        return false;
+      }
+    }
+    return true;
+  }
+  default:
+    return false;
+  }
 }
 bool Value::max(Value &a, Value &b) {
   if (same_kind(a, b, ValueKind::STRING)) {
@@ -276,8 +870,36 @@ void Value::debug_print(Arena &arena) const {
     else
       printf("false\n");
     break;
+  case ValueKind::SEQUENCE:
+    printf("[Sequence]\n");
+    break;
+  case ValueKind::LIST:
+    printf("[List]\n");
+    for (AstNode node : data.list) {
+      from_json(node, arena).debug_print(arena);
+    }
+    break;
   case ValueKind::NIL:
     printf("null\n");
     break;
   }
 }
+
+bool collect_sequence(AstNode sequence, Evaluator &ev,
+                      std::vector<AstNode> &out) {
+  std::optional<Pipeline> pipeline = compile_pipeline(sequence, ev);
+  if (!pipeline.has_value()) {
+    return false;
+  }
+  std::optional<PipelineSource> source = pipeline_source(*pipeline, ev);
+  if (!source.has_value()) {
+    return false;
+  }
+
+  size_t before = out.size();
+  auto collect = [&](AstNode node) { out.push_back(node); };
+  run_slice(*pipeline, 0, source->elements, source->bounds, 0,
+            source->bounds.count, ev, collect);
+  ev.allocate((out.size() - before) * sizeof(AstNode));
+  return !ev.over_budget;
+}
@@ -1,9 +1,15 @@
 #pragma once
 
 #include "parser_driver.h"
+#include "profile.h"
+#include "thread_pool.h"
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <optional>
+#include <span>
 #include <string>
+#include <vector>
 
 enum class ValueKind {
   ERROR,
@@ -12,6 +18,10 @@ enum class ValueKind {
   NUMBER,
   BOOLEAN,
   NIL,
+  // lazy projection, holds the Slice/Field/Subscript expression producing it
+  SEQUENCE,
+  // nodes of the document picked by a function such as distinct
+  LIST,
 };
 
 // gcc is complaining about using memcpy on unions (we are doing it only for
@@ -20,7 +30,9 @@ enum class ValueKind {
 
 union ValueData {
   std::string string;
+  std::vector<AstNode> list;
   AstNode json;
+  AstNode sequence;
   double number;
   bool boolean;
 
@@ -34,43 +46,29 @@ class Value {
 
 public:
   Value() : kind(ValueKind::ERROR) {}
-  Value(Value &other) : kind(other.kind) {
-    if (kind == ValueKind::STRING) {
-      this->data.string = other.data.string;
-    } else {
-      memcpy(&this->data, &other.data, sizeof(ValueData));
-    }
-  }
+  Value(const Value &other) : kind(ValueKind::ERROR) { assign(other); }
+  Value(Value &&other) : kind(ValueKind::ERROR) { assign(std::move(other)); }
 
-  Value &operator=(Value &other) {
-    this->kind = other.kind;
-    if (kind == ValueKind::STRING) {
-      this->data.string = other.data.string;
-    } else {
-      memcpy(&this->data, &other.data, sizeof(ValueData));
+  Value &operator=(const Value &other) {
+    if (this != &other) {
+      assign(other);
     }
     return *this;
   }
 
-  void operator=(Value other) {
-    this->kind = other.kind;
-    if (kind == ValueKind::STRING) {
-      std::swap(data.string, other.data.string);
-    } else {
-      memcpy(&this->data, &other.data, sizeof(ValueData));
+  Value &operator=(Value &&other) {
+    if (this != &other) {
+      assign(std::move(other));
     }
+    return *this;
   }
 
-  ~Value() {
-    if (kind == ValueKind::STRING) {
-      std::string offering;
-      std::swap(data.string, offering);
-    }
-  }
+  ~Value() { reset(ValueKind::ERROR); }
 
   ValueKind get_kind() const { return kind; }
 
   ValueData &get_data() { return data; }
+  const ValueData &get_data() const { return data; }
 
   static Value error() {
     Value value{};
@@ -87,7 +85,7 @@ public:
 
   static Value string(std::string_view str) {
     Value value{};
-    value.kind = ValueKind::STRING;
+    value.reset(ValueKind::STRING);
     value.data.string = str;
     return value;
   }
@@ -106,6 +104,20 @@ public:
     return value;
   }
 
+  static Value sequence(AstNode expression) {
+    Value value{};
+    value.kind = ValueKind::SEQUENCE;
+    value.data.sequence = expression;
+    return value;
+  }
+
+  static Value list(std::vector<AstNode> nodes) {
+    Value value{};
+    value.reset(ValueKind::LIST);
+    value.data.list = std::move(nodes);
+    return value;
+  }
+
   static Value nil() {
     Value value{};
     value.kind = ValueKind::NIL;
@@ -120,30 +132,207 @@ public:
   static bool sub(Value &a, Value &b);
   static bool mul(Value &a, Value &b);
   static bool div(Value &a, Value &b);
-  // TODO do actual equality
-  static bool eq(Value &a, Value &b);
+  // Deep equality, values of different kinds are never equal
+  static bool equal(const Value &a, const Value &b, Arena &arena);
   static bool max(Value &a, Value &b);
   static bool min(Value &a, Value &b);
 
   void debug_print(Arena &arena) const;
+
+private:
+  // Changes the kind of the value, constructing or destroying the non-trivial
+  // union members as needed. The new contents are left default initialized.
+  void reset(ValueKind new_kind) {
+    if (kind == new_kind) {
+      return;
+    }
+    if (kind == ValueKind::STRING) {
+      data.string.~basic_string();
+    } else if (kind == ValueKind::LIST) {
+      data.list.~vector();
+    }
+    if (new_kind == ValueKind::STRING) {
+      new (&data.string) std::string();
+    } else if (new_kind == ValueKind::LIST) {
+      new (&data.list) std::vector<AstNode>();
+    }
+    kind = new_kind;
+  }
+
+  void assign(const Value &other) {
+    reset(other.kind);
+    if (kind == ValueKind::STRING) {
+      data.string = other.data.string;
+    } else if (kind == ValueKind::LIST) {
+      data.list = other.data.list;
+    } else {
+      memcpy(&data, &other.data, sizeof(ValueData));
+    }
+  }
+
+  void assign(Value &&other) {
+    reset(other.kind);
+    if (kind == ValueKind::STRING) {
+      std::swap(data.string, other.data.string);
+    } else if (kind == ValueKind::LIST) {
+      std::swap(data.list, other.data.list);
+    } else {
+      memcpy(&data, &other.data, sizeof(ValueData));
+    }
+  }
+};
+
+// Limits of one evaluation, 0 means no limit
+struct EvalBudget {
+  // nodes evaluated and elements of arrays and sequences visited
+  size_t steps = 0;
+  // strings and lists created while evaluating
+  size_t bytes = 0;
+  size_t milliseconds = 0;
+
+  bool limited() const { return steps > 0 || bytes > 0 || milliseconds > 0; }
+};
+
+struct EvalError {
+  enum class Kind {
+    Runtime,
+    StepBudget,
+    ByteBudget,
+    TimeBudget,
+  };
+
+  Kind kind;
+  const char *message;
+};
+
+// The usage of a budget, shared by the evaluators of the parallel tasks of one
+// evaluation. Evaluators count locally and only add their counts and look at
+// the clock every BUDGET_INTERVAL steps or bytes.
+class BudgetState {
+  EvalBudget limits;
+  uint64_t deadline;
+  std::atomic<size_t> steps{0};
+  std::atomic<size_t> bytes{0};
+  // the budget which ran out first, Runtime while none did
+  std::atomic<EvalError::Kind> exceeded{EvalError::Kind::Runtime};
+
+public:
+  static constexpr size_t BUDGET_INTERVAL = 1024;
+
+  explicit BudgetState(EvalBudget limits);
+
+  // Adds the counts of an evaluator, returns the error for the budget which
+  // ran out if this call is the one which found out
+  std::optional<EvalError> add(size_t steps, size_t bytes);
+
+  bool is_exceeded() const {
+    return exceeded.load(std::memory_order_relaxed) !=
+           EvalError::Kind::Runtime;
+  }
 };
 
 struct Evaluator {
+  // the expression and the json document can live in different arenas, so
+  // that one prepared expression can be evaluated against many documents
+  Arena &query;
   Arena &arena;
-  std::vector<const char *> errors;
+  std::vector<EvalError> errors;
   AstNode json_root;
+  ParallelOptions parallel;
+  // values of $1, $2, ...
+  std::span<const Value> params;
+  // set while profiling, the counters go to the node being evaluated
+  Profile *profile = nullptr;
+  NodeProfile *profile_node = nullptr;
+  ProfileCounters pending;
+  // set when the evaluation has limits
+  BudgetState *budget = nullptr;
+  size_t budget_steps = 0;
+  size_t budget_bytes = 0;
+  bool over_budget = false;
 
 public:
   Evaluator(Arena &arena, AstNode json_root)
-      : arena(arena), json_root(json_root) {}
+      : query(arena), arena(arena), json_root(json_root) {}
+  Evaluator(Arena &query, Arena &arena, AstNode json_root)
+      : query(query), arena(arena), json_root(json_root) {}
+
+  // An evaluator for a parallel task, it shares everything but the error list
+  Evaluator fork() const {
+    Evaluator other(query, arena, json_root);
+    other.parallel = parallel;
+    other.params = params;
+    other.profile = profile;
+    other.profile_node = profile_node;
+    other.budget = budget;
+    return other;
+  }
+
+  // Counts `n` steps against the budget, false once it has run out. Returns
+  // true right away without a budget.
+  bool step(size_t n = 1) {
+    if (budget == nullptr) {
+      return true;
+    }
+    budget_steps += n;
+    if (budget_steps >= BudgetState::BUDGET_INTERVAL) {
+      flush_budget();
+    }
+    return !over_budget;
+  }
+
+  // Counts bytes of strings and lists against the budget
+  void allocate(size_t n) {
+    if (budget == nullptr) {
+      return;
+    }
+    budget_bytes += n;
+    if (budget_bytes >= BudgetState::BUDGET_INTERVAL) {
+      flush_budget();
+    }
+  }
+
+  // Adds the counts to the shared budget, forks do this before they are
+  // dropped. The first evaluator which finds the budget exceeded reports it.
+  void flush_budget() {
+    if (budget == nullptr) {
+      return;
+    }
+    std::optional<EvalError> exceeded =
+        budget->add(budget_steps, budget_bytes);
+    budget_steps = 0;
+    budget_bytes = 0;
+    if (exceeded.has_value()) {
+      errors.push_back(*exceeded);
+    }
+    over_budget = over_budget || budget->is_exceeded();
+  }
 
-  void error(const char *message) { errors.push_back(message); }
+  // Adds the pending counters to the node being evaluated, forks do this
+  // before they are dropped
+  void flush_profile() {
+    if (profile_node != nullptr) {
+      profile_node->visited.fetch_add(pending.visited,
+                                      std::memory_order_relaxed);
+      profile_node->allocated.fetch_add(pending.allocated,
+                                        std::memory_order_relaxed);
+    }
+    pending = {};
+  }
+
+  // Errors after the budget ran out are only the fallout of stopping, they
+  // aren't reported
+  void error(const char *message) {
+    if (budget == nullptr || !budget->is_exceeded()) {
+      errors.push_back({EvalError::Kind::Runtime, message});
+    }
+  }
   void report_errors() {
     if (!errors.empty()) {
       printf("\n<<Errors>>\n");
     }
-    for (const char *error : errors) {
-      std::printf("%s\n", error);
+    for (const EvalError &error : errors) {
+      std::printf("%s\n", error.message);
     }
   }
 };
@@ -156,4 +345,28 @@ Value map_lookup(AstNode json_map, std::string_view key, Evaluator &ev);
 
 Value builtin_field(AstNode expression, Evaluator &ev);
 
+Value builtin_compare(AstNode expression, Evaluator &ev);
+
+Value builtin_logical(AstNode expression, Evaluator &ev);
+
+Value builtin_distinct(AstNode expression, Evaluator &ev);
+
+// Eq, Ne, Lt, Le, Gt, Ge. Numbers and strings are ordered, any other
+// combination of kinds is only ever not equal.
+bool compare_values(NodeKind op, const Value &a, const Value &b, Arena &arena);
+
+bool json_equal(AstNode a, AstNode b, Arena &arena);
+
+bool is_truthy(const Value &value);
+
+// Converts a node of the json document to a value
+Value from_json(AstNode node, Arena &arena);
+
+// from_json() which counts strings against the budget of `ev`
+Value json_value(AstNode node, Evaluator &ev);
+
 Value eval(AstNode expression, Evaluator &ev);
+
+// Appends the nodes produced by a sequence to `out`
+bool collect_sequence(AstNode sequence, Evaluator &ev,
+                      std::vector<AstNode> &out);
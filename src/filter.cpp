@@ -0,0 +1,332 @@
+#include "filter.h"
+#include "sequence.h"
+
+#include <algorithm>
+#include <optional>
+
+// Field paths relative to the filtered element, `price` or `meta.price`
+static bool column_path(AstNode node, Arena &arena,
+                        std::vector<std::string_view> &path) {
+  switch (node.get_kind()) {
+  case NodeKind::Identifier:
+    path.push_back(arena.as_string_like(node).value());
+    return true;
+  case NodeKind::Field: {
+    auto args = arena.as_array_like(node).value();
+    if (args[1].get_kind() != NodeKind::Identifier ||
+        !column_path(args[0], arena, path)) {
+      return false;
+    }
+    path.push_back(arena.as_string_like(args[1]).value());
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// Number and string literals, parameters are bound by the time the filter is
+// compiled so they count as well
+static const Value *literal_value(AstNode node, Evaluator &ev,
+                                  Value &scratch) {
+  switch (node.get_kind()) {
+  case NodeKind::NUMBER:
+  case NodeKind::STRING:
+    scratch = eval(node, ev);
+    return &scratch;
+  case NodeKind::Param: {
+    size_t index = node.get_data();
+    if (index == 0 || index > ev.params.size()) {
+      return nullptr;
+    }
+    const Value *value = &ev.params[index - 1];
+    if (value->get_kind() == ValueKind::NUMBER ||
+        value->get_kind() == ValueKind::STRING) {
+      return value;
+    }
+    return nullptr;
+  }
+  default:
+    return nullptr;
+  }
+}
+
+// `a < b` is the same as `b > a`
+static NodeKind mirror(NodeKind op) {
+  switch (op) {
+  case NodeKind::Lt:
+    return NodeKind::Gt;
+  case NodeKind::Le:
+    return NodeKind::Ge;
+  case NodeKind::Gt:
+    return NodeKind::Lt;
+  case NodeKind::Ge:
+    return NodeKind::Le;
+  default:
+    return op;
+  }
+}
+
+static size_t compile_node(AstNode node, Evaluator &ev,
+                           FilterProgram &program) {
+  Arena &arena = ev.query;
+  FilterNode filter{};
+  filter.kind = FilterNode::Kind::Eval;
+  filter.expression = node;
+
+  switch (node.get_kind()) {
+  case NodeKind::And:
+  case NodeKind::Or: {
+    auto args = arena.as_array_like(node).value();
+    filter.kind = node.get_kind() == NodeKind::And ? FilterNode::Kind::And
+                                                   : FilterNode::Kind::Or;
+    filter.left = compile_node(args[0], ev, program);
+    filter.right = compile_node(args[1], ev, program);
+    break;
+  }
+  case NodeKind::Eq:
+  case NodeKind::Ne:
+  case NodeKind::Lt:
+  case NodeKind::Le:
+  case NodeKind::Gt:
+  case NodeKind::Ge: {
+    auto args = arena.as_array_like(node).value();
+    // pointers into the query arena, which a string literal is viewed in
+    const AstNode *column = &args[0];
+    const AstNode *literal = &args[1];
+    NodeKind op = node.get_kind();
+    Value scratch;
+    if (literal_value(*column, ev, scratch) != nullptr) {
+      std::swap(column, literal);
+      op = mirror(op);
+    }
+
+    const Value *value = literal_value(*literal, ev, scratch);
+    std::vector<std::string_view> path;
+    if (value == nullptr || !column_path(*column, arena, path)) {
+      break;
+    }
+
+    filter.kind = FilterNode::Kind::Compare;
+    filter.op = op;
+    filter.path = std::move(path);
+    filter.is_string = value->get_kind() == ValueKind::STRING;
+    if (filter.is_string) {
+      // a view into the query arena or into the bound parameter, both
+      // outlive the program
+      if (value == &scratch) {
+        filter.string = arena.as_string_like(*literal).value();
+      } else {
+        filter.string = value->get_data().string;
+      }
+    } else {
+      filter.number = value->get_data().number;
+    }
+    break;
+  }
+  default:
+    break;
+  }
+
+  program.nodes.push_back(std::move(filter));
+  return program.nodes.size() - 1;
+}
+
+FilterProgram compile_filter(AstNode predicate, Evaluator &ev) {
+  FilterProgram program;
+  program.root = compile_node(predicate, ev, program);
+  return program;
+}
+
+// The comparison is done on the whole batch without branches so that it can
+// be vectorized, values of elements which aren't present are zero.
+template <typename Compare>
+static void compare_column(const double *values, const uint8_t *present,
+                           uint8_t *mask, size_t len, bool missing,
+                           Compare compare) {
+  for (size_t i = 0; i < len; i++) {
+    uint8_t result = present[i] ? compare(values[i]) : missing;
+    mask[i] &= result;
+  }
+}
+
+static void compare_numbers(const FilterNode &node, const double *values,
+                            const uint8_t *present, uint8_t *mask,
+                            size_t len) {
+  double c = node.number;
+  // a value of a different kind is never equal
+  bool missing = node.op == NodeKind::Ne;
+  switch (node.op) {
+  case NodeKind::Eq:
+    compare_column(values, present, mask, len, missing,
+                   [c](double v) { return v == c; });
+    break;
+  case NodeKind::Ne:
+    compare_column(values, present, mask, len, missing,
+                   [c](double v) { return v != c; });
+    break;
+  case NodeKind::Lt:
+    compare_column(values, present, mask, len, missing,
+                   [c](double v) { return v < c; });
+    break;
+  case NodeKind::Le:
+    compare_column(values, present, mask, len, missing,
+                   [c](double v) { return v <= c; });
+    break;
+  case NodeKind::Gt:
+    compare_column(values, present, mask, len, missing,
+                   [c](double v) { return v > c; });
+    break;
+  case NodeKind::Ge:
+    compare_column(values, present, mask, len, missing,
+                   [c](double v) { return v >= c; });
+    break;
+  default:
+    assert(0 && "Not a comparison");
+  }
+}
+
+static bool compare_string(NodeKind op, std::string_view a,
+                           std::string_view b) {
+  int order = a.compare(b);
+  switch (op) {
+  case NodeKind::Eq:
+    return order == 0;
+  case NodeKind::Ne:
+    return order != 0;
+  case NodeKind::Lt:
+    return order < 0;
+  case NodeKind::Le:
+    return order <= 0;
+  case NodeKind::Gt:
+    return order > 0;
+  case NodeKind::Ge:
+    return order >= 0;
+  default:
+    assert(0 && "Not a comparison");
+    return false;
+  }
+}
+
+static void run_compare(const FilterNode &node,
+                        std::span<const AstNode> batch, uint8_t *mask,
+                        Evaluator &ev) {
+  Arena &arena = ev.arena;
+  size_t len = batch.size();
+  double values[FILTER_BATCH];
+  std::string_view strings[FILTER_BATCH];
+  // the strings are viewed in these, short ones are inline in the node
+  AstNode string_nodes[FILTER_BATCH];
+  uint8_t present[FILTER_BATCH];
+
+  NodeKind wanted = node.is_string ? NodeKind::STRING : NodeKind::NUMBER;
+  for (size_t i = 0; i < len; i++) {
+    values[i] = 0;
+    present[i] = 0;
+    if (!mask[i]) {
+      continue;
+    }
+
+    std::optional<AstNode> value = batch[i];
+    for (std::string_view key : node.path) {
+      value = find_field(*value, key, arena, &ev.pending.visited);
+      if (!value.has_value()) {
+        break;
+      }
+    }
+    if (!value.has_value() || value->get_kind() != wanted) {
+      continue;
+    }
+
+    present[i] = 1;
+    if (node.is_string) {
+      string_nodes[i] = *value;
+      strings[i] = arena.as_string_like(string_nodes[i]).value();
+    } else {
+      values[i] = value->get_value().number;
+    }
+  }
+
+  if (node.is_string) {
+    for (size_t i = 0; i < len; i++) {
+      if (present[i]) {
+        mask[i] &= compare_string(node.op, strings[i], node.string);
+      } else {
+        mask[i] &= node.op == NodeKind::Ne;
+      }
+    }
+  } else {
+    compare_numbers(node, values, present, mask, len);
+  }
+}
+
+static void run_node(const FilterProgram &program, size_t index,
+                     std::span<const AstNode> batch, uint8_t *mask,
+                     Evaluator &ev) {
+  const FilterNode &node = program.nodes[index];
+  size_t len = batch.size();
+
+  // Eval nodes are profiled by eval() for each element
+  std::optional<ProfileScope> scope;
+  if (ev.profile != nullptr && node.kind != FilterNode::Kind::Eval) {
+    if (NodeProfile *profile = ev.profile->find(node.expression)) {
+      profile->calls.fetch_add(std::count(mask, mask + len, 1),
+                               std::memory_order_relaxed);
+      scope.emplace(ev, profile);
+    }
+  }
+
+  switch (node.kind) {
+  case FilterNode::Kind::Compare:
+    run_compare(node, batch, mask, ev);
+    break;
+  case FilterNode::Kind::And:
+    run_node(program, node.left, batch, mask, ev);
+    run_node(program, node.right, batch, mask, ev);
+    break;
+  case FilterNode::Kind::Or: {
+    uint8_t rest[FILTER_BATCH];
+    std::copy(mask, mask + len, rest);
+    run_node(program, node.left, batch, mask, ev);
+    // the right side only needs to look at what the left side rejected
+    for (size_t i = 0; i < len; i++) {
+      rest[i] &= !mask[i];
+    }
+    run_node(program, node.right, batch, rest, ev);
+    for (size_t i = 0; i < len; i++) {
+      mask[i] |= rest[i];
+    }
+    break;
+  }
+  case FilterNode::Kind::Eval:
+    for (size_t i = 0; i < len; i++) {
+      if (mask[i]) {
+        // identifiers are looked up in the element, errors such as a missing
+        // field just reject the element
+        Evaluator local(ev.query, ev.arena, batch[i]);
+        local.params = ev.params;
+        local.profile = ev.profile;
+        local.profile_node = ev.profile_node;
+        local.budget = ev.budget;
+        mask[i] = is_truthy(eval(node.expression, local));
+        local.flush_profile();
+        // the counts go on with the filter, a budget running out is the only
+        // error which isn't about the element
+        for (const EvalError &error : local.errors) {
+          if (error.kind != EvalError::Kind::Runtime) {
+            ev.errors.push_back(error);
+          }
+        }
+        ev.step(local.budget_steps);
+        ev.allocate(local.budget_bytes);
+      }
+    }
+    break;
+  }
+}
+
+void filter_batch(const FilterProgram &program, std::span<const AstNode> batch,
+                  uint8_t *mask, Evaluator &ev) {
+  assert(batch.size() <= FILTER_BATCH);
+  run_node(program, program.root, batch, mask, ev);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "eval.h"
+
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+// Filter predicates (`items[? price > 100]`) are evaluated a batch of elements
+// at a time. Comparisons of a field path against a literal extract the field
+// of every element into a column and compare the whole column in one tight
+// loop, anything else falls back to evaluating the expression per element with
+// the element as the root.
+//
+// `&&` and `||` narrow the selection passed to their right side, so fields
+// are only extracted for elements which can still change the result.
+
+constexpr size_t FILTER_BATCH = 256;
+
+struct FilterNode {
+  enum class Kind {
+    // column op literal
+    Compare,
+    And,
+    Or,
+    // arbitrary expression, evaluated per element
+    Eval,
+  };
+
+  Kind kind;
+  // Compare: Eq, Ne, Lt, Le, Gt, Ge
+  NodeKind op;
+  // Compare: field names leading from the element to the column value
+  std::vector<std::string_view> path;
+  // Compare: the literal is either a number or a string
+  bool is_string;
+  double number;
+  std::string_view string;
+  // And, Or
+  size_t left;
+  size_t right;
+  // the predicate node, evaluated per element by Eval and profiled as a
+  // whole batch by the others
+  AstNode expression;
+};
+
+struct FilterProgram {
+  std::vector<FilterNode> nodes;
+  size_t root;
+};
+
+FilterProgram compile_filter(AstNode predicate, Evaluator &ev);
+
+// Clears mask[i] for the elements of the batch which don't pass the filter,
+// elements whose mask is already cleared are not looked at.
+void filter_batch(const FilterProgram &program, std::span<const AstNode> batch,
+                  uint8_t *mask, Evaluator &ev);
@@ -0,0 +1,136 @@
+#include "input.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+
+ChunkRing::ChunkRing(size_t buffers, size_t buffer_size)
+    : slots(std::max<size_t>(buffers, 2)), write_index(0), read_index(0),
+      full(0), reading(false), finished(false), closed(false) {
+  for (Slot &slot : slots) {
+    // large enough to always hold the magic bytes of compressed formats
+    slot.data.resize(std::max<size_t>(buffer_size, 16));
+    slot.len = 0;
+  }
+}
+
+std::span<char> ChunkRing::begin_write() {
+  std::unique_lock lock(mutex);
+  changed.wait(lock, [this]() { return closed || full < slots.size(); });
+  if (closed) {
+    return {};
+  }
+  Slot &slot = slots[write_index];
+  return std::span(slot.data.data(), slot.data.size());
+}
+
+void ChunkRing::end_write(size_t len) {
+  {
+    std::lock_guard lock(mutex);
+    slots[write_index].len = len;
+    write_index = (write_index + 1) % slots.size();
+    full++;
+  }
+  changed.notify_all();
+}
+
+void ChunkRing::finish() {
+  {
+    std::lock_guard lock(mutex);
+    finished = true;
+  }
+  changed.notify_all();
+}
+
+std::span<const char> ChunkRing::next_read() {
+  std::unique_lock lock(mutex);
+  if (reading) {
+    reading = false;
+    read_index = (read_index + 1) % slots.size();
+    full--;
+    changed.notify_all();
+  }
+
+  changed.wait(lock, [this]() { return full > 0 || finished; });
+  if (full == 0) {
+    return {};
+  }
+
+  reading = true;
+  Slot &slot = slots[read_index];
+  return std::span(slot.data.data(), slot.len);
+}
+
+void ChunkRing::close() {
+  {
+    std::lock_guard lock(mutex);
+    closed = true;
+  }
+  changed.notify_all();
+}
+
+ReadAheadSource::ReadAheadSource(int fd, bool owns_fd,
+                                 ReadAheadOptions options)
+    : fd(fd), owns_fd(owns_fd), ring(options.buffers, options.buffer_size),
+      read_error(nullptr) {
+  reader = std::thread([this]() { reader_main(); });
+}
+
+ReadAheadSource::~ReadAheadSource() {
+  ring.close();
+  reader.join();
+  if (owns_fd) {
+    ::close(fd);
+  }
+}
+
+std::unique_ptr<ReadAheadSource>
+ReadAheadSource::open(const char *path, ReadAheadOptions options) {
+  if (path[0] == '-' && path[1] == '\0') {
+    return std::make_unique<ReadAheadSource>(STDIN_FILENO, false, options);
+  }
+
+  int fd = ::open(path, O_RDONLY);
+  if (fd < 0) {
+    return nullptr;
+  }
+  // we only ever go forward, let the kernel read ahead aggressively as well
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return std::make_unique<ReadAheadSource>(fd, true, options);
+}
+
+void ReadAheadSource::reader_main() {
+  while (true) {
+    std::span<char> buffer = ring.begin_write();
+    if (buffer.empty()) {
+      break;
+    }
+
+    // fill the whole buffer, pipes return data in small pieces
+    size_t len = 0;
+    bool eof = false;
+    while (len < buffer.size()) {
+      ssize_t n = ::read(fd, buffer.data() + len, buffer.size() - len);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n < 0) {
+        read_error = "Failed to read input";
+      }
+      if (n <= 0) {
+        eof = true;
+        break;
+      }
+      len += (size_t)n;
+    }
+
+    if (len > 0) {
+      ring.end_write(len);
+    }
+    if (eof) {
+      break;
+    }
+  }
+  ring.finish();
+}
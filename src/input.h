@@ -0,0 +1,111 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// A source of input bytes, the parser pulls it one chunk at a time.
+class InputSource {
+public:
+  virtual ~InputSource() = default;
+
+  // Returns the next chunk of input, an empty span marks the end. The chunk
+  // stays valid until the next call.
+  virtual std::span<const char> next_chunk() = 0;
+
+  // Error message if the input ended because of an error
+  virtual const char *error() const { return nullptr; }
+};
+
+// The whole input is already in memory
+class StringSource : public InputSource {
+  std::string_view string;
+  bool done;
+
+public:
+  StringSource(std::string_view string) : string(string), done(false) {}
+
+  std::span<const char> next_chunk() override {
+    if (done) {
+      return {};
+    }
+    done = true;
+    return std::span(string.data(), string.size());
+  }
+};
+
+// A fixed ring of buffers passed from a producer thread to a consumer.
+//
+// The producer fills free buffers while the consumer works through the full
+// ones, so that both sides can run at the same time as long as the other one
+// keeps up.
+class ChunkRing {
+  struct Slot {
+    std::vector<char> data;
+    size_t len;
+  };
+
+  std::vector<Slot> slots;
+  // next slot to fill, and next slot to consume
+  size_t write_index;
+  size_t read_index;
+  // number of full slots, including the one the consumer is holding
+  size_t full;
+  bool reading;
+  // set by the producer once there is no more data
+  bool finished;
+  // set by the consumer when it doesn't want any more data
+  bool closed;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+
+public:
+  ChunkRing(size_t buffers, size_t buffer_size);
+
+  // Producer side, waits for a free buffer. Returns an empty span if the
+  // consumer is gone.
+  std::span<char> begin_write();
+  void end_write(size_t len);
+  void finish();
+
+  // Consumer side, waits for a full buffer, the previous one is released.
+  // Returns an empty span after the producer is finished.
+  std::span<const char> next_read();
+  void close();
+};
+
+struct ReadAheadOptions {
+  size_t buffer_size = 1 << 20;
+  // three buffers let the reader work on one while the parser has another and
+  // a third one is already waiting
+  size_t buffers = 3;
+};
+
+// Reads a file descriptor on a separate thread, a few buffers ahead of the
+// parser, so that waiting on the disk or a pipe overlaps with parsing.
+class ReadAheadSource : public InputSource {
+  int fd;
+  bool owns_fd;
+  ChunkRing ring;
+  const char *read_error;
+  std::thread reader;
+
+  void reader_main();
+
+public:
+  ReadAheadSource(int fd, bool owns_fd, ReadAheadOptions options = {});
+  ~ReadAheadSource() override;
+
+  // "-" is stdin, returns nullptr if the file can't be opened
+  static std::unique_ptr<ReadAheadSource> open(const char *path,
+                                               ReadAheadOptions options = {});
+
+  std::span<const char> next_chunk() override { return ring.next_read(); }
+  const char *error() const override { return read_error; }
+};
@@ -0,0 +1,427 @@
+#include "json_eval.h"
+#include "optimize.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+void Document::load(InputSource &input, DocumentOptions options) {
+  arena.clear(options.arena);
+  streamed.reset();
+  Parser parser(input);
+  root = parse_document(parser, arena, options.parse);
+  errors = parser.get_errors();
+  live = arena.node_count();
+}
+
+std::unique_ptr<Document> Document::from_buffer(std::string_view json,
+                                                DocumentOptions options) {
+  auto document = std::make_unique<Document>();
+  StringSource input(json);
+  document->load(input, options);
+  return document;
+}
+
+std::unique_ptr<Document> Document::from_file(const char *path,
+                                              ReadAheadOptions options,
+                                              const char *&error,
+                                              DocumentOptions load_options) {
+  std::unique_ptr<InputSource> input = open_input(path, options, error);
+  if (!input) {
+    return nullptr;
+  }
+  auto document = std::make_unique<Document>();
+  document->load(*input, load_options);
+  return document;
+}
+
+bool Document::load_file(const char *path, ReadAheadOptions options,
+                         const char *&error, DocumentOptions load_options) {
+  std::unique_ptr<InputSource> input = open_input(path, options, error);
+  if (!input) {
+    return false;
+  }
+  load(*input, load_options);
+  return true;
+}
+
+std::unique_ptr<Document>
+Document::stream_file(const char *path, const PreparedQuery &query,
+                      ReadAheadOptions options, const char *&error,
+                      DocumentOptions load_options) {
+  if (!streamable(query.get_expression(), query.get_arena())) {
+    error = "The query doesn't only read fixed paths";
+    return nullptr;
+  }
+  std::unique_ptr<InputSource> input = open_input(path, options, error);
+  if (!input) {
+    return nullptr;
+  }
+  auto document = std::make_unique<Document>();
+  document->arena = Arena(load_options.arena);
+  Parser parser(*input);
+  InputFormat format = load_options.parse.format;
+  if (format == InputFormat::AUTO) {
+    format = detect_format(parser.buffered());
+  }
+  // binary formats are decoded whole, that is cheap with their lengths known
+  if (format == InputFormat::JSON) {
+    document->streamed = query.clone();
+    document->root = stream_paths(
+        parser, document->streamed->get_expression(),
+        document->streamed->get_arena(), document->arena, load_options.parse);
+  } else {
+    document->root =
+        parse_document(parser, document->arena, load_options.parse);
+  }
+  document->errors = parser.get_errors();
+  document->live = document->arena.node_count();
+  return document;
+}
+
+DocumentBuilder::DocumentBuilder(DocumentOptions options)
+    : document(std::make_unique<Document>()),
+      parser(document->arena, options.parse) {
+  document->arena = Arena(options.arena);
+}
+
+std::unique_ptr<Document> DocumentBuilder::finish() {
+  document->root = parser.finish();
+  document->errors = parser.get_errors();
+  document->live = document->arena.node_count();
+  return std::move(document);
+}
+
+bool Document::apply_patch(const Document &patch, const char *&error) {
+  if (streamed != nullptr) {
+    // the indices of the sparse arrays aren't those of the document
+    error = "Streamed documents can't be patched";
+    return false;
+  }
+  if (!patch.ok()) {
+    error = "Patch has syntax errors";
+    return false;
+  }
+  std::vector<PatchOperation> operations;
+  if (!parse_patch(patch.root, patch.arena, operations, error)) {
+    return false;
+  }
+
+  std::optional<AstNode> patched =
+      ::apply_patch(operations, patch.arena, root, arena, error);
+  if (!patched.has_value()) {
+    return false;
+  }
+  root = *patched;
+
+  if (arena.node_count() > live * 2) {
+    root = arena.compact(root);
+    live = arena.node_count();
+  }
+  return true;
+}
+
+VersionedDocument::VersionedDocument(std::unique_ptr<Document> document)
+    : current(new Version{
+          std::make_shared<Arena>(std::move(document->get_arena())),
+          document->get_root()}),
+      live(current.load()->arena->node_count()) {}
+
+VersionedDocument::~VersionedDocument() {
+  for (Retired &old : retired) {
+    delete old.version;
+  }
+  delete current.load();
+}
+
+size_t VersionedDocument::pin() {
+  // threads start looking at different slots so they rarely compete
+  size_t start = std::hash<std::thread::id>{}(std::this_thread::get_id());
+  for (size_t i = 0;; i++) {
+    size_t index = (start + i) % READER_SLOTS;
+    uint64_t idle = IDLE;
+    if (slots[index].epoch.compare_exchange_strong(idle, epoch.load())) {
+      return index;
+    }
+    if (i % READER_SLOTS == READER_SLOTS - 1) {
+      std::this_thread::yield();
+    }
+  }
+}
+
+VersionedDocument::Snapshot VersionedDocument::snapshot() {
+  size_t slot = pin();
+  return Snapshot(this, slot, current.load());
+}
+
+VersionedDocument::Snapshot::~Snapshot() {
+  if (owner != nullptr) {
+    owner->slots[slot].epoch.store(IDLE);
+  }
+}
+
+// A reader which pinned an epoch after the increment loads the current version
+// after the exchange, so it can't see the old one
+void VersionedDocument::publish(Version *version) {
+  Version *old = current.exchange(version);
+  uint64_t retired_at = epoch.fetch_add(1) + 1;
+  retired.push_back({old, retired_at});
+  reclaim();
+}
+
+void VersionedDocument::reclaim() {
+  uint64_t oldest = IDLE;
+  for (ReaderSlot &slot : slots) {
+    oldest = std::min(oldest, slot.epoch.load());
+  }
+  auto unused = [&](const Retired &old) {
+    if (old.epoch > oldest) {
+      return false;
+    }
+    delete old.version;
+    return true;
+  };
+  retired.erase(std::remove_if(retired.begin(), retired.end(), unused),
+                retired.end());
+}
+
+// A copy of the tree reachable from `root` with room for at least as much
+// again, and for `cost` on top of that
+static std::shared_ptr<Arena> copy_live(Arena &arena, AstNode &root,
+                                        PatchCost cost) {
+  auto copy = std::make_shared<Arena>(arena.get_options());
+  root = copy->copy_tree(arena, root);
+  size_t nodes = copy->node_count();
+  size_t bytes = copy->string_position().raw();
+  copy->reserve(std::max(nodes, cost.nodes) + cost.nodes,
+                std::max(bytes, cost.bytes) + cost.bytes);
+  return copy;
+}
+
+bool VersionedDocument::apply_patch(const Document &patch,
+                                    const char *&error) {
+  std::lock_guard lock(writer);
+  reclaim();
+
+  if (!patch.ok()) {
+    error = "Patch has syntax errors";
+    return false;
+  }
+  std::vector<PatchOperation> operations;
+  if (!parse_patch(patch.get_root(), patch.get_arena(), operations, error)) {
+    return false;
+  }
+
+  const Version *base = current.load();
+  std::shared_ptr<Arena> arena = base->arena;
+  AstNode root = base->root;
+  PatchCost cost =
+      patch_cost(operations, patch.get_arena(), root, *arena);
+  // readers may be using the storage of the arena, it must not move
+  if (!arena->has_room(cost.nodes, cost.bytes)) {
+    arena = copy_live(*arena, root, cost);
+    live = arena->node_count();
+  }
+
+  std::optional<AstNode> patched =
+      ::apply_patch(operations, patch.get_arena(), root, *arena, error);
+  if (!patched.has_value()) {
+    return false;
+  }
+  root = *patched;
+
+  if (arena->node_count() > live * 2) {
+    arena = copy_live(*arena, root, cost);
+    live = arena->node_count();
+  }
+  publish(new Version{std::move(arena), root});
+  return true;
+}
+
+static size_t max_param(AstNode expression, Arena &arena) {
+  if (expression.get_kind() == NodeKind::Param) {
+    return expression.get_data();
+  }
+  size_t max = 0;
+  if (kind_is_function(expression.get_kind()) &&
+      kind_is_array_like(expression.get_kind())) {
+    std::span<AstNode> args = arena.as_array_like(expression).value();
+    for (AstNode arg : args) {
+      max = std::max(max, max_param(arg, arena));
+    }
+  }
+  return max;
+}
+
+std::unique_ptr<PreparedQuery>
+PreparedQuery::prepare(std::string_view expression) {
+  auto query = std::make_unique<PreparedQuery>();
+
+  StringSource input(expression);
+  Parser parser(input);
+  AstNode parsed = parse_expression(parser, query->arena);
+  parser.consume_whitespace();
+  if (parser.peek() != EOF) {
+    parser.error("Unexpected character after expression");
+  }
+
+  query->expression = optimize_expression(parsed, query->arena);
+  query->param_count = max_param(query->expression, query->arena);
+  query->errors = parser.get_errors();
+  return query;
+}
+
+std::unique_ptr<PreparedQuery> PreparedQuery::clone() const {
+  auto copy = std::make_unique<PreparedQuery>();
+  copy->arena = arena;
+  copy->expression = expression;
+  copy->param_count = param_count;
+  copy->errors = errors;
+  return copy;
+}
+
+bool PreparedQuery::compile(const char *&error) {
+  if (!ok()) {
+    error = "Expression has errors";
+    return false;
+  }
+  compiled = CompiledQuery::compile(expression, arena, error);
+  return compiled != nullptr;
+}
+
+std::optional<double> ResultView::as_number() const {
+  if (value->get_kind() == ValueKind::NUMBER) {
+    return value->get_data().number;
+  }
+  return {};
+}
+
+std::optional<bool> ResultView::as_boolean() const {
+  if (value->get_kind() == ValueKind::BOOLEAN) {
+    return value->get_data().boolean;
+  }
+  return {};
+}
+
+std::optional<std::string_view> ResultView::as_string() const {
+  if (value->get_kind() == ValueKind::STRING) {
+    return value->get_data().string;
+  }
+  return {};
+}
+
+std::optional<AstNode> ResultView::as_json() const {
+  if (value->get_kind() == ValueKind::JSON) {
+    return value->get_data().json;
+  }
+  return {};
+}
+
+void ResultView::debug_print() const {
+  if (value->get_kind() != ValueKind::SEQUENCE) {
+    value->debug_print(*arena);
+    return;
+  }
+  printf("[Sequence]\n");
+  for (AstNode node : nodes) {
+    from_json(node, *arena).debug_print(*arena);
+  }
+}
+
+bool ResultView::encode(OutputFormat format, std::string &out) const {
+  Encoder encoder(format, out);
+  switch (value->get_kind()) {
+  case ValueKind::ERROR:
+    return false;
+  case ValueKind::JSON:
+    encoder.json(value->get_data().json, *arena);
+    break;
+  case ValueKind::STRING:
+    encoder.string(value->get_data().string);
+    break;
+  case ValueKind::NUMBER:
+    encoder.number(value->get_data().number);
+    break;
+  case ValueKind::BOOLEAN:
+    encoder.boolean(value->get_data().boolean);
+    break;
+  case ValueKind::NIL:
+    encoder.nil();
+    break;
+  case ValueKind::SEQUENCE:
+  case ValueKind::LIST:
+    encoder.array(nodes.size());
+    for (AstNode node : nodes) {
+      encoder.json(node, *arena);
+    }
+    break;
+  }
+  return true;
+}
+
+void EvalContext::bind(size_t index, Value value) {
+  if (index == 0) {
+    return;
+  }
+  if (params.size() < index) {
+    params.resize(index);
+  }
+  params[index - 1] = std::move(value);
+}
+
+ResultView EvalContext::evaluate(const PreparedQuery &query, Arena &arena,
+                                 AstNode root) {
+  errors.clear();
+  nodes.clear();
+  // the compiled code gives up on anything unusual, the interpreter reports
+  // the errors then
+  const CompiledQuery *compiled = query.get_compiled();
+  if (compiled != nullptr && profile == nullptr && !budget.limited() &&
+      compiled->run(arena, root, result)) {
+    return ResultView(&result, nodes, &arena);
+  }
+
+  Evaluator ev(query.get_arena(), arena, root);
+  ev.parallel = parallel;
+  ev.params = params;
+  ev.profile = profile;
+  std::optional<BudgetState> budget_state;
+  if (budget.limited()) {
+    budget_state.emplace(budget);
+    ev.budget = &*budget_state;
+  }
+
+  // keep the capacity around for the next evaluation
+  std::swap(ev.errors, errors);
+  ev.errors.clear();
+  nodes.clear();
+
+  result = eval(query.get_expression(), ev);
+  if (result.get_kind() == ValueKind::SEQUENCE) {
+    // the nodes of the sequence are produced here, the work belongs to the
+    // root of the expression
+    std::optional<ProfileScope> scope;
+    if (profile != nullptr) {
+      if (NodeProfile *node = profile->find(query.get_expression())) {
+        scope.emplace(ev, node);
+      }
+    }
+    if (!collect_sequence(result.get_data().sequence, ev, nodes)) {
+      result = Value::error();
+    }
+  }
+  if (budget_state.has_value()) {
+    // whatever is left over may be the one that runs out
+    ev.flush_budget();
+    if (budget_state->is_exceeded()) {
+      result = Value::error();
+      nodes.clear();
+    }
+  }
+
+  std::swap(ev.errors, errors);
+  if (result.get_kind() == ValueKind::LIST) {
+    return ResultView(&result, result.get_data().list, &arena);
+  }
+  return ResultView(&result, nodes, &arena);
+}
@@ -0,0 +1,305 @@
+#pragma once
+
+// Embeddable interface of json_eval, the cli is a client of this as well.
+//
+// Documents and prepared queries are immutable once they are created (apart
+// from patching a document, which needs exclusive access), so any number of
+// threads can evaluate any queries against any documents at the same time. A
+// VersionedDocument can be patched while it is being queried. An EvalContext
+// holds the mutable state of an evaluation, it must only be used by one thread
+// at a time and reusing it avoids reallocating its buffers.
+
+#include "codegen.h"
+#include "decompress.h"
+#include "encode.h"
+#include "eval.h"
+#include "patch.h"
+#include "push_parser.h"
+#include "query_dsl.h"
+#include "stream.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
+
+class PreparedQuery;
+
+struct DocumentOptions {
+  ArenaOptions arena;
+  ParseOptions parse;
+};
+
+// A parsed json document
+class Document {
+  // only read once the document is loaded, the accessors of Arena just aren't
+  // const
+  mutable Arena arena;
+  AstNode root;
+  std::vector<ParseError> errors;
+  // nodes of the arena when it was loaded or last compacted, patches append
+  // behind them
+  size_t live = 0;
+  // the query a streamed document was read for, with its subscripts pointing
+  // into the sparse arrays, see stream.h
+  std::unique_ptr<PreparedQuery> streamed;
+
+  void load(InputSource &input, DocumentOptions options);
+
+  friend class DocumentBuilder;
+
+public:
+  static std::unique_ptr<Document> from_buffer(std::string_view json,
+                                               DocumentOptions options = {});
+
+  // Compressed files are decompressed, "-" is stdin. Returns nullptr and sets
+  // `error` if the file can't be read.
+  static std::unique_ptr<Document> from_file(const char *path,
+                                             ReadAheadOptions options,
+                                             const char *&error,
+                                             DocumentOptions load_options = {});
+
+  // Replaces the document with the contents of another file, reusing the
+  // memory of the arena. Returns false and sets `error` if the file can't be
+  // read, the document is left as it was then.
+  bool load_file(const char *path, ReadAheadOptions options, const char *&error,
+                 DocumentOptions load_options = {});
+
+  // Only the parts of the file the query reads, for queries which read fixed
+  // paths, see stream.h. The file is read as far as needed and the document
+  // is only good for evaluating that query. Returns nullptr and sets `error`
+  // if the query isn't streamable or the file can't be read.
+  static std::unique_ptr<Document>
+  stream_file(const char *path, const PreparedQuery &query,
+              ReadAheadOptions options, const char *&error,
+              DocumentOptions load_options = {});
+
+  // What to evaluate for `query`: itself, or for a streamed document the copy
+  // of the query it was read for, whose subscripts are rewritten. The copy
+  // runs on the interpreter.
+  const PreparedQuery &query_for(const PreparedQuery &query) const {
+    if (streamed != nullptr) {
+      return *streamed;
+    }
+    return query;
+  }
+
+  // Json syntax errors, the document is still usable but parts of it may be
+  // replaced by error nodes
+  bool ok() const { return errors.empty(); }
+  const std::vector<ParseError> &get_errors() const { return errors; }
+
+  // Applies a JSON Patch document (RFC 6902 add, remove and replace), see
+  // patch.h. The arena is compacted once patches have doubled its size, so
+  // patches stay proportional to their size on average. On error the document
+  // is left unchanged. Streamed documents can't be patched.
+  bool apply_patch(const Document &patch, const char *&error);
+
+  AstNode get_root() const { return root; }
+  Arena &get_arena() const { return arena; }
+};
+
+// Builds a document from input which arrives in pieces, each chunk is parsed
+// as soon as it is fed, see push_parser.h
+class DocumentBuilder {
+  std::unique_ptr<Document> document;
+  PushParser parser;
+
+public:
+  DocumentBuilder(DocumentOptions options = {});
+
+  void feed(std::span<const char> chunk) { parser.feed(chunk); }
+
+  // The end of input, the builder is done afterwards
+  std::unique_ptr<Document> finish();
+};
+
+// A document which is patched while other threads keep querying it.
+//
+// Readers pin the current version with snapshot() and evaluate against it
+// without taking a lock, a pinned version never changes. One writer at a time
+// applies patches and publishes the result atomically, later snapshots see it.
+// Patches append to the arena of the current version while it has room, past
+// anything readers look at; otherwise, and once patches have doubled its
+// size, the live tree is copied to a new arena with room to spare. Old
+// versions are freed by the writer once every reader which could still see
+// them has left (epoch based reclamation).
+class VersionedDocument {
+  struct Version {
+    std::shared_ptr<Arena> arena;
+    AstNode root;
+  };
+
+  struct Retired {
+    Version *version;
+    // readers which pinned this epoch or a later one can't see the version
+    uint64_t epoch;
+  };
+
+  static constexpr uint64_t IDLE = UINT64_MAX;
+  static constexpr size_t READER_SLOTS = 64;
+
+  // the epoch a reader pinned, IDLE for free slots
+  struct alignas(64) ReaderSlot {
+    std::atomic<uint64_t> epoch{IDLE};
+  };
+
+  std::atomic<Version *> current;
+  std::atomic<uint64_t> epoch{0};
+  ReaderSlot slots[READER_SLOTS];
+
+  // everything below belongs to the writer
+  std::mutex writer;
+  std::vector<Retired> retired;
+  // nodes of the arena when it was last copied
+  size_t live;
+
+  size_t pin();
+  void publish(Version *version);
+  void reclaim();
+
+public:
+  class Snapshot {
+    VersionedDocument *owner;
+    size_t slot;
+    const Version *version;
+
+  public:
+    Snapshot(VersionedDocument *owner, size_t slot, const Version *version)
+        : owner(owner), slot(slot), version(version) {}
+    Snapshot(Snapshot &&other)
+        : owner(other.owner), slot(other.slot), version(other.version) {
+      other.owner = nullptr;
+    }
+    Snapshot(const Snapshot &) = delete;
+    Snapshot &operator=(const Snapshot &) = delete;
+    ~Snapshot();
+
+    AstNode get_root() const { return version->root; }
+    Arena &get_arena() const { return *version->arena; }
+  };
+
+  explicit VersionedDocument(std::unique_ptr<Document> document);
+  VersionedDocument(const VersionedDocument &) = delete;
+  VersionedDocument &operator=(const VersionedDocument &) = delete;
+  // there must be no snapshots left
+  ~VersionedDocument();
+
+  // Pins the current version, a couple of atomic operations
+  Snapshot snapshot();
+
+  // Same as Document::apply_patch(), readers are never blocked
+  bool apply_patch(const Document &patch, const char *&error);
+};
+
+// An expression which is parsed and optimized once, and can then be evaluated
+// against many documents. It can refer to positional parameters $1, $2, ...
+// which are bound in the EvalContext.
+class PreparedQuery {
+  mutable Arena arena;
+  AstNode expression;
+  size_t param_count;
+  std::vector<ParseError> errors;
+  std::unique_ptr<CompiledQuery> compiled;
+
+public:
+  static std::unique_ptr<PreparedQuery> prepare(std::string_view expression);
+
+  // A copy with the same nodes at the same places, without the compiled code
+  std::unique_ptr<PreparedQuery> clone() const;
+
+  // Compiles the query into native code which is used for every later
+  // evaluation, see codegen.h. Must be called before the query is shared
+  // between threads. Returns false and sets `error` if the interpreter has to
+  // be used.
+  bool compile(const char *&error);
+  const CompiledQuery *get_compiled() const { return compiled.get(); }
+
+  bool ok() const { return errors.empty(); }
+  const std::vector<ParseError> &get_errors() const { return errors; }
+
+  // the highest parameter number used by the expression
+  size_t get_param_count() const { return param_count; }
+
+  AstNode get_expression() const { return expression; }
+  Arena &get_arena() const { return arena; }
+};
+
+// The result of an evaluation. It borrows from the document and from the
+// context, so it is valid until the context evaluates again or the document
+// goes away.
+class ResultView {
+  const Value *value;
+  std::span<const AstNode> nodes;
+  Arena *arena;
+
+public:
+  ResultView(const Value *value, std::span<const AstNode> nodes, Arena *arena)
+      : value(value), nodes(nodes), arena(arena) {}
+
+  ValueKind get_kind() const { return value->get_kind(); }
+  bool ok() const { return value->get_kind() != ValueKind::ERROR; }
+
+  std::optional<double> as_number() const;
+  std::optional<bool> as_boolean() const;
+  std::optional<std::string_view> as_string() const;
+  // objects and arrays
+  std::optional<AstNode> as_json() const;
+  // the elements of a SEQUENCE or LIST result
+  std::span<const AstNode> get_nodes() const { return nodes; }
+
+  // the arena of the document, json nodes are read through it
+  Arena &get_arena() const { return *arena; }
+
+  void debug_print() const;
+
+  // Appends the result in a binary format, sequences and lists become arrays.
+  // Returns false and appends nothing if the result is an error.
+  bool encode(OutputFormat format, std::string &out) const;
+};
+
+class EvalContext {
+  ParallelOptions parallel;
+  std::vector<Value> params;
+  std::vector<EvalError> errors;
+  Value result;
+  std::vector<AstNode> nodes;
+  Profile *profile = nullptr;
+  EvalBudget budget;
+
+  ResultView evaluate(const PreparedQuery &query, Arena &arena, AstNode root);
+
+public:
+  EvalContext(ParallelOptions parallel = {}) : parallel(parallel) {}
+
+  // Binds the value of $index, parameters start from 1
+  void bind(size_t index, Value value);
+  void clear_bindings() { params.clear(); }
+
+  // Records the evaluations in `profile`, which has to be set up for the
+  // query, nullptr stops profiling. Compiled queries run on the interpreter
+  // while profiling.
+  void set_profile(Profile *profile) { this->profile = profile; }
+
+  // Limits for each later evaluation. Running out stops the evaluation with
+  // an error of the kind of the budget, the result is an error then. Compiled
+  // queries run on the interpreter while there are limits.
+  void set_budget(EvalBudget budget) { this->budget = budget; }
+
+  ResultView evaluate(const PreparedQuery &query, const Document &document) {
+    return evaluate(document.query_for(query), document.get_arena(),
+                    document.get_root());
+  }
+  // The snapshot has to stay alive as long as the result is used
+  ResultView evaluate(const PreparedQuery &query,
+                      const VersionedDocument::Snapshot &snapshot) {
+    return evaluate(query, snapshot.get_arena(), snapshot.get_root());
+  }
+
+  // errors of the last evaluation
+  const std::vector<EvalError> &get_errors() const { return errors; }
+};
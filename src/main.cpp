@@ -1,75 +1,736 @@
-#include "eval.h"
-#include "parser_driver.h"
+#include "cpu.h"
+#include "json_eval.h"
+#include "stats.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
-#include <fstream>
-#include <sstream>
+#include <glob.h>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <vector>
 
 void print_help() {
-  const char *message = "Usage: json_eval <JSON FILE> <EXPRESSION>\n";
+  const char *message =
+      "Usage: json_eval [OPTIONS] <JSON FILE>... <EXPRESSION>\n"
+      "\n"
+      "The json file is read on a separate thread while it is being parsed,\n"
+      "'-' reads from stdin. Gzip (and zstd when built with it) compressed\n"
+      "files are decompressed on the fly.\n"
+      "\n"
+      "Several files, or quoted patterns like 'logs/*.json', are spread over\n"
+      "the threads and each result is printed under the name of its file.\n"
+      "\n"
+      "Options:\n"
+      "  --threads=N            worker threads for array operations, or for\n"
+      "                         files when there are several, 0 picks the\n"
+      "                         number of cpus (default)\n"
+      "  --as-completed         prints the results of several files as soon\n"
+      "                         as they are ready instead of in order\n"
+      "  --sequential-cutoff=N  arrays up to N elements are processed on a\n"
+      "                         single thread (default 16384)\n"
+      "  --io-buffer-size=N     bytes per read ahead buffer (default 1MiB)\n"
+      "  --io-buffers=N         number of read ahead buffers (default 3)\n"
+      "  --param=VALUE          binds the next positional parameter $1, $2, ...\n"
+      "  --patch=FILE           applies a JSON Patch (add, remove, replace) to\n"
+      "                         the document before evaluating, can be repeated\n"
+      "  --hashes               keeps a hash of every object and array, equality\n"
+      "                         and distinct reject different values at once\n"
+      "  --dedup                stores identical strings, objects and arrays of\n"
+      "                         the document only once and reports the savings\n"
+      "  --format=FORMAT        json, cbor or msgpack, detected by default\n"
+      "  --output=FORMAT        text, cbor or msgpack, the binary formats only\n"
+      "                         write the result, errors go to stderr\n"
+      "  --max-depth=N          deepest nesting of json objects and arrays\n"
+      "                         (default 100000)\n"
+      "  --push-chunk=N         parses the input with the push parser, fed N\n"
+      "                         bytes at a time\n"
+      "  --benchmark            compares the json parsers and the cpu specific\n"
+      "                         kernels on generated input\n"
+      "  --cpu=VARIANT          generic, sse42, avx2 or avx512 kernels instead\n"
+      "                         of the best ones the cpu supports\n"
+      "  --stream               only reads the parts of the input a query of\n"
+      "                         fixed paths needs, stopping once they are found\n"
+      "  --compile-query        compiles the expression into native code with\n"
+      "                         the system compiler ($CXX, c++), falls back to\n"
+      "                         the interpreter if that isn't possible\n"
+      "  --stats                prints the shape of the document (depth, kinds,\n"
+      "                         sizes, common keys) and the memory it takes\n"
+      "  --max-steps=N          stops evaluating after N nodes and elements\n"
+      "  --max-bytes=N          stops evaluating once N bytes of strings and\n"
+      "                         lists are created\n"
+      "  --max-time-ms=N        stops evaluating after N milliseconds\n"
+      "  --explain              prints the optimized expression tree without\n"
+      "                         reading the document\n"
+      "  --analyze              evaluates, then prints the tree with the calls,\n"
+      "                         time, visited nodes and allocations of each node\n"
+      "  --trace=FILE           writes a Chrome trace of the evaluation, one\n"
+      "                         event per node evaluated\n";
   fprintf(stderr, "%s", message);
 }
 
+// Parameters are numbers or booleans when they look like one, strings
+// otherwise
+Value parse_param(const char *text) {
+  if (std::strcmp(text, "true") == 0) {
+    return Value::boolean(true);
+  }
+  if (std::strcmp(text, "false") == 0) {
+    return Value::boolean(false);
+  }
+  char *end = nullptr;
+  double number = std::strtod(text, &end);
+  if (end != text && *end == '\0') {
+    return Value::number(number);
+  }
+  return Value::string(text);
+}
+
 struct CliOptions {
   bool benchmark;
+  size_t max_depth = ParseOptions().max_depth;
+  InputFormat format = InputFormat::AUTO;
+  OutputFormat output = OutputFormat::TEXT;
+  // feed the input to the push parser in pieces of this size
+  size_t push_chunk;
+  bool compile_query;
+  bool stream;
+  bool hashes;
+  bool dedup;
+  bool as_completed;
+  bool stats;
+  bool explain;
+  bool analyze;
+  const char *trace;
+  EvalBudget budget;
+  size_t threads = 0;
+  size_t sequential_cutoff = ParallelOptions().sequential_cutoff;
+  size_t io_buffer_size = ReadAheadOptions().buffer_size;
+  size_t io_buffers = ReadAheadOptions().buffers;
+  std::vector<const char *> params;
+  std::vector<const char *> patches;
 };
 
+// Matches `--name=value` and stores the value, returns false if `arg` is a
+// different option or the value isn't a number.
+bool parse_size_option(const char *arg, const char *name, size_t &out) {
+  size_t len = std::strlen(name);
+  if (std::strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+  char *end = nullptr;
+  unsigned long long value = std::strtoull(arg + len + 1, &end, 10);
+  if (end == arg + len + 1 || *end != '\0') {
+    return false;
+  }
+  out = (size_t)value;
+  return true;
+}
+
+bool parse_format(const char *name, InputFormat &out) {
+  if (std::strcmp(name, "json") == 0) {
+    out = InputFormat::JSON;
+  } else if (std::strcmp(name, "cbor") == 0) {
+    out = InputFormat::CBOR;
+  } else if (std::strcmp(name, "msgpack") == 0) {
+    out = InputFormat::MSGPACK;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+bool parse_output(const char *name, OutputFormat &out) {
+  if (std::strcmp(name, "text") == 0) {
+    out = OutputFormat::TEXT;
+  } else if (std::strcmp(name, "cbor") == 0) {
+    out = OutputFormat::CBOR;
+  } else if (std::strcmp(name, "msgpack") == 0) {
+    out = OutputFormat::MSGPACK;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// The best of a few runs of `run`, in MB/s of `bytes`
+template <typename F> double best_throughput(size_t bytes, F run) {
+  double best = 0;
+  for (int i = 0; i < 5; i++) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - start;
+    best = std::max(best, bytes / elapsed.count() / 1e6);
+  }
+  return best;
+}
+
+// Parsing and aggregation with each variant of the kernels of cpu.h
+void benchmark_kernels(const std::string &shallow) {
+  // ascii strings, and text with some two and three byte UTF-8 characters
+  // which have to be validated
+  std::string strings = "[";
+  std::string unicode = "[";
+  std::string numbers = "{\"x\": [";
+  for (int i = 0; i < 1000000; i++) {
+    if (i > 0) {
+      strings += ",";
+      unicode += ",";
+      numbers += ",";
+    }
+    if (i < 100000) {
+      strings += '"';
+      strings.append(20 + i % 100, 'a' + i % 26);
+      strings += '"';
+      unicode += "\"";
+      for (int j = 0; j < 4 + i % 20; j++) {
+        unicode += j % 4 == 0 ? "d\xc3\xa9j\xc3\xa0 "
+                              : "\xe4\xb8\xad\xe6\x96\x87 text ";
+      }
+      unicode += "\"";
+    }
+    numbers += std::to_string(i % 1000 * 1.5);
+  }
+  strings += "]";
+  unicode += "]";
+  numbers += "]}";
+
+  std::unique_ptr<Document> document = Document::from_buffer(numbers);
+  std::unique_ptr<PreparedQuery> query = PreparedQuery::prepare("max(x)");
+  Arena &arena = document->get_arena();
+  AstNode x = arena.as_array_like(document->get_root()).value()[1];
+  size_t count = arena.as_array_like(x)->size();
+
+  CpuFeatures cpu = detect_cpu();
+  printf("\ncpu:%s%s%s%s\n", cpu.sse42 ? " sse4.2" : "",
+         cpu.avx2 ? " avx2" : "", cpu.bmi2 ? " bmi2" : "",
+         cpu.avx512 ? " avx512" : "");
+  const Kernels *selected = active_kernels;
+  for (const Kernels *variant : supported_kernels()) {
+    active_kernels = variant;
+    auto parse = [](const std::string &json) {
+      Arena arena;
+      StringSource source(json);
+      Parser parser(source);
+      parse_json(parser, arena);
+    };
+    double objects =
+        best_throughput(shallow.size(), [&] { parse(shallow); });
+    double text = best_throughput(strings.size(), [&] { parse(strings); });
+    double utf8 = best_throughput(unicode.size(), [&] { parse(unicode); });
+    EvalContext context;
+    double max = best_throughput(count * sizeof(AstNode),
+                                 [&] { context.evaluate(*query, *document); });
+    printf("%-8s shallow %7.1f  strings %7.1f  unicode %7.1f  max %7.1f "
+           "MB/s\n",
+           variant->name, objects, text, utf8, max);
+  }
+  active_kernels = selected;
+}
+
+// Throughput of the json parsers on generated documents, a wide one made of
+// small objects and a deeply nested one
+void run_benchmark() {
+  std::string shallow = "[";
+  for (int i = 0; i < 200000; i++) {
+    if (i > 0) {
+      shallow += ",";
+    }
+    shallow += "{\"id\": " + std::to_string(i) +
+               ", \"name\": \"item\", \"tags\": [1, 2, 3]}";
+  }
+  shallow += "]";
+
+  std::string deep = "[";
+  for (int i = 0; i < 500; i++) {
+    if (i > 0) {
+      deep += ",";
+    }
+    deep += std::string(2000, '[') + "1" + std::string(2000, ']');
+  }
+  deep += "]";
+
+  struct Input {
+    const char *name;
+    const std::string &json;
+  };
+  Input inputs[] = {{"shallow", shallow}, {"deep", deep}};
+
+  for (const Input &input : inputs) {
+    for (const char *name : {"iterative", "recursive", "push"}) {
+      double best = best_throughput(input.json.size(), [&] {
+        Arena arena;
+        StringSource source(input.json);
+        Parser parser(source);
+        if (std::strcmp(name, "recursive") == 0) {
+          parse_json_recursive(parser, arena);
+        } else if (std::strcmp(name, "push") == 0) {
+          // the way it would be fed from a socket
+          PushParser push(arena);
+          std::span<const char> data(input.json.data(), input.json.size());
+          for (size_t at = 0; at < data.size(); at += 64 * 1024) {
+            push.feed(data.subspan(at, std::min<size_t>(64 * 1024,
+                                                        data.size() - at)));
+          }
+          push.finish();
+        } else {
+          parse_json(parser, arena);
+        }
+      });
+      printf("%-8s %-10s %8.1f MB/s\n", input.name, name, best);
+    }
+  }
+
+  benchmark_kernels(shallow);
+}
+
+// Loads the file through a DocumentBuilder, as if it arrived `chunk` bytes at
+// a time
+std::unique_ptr<Document> push_file(const char *path,
+                                    ReadAheadOptions read_ahead,
+                                    const char *&error,
+                                    DocumentOptions options, size_t chunk) {
+  std::unique_ptr<InputSource> input = open_input(path, read_ahead, error);
+  if (!input) {
+    return nullptr;
+  }
+  DocumentBuilder builder(options);
+  while (true) {
+    std::span<const char> data = input->next_chunk();
+    if (data.empty()) {
+      break;
+    }
+    while (!data.empty()) {
+      size_t len = std::min(chunk, data.size());
+      builder.feed(data.first(len));
+      data = data.subspan(len);
+    }
+  }
+  return builder.finish();
+}
+
+void report_parse_errors(FILE *out, const char *filename,
+                         const std::vector<ParseError> &json,
+                         const std::vector<ParseError> &expression) {
+  if (!json.empty() || !expression.empty()) {
+    fprintf(out, "\n<<Errors>>\n");
+  }
+  for (const ParseError &error : json) {
+    fprintf(out, "%s:%d:%d %s\n", filename, error.line, error.column,
+            error.message);
+  }
+  for (const ParseError &error : expression) {
+    fprintf(out, "<expression>:%d:%d %s\n", error.line, error.column,
+            error.message);
+  }
+}
+
+bool has_wildcards(const char *path) {
+  return std::strpbrk(path, "*?[") != nullptr;
+}
+
+// Expands the patterns among `patterns` into the files they match, in sorted
+// order. Returns false if a pattern doesn't match anything.
+bool expand_paths(const std::vector<const char *> &patterns,
+                  std::vector<std::string> &paths) {
+  bool ok = true;
+  for (const char *pattern : patterns) {
+    if (!has_wildcards(pattern)) {
+      paths.push_back(pattern);
+      continue;
+    }
+    glob_t matches;
+    if (glob(pattern, 0, nullptr, &matches) == 0) {
+      for (size_t i = 0; i < matches.gl_pathc; i++) {
+        paths.push_back(matches.gl_pathv[i]);
+      }
+    } else {
+      fprintf(stderr, "No files match '%s'\n", pattern);
+      ok = false;
+    }
+    globfree(&matches);
+  }
+  return ok;
+}
+
+// The result of one of several files, under its name. Binary formats write
+// a [name, result] array per file, with null for errors which go to stderr.
+// Returns false if the file couldn't be read, or if the result of a binary
+// format is an error.
+bool print_file_result(const char *path, const Document *document,
+                       const char *open_error, const EvalContext &context,
+                       const ResultView *result, OutputFormat format) {
+  bool text = format == OutputFormat::TEXT;
+  FILE *errors = text ? stdout : stderr;
+  if (text) {
+    printf("\n<<%s>>\n", path);
+  }
+  if (document == nullptr) {
+    fprintf(errors, "%s '%s'\n", open_error, path);
+  } else {
+    report_parse_errors(errors, path, document->get_errors(), {});
+  }
+
+  if (text && result != nullptr) {
+    result->debug_print();
+  } else if (!text) {
+    std::string encoded;
+    Encoder encoder(format, encoded);
+    encoder.array(2);
+    encoder.string(path);
+    if (result == nullptr || !result->encode(format, encoded)) {
+      encoder.nil();
+    }
+    fwrite(encoded.data(), 1, encoded.size(), stdout);
+  }
+
+  if (result != nullptr && !context.get_errors().empty()) {
+    fprintf(errors, "\n<<Errors>>\n");
+    for (const EvalError &error : context.get_errors()) {
+      if (text) {
+        fprintf(errors, "%s\n", error.message);
+      } else {
+        fprintf(errors, "%s: %s\n", path, error.message);
+      }
+    }
+  }
+  return result != nullptr && (text || result->ok());
+}
+
+// Evaluates the query on every file. Each worker takes the next file when it
+// is done with one, and keeps its document and context, so the memory of the
+// arena is reused from one file to the next. Results are printed in the order
+// of the files unless `as_completed` is set, a worker waits for its turn
+// before it moves on. Returns false if any file failed.
+bool run_files(const std::vector<std::string> &paths,
+               const PreparedQuery &query, const CliOptions &options,
+               ReadAheadOptions read_ahead, DocumentOptions document_options,
+               ThreadPool *pool) {
+  std::atomic<size_t> next_file{0};
+  std::mutex output;
+  std::condition_variable turn;
+  size_t printed = 0;
+  bool ok = true;
+
+  auto worker = [&]() {
+    Document reused;
+    EvalContext context;
+    for (size_t i = 0; i < options.params.size(); i++) {
+      context.bind(i + 1, parse_param(options.params[i]));
+    }
+    context.set_budget(options.budget);
+
+    while (true) {
+      size_t index = next_file.fetch_add(1);
+      if (index >= paths.size()) {
+        return;
+      }
+      const char *path = paths[index].c_str();
+      const char *open_error = nullptr;
+      std::unique_ptr<Document> loaded;
+      const Document *document = &reused;
+      if (options.stream) {
+        loaded = Document::stream_file(path, query, read_ahead, open_error,
+                                       document_options);
+        document = loaded.get();
+      } else if (options.push_chunk > 0) {
+        loaded = push_file(path, read_ahead, open_error, document_options,
+                           options.push_chunk);
+        document = loaded.get();
+      } else if (!reused.load_file(path, read_ahead, open_error,
+                                   document_options)) {
+        document = nullptr;
+      }
+
+      std::optional<ResultView> result;
+      if (document != nullptr) {
+        result = context.evaluate(query, *document);
+      }
+
+      std::unique_lock<std::mutex> lock(output);
+      if (!options.as_completed) {
+        turn.wait(lock, [&] { return printed == index; });
+      }
+      ok &= print_file_result(path, document, open_error, context,
+                              result ? &*result : nullptr, options.output);
+      printed++;
+      turn.notify_all();
+    }
+  };
+
+  if (pool == nullptr) {
+    worker();
+  } else {
+    TaskGroup group(*pool);
+    for (size_t i = 0; i < pool->size(); i++) {
+      group.run(worker);
+    }
+    group.wait();
+  }
+  fflush(stdout);
+  return ok;
+}
+
 int main(int argc, const char *argv[]) {
-  for (int i = 0; i < argc; i++) {
-    if (std::strcmp(argv[i], "--help") == 0) {
+  CliOptions options{};
+  std::vector<const char *> positional;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (std::strcmp(arg, "--help") == 0) {
       print_help();
       return 0;
+    } else if (parse_size_option(arg, "--threads", options.threads)) {
+    } else if (parse_size_option(arg, "--sequential-cutoff",
+                                 options.sequential_cutoff)) {
+    } else if (parse_size_option(arg, "--io-buffer-size",
+                                 options.io_buffer_size)) {
+    } else if (parse_size_option(arg, "--io-buffers", options.io_buffers)) {
+    } else if (parse_size_option(arg, "--max-depth", options.max_depth)) {
+    } else if (parse_size_option(arg, "--push-chunk", options.push_chunk)) {
+    } else if (parse_size_option(arg, "--max-steps", options.budget.steps)) {
+    } else if (parse_size_option(arg, "--max-bytes", options.budget.bytes)) {
+    } else if (parse_size_option(arg, "--max-time-ms",
+                                 options.budget.milliseconds)) {
+    } else if (std::strncmp(arg, "--format=", 9) == 0) {
+      if (!parse_format(arg + 9, options.format)) {
+        printf("Unknown format '%s'\n", arg + 9);
+        return 1;
+      }
+    } else if (std::strncmp(arg, "--output=", 9) == 0) {
+      if (!parse_output(arg + 9, options.output)) {
+        printf("Unknown output format '%s'\n", arg + 9);
+        return 1;
+      }
+    } else if (std::strncmp(arg, "--cpu=", 6) == 0) {
+      const char *error = nullptr;
+      if (!select_kernels(arg + 6, error)) {
+        printf("%s '%s'\n", error, arg + 6);
+        return 1;
+      }
+    } else if (std::strcmp(arg, "--benchmark") == 0) {
+      options.benchmark = true;
+    } else if (std::strcmp(arg, "--hashes") == 0) {
+      options.hashes = true;
+    } else if (std::strcmp(arg, "--dedup") == 0) {
+      options.dedup = true;
+    } else if (std::strcmp(arg, "--stream") == 0) {
+      options.stream = true;
+    } else if (std::strcmp(arg, "--compile-query") == 0) {
+      options.compile_query = true;
+    } else if (std::strcmp(arg, "--as-completed") == 0) {
+      options.as_completed = true;
+    } else if (std::strcmp(arg, "--stats") == 0) {
+      options.stats = true;
+    } else if (std::strcmp(arg, "--explain") == 0) {
+      options.explain = true;
+    } else if (std::strcmp(arg, "--analyze") == 0) {
+      options.analyze = true;
+    } else if (std::strncmp(arg, "--trace=", 8) == 0) {
+      options.trace = arg + 8;
+    } else if (std::strncmp(arg, "--param=", 8) == 0) {
+      options.params.push_back(arg + 8);
+    } else if (std::strncmp(arg, "--patch=", 8) == 0) {
+      options.patches.push_back(arg + 8);
+    } else if (std::strncmp(arg, "--", 2) == 0) {
+      printf("Unknown option '%s'\n", arg);
+      print_help();
+      return 1;
+    } else {
+      positional.push_back(arg);
     }
   }
 
+  if (options.benchmark) {
+    run_benchmark();
+    return 0;
+  }
+
   const char *path = "/dev/null";
   const char *expression = "";
 
-  if (argc > 1) {
-    path = argv[1];
+  if (positional.size() > 0) {
+    path = positional[0];
   }
-  if (argc > 2) {
-    expression = argv[2];
+  if (positional.size() > 1) {
+    expression = positional.back();
   }
+  // any number of files before the expression
+  bool many_files = positional.size() > 2 ||
+                    (positional.size() == 2 && has_wildcards(path));
 
-  // argv[0] is the executable path, so we expect 3 args in total
-  if (argc != 3) {
+  if (positional.size() != 2 && !options.stats && !many_files) {
     printf("Expected 2 arguments\n");
     // print_help();
     // return 1;
   }
 
-  std::ifstream file(path);
-  if (file.fail()) {
-    printf("Couldn't open file '%s'", path);
+  ReadAheadOptions read_ahead;
+  read_ahead.buffer_size = options.io_buffer_size;
+  read_ahead.buffers = options.io_buffers;
+  DocumentOptions document_options;
+  document_options.arena.hashes = options.hashes;
+  document_options.arena.dedup = options.dedup;
+  document_options.parse.max_depth = options.max_depth;
+  document_options.parse.format = options.format;
+  std::unique_ptr<PreparedQuery> query = PreparedQuery::prepare(expression);
+
+  if (options.explain) {
+    printf("\n<<Explain>>\n");
+    print_plan(stdout, query->get_expression(), query->get_arena(), nullptr);
+    report_parse_errors(stdout, path, {}, query->get_errors());
+    return query->ok() ? 0 : 1;
+  }
+
+  if (options.stream &&
+      !streamable(query->get_expression(), query->get_arena())) {
+    fprintf(stderr, "The query can't be streamed, reading all of it\n");
+    options.stream = false;
+  }
+
+  std::optional<ThreadPool> pool;
+  ParallelOptions parallel;
+  if (options.threads != 1) {
+    pool.emplace(options.threads);
+    parallel.pool = &*pool;
+  }
+  parallel.sequential_cutoff = options.sequential_cutoff;
+
+  if (many_files) {
+    if (!options.patches.empty() || options.stats || options.analyze ||
+        options.trace != nullptr) {
+      printf("--patch, --stats, --analyze and --trace take a single file\n");
+      return 1;
+    }
+    std::vector<std::string> paths;
+    bool matched = expand_paths(
+        std::vector<const char *>(positional.begin(), positional.end() - 1),
+        paths);
+    const char *compile_error = nullptr;
+    if (options.compile_query && !query->compile(compile_error)) {
+      fprintf(stderr, "%s, using the interpreter\n", compile_error);
+    }
+    report_parse_errors(options.output == OutputFormat::TEXT ? stdout : stderr,
+                        path, {}, query->get_errors());
+    bool ok = run_files(paths, *query, options, read_ahead, document_options,
+                        parallel.pool);
+    return matched && ok ? 0 : 1;
+  }
+
+  const char *open_error = nullptr;
+  std::unique_ptr<Document> document;
+  if (options.stream) {
+    document = Document::stream_file(path, *query, read_ahead, open_error,
+                                     document_options);
+  } else if (options.push_chunk > 0) {
+    document = push_file(path, read_ahead, open_error, document_options,
+                         options.push_chunk);
+  } else {
+    document = Document::from_file(path, read_ahead, open_error,
+                                   document_options);
+  }
+  if (!document) {
+    printf("%s '%s'\n", open_error, path);
     return 1;
   }
 
-  Arena arena{};
-  Parser parser{};
+  for (const char *patch_path : options.patches) {
+    std::unique_ptr<Document> patch =
+        Document::from_file(patch_path, read_ahead, open_error);
+    if (!patch) {
+      printf("%s '%s'\n", open_error, patch_path);
+      return 1;
+    }
+    const char *patch_error = nullptr;
+    if (!document->apply_patch(*patch, patch_error)) {
+      printf("%s: %s\n", patch_path, patch_error);
+      return 1;
+    }
+  }
+
+  if (options.stats) {
+    Arena &arena = document->get_arena();
+    DocumentStats stats =
+        document_stats(arena, document->get_root(), parallel);
+    printf("\n<<Stats>>\n");
+    print_stats(stdout, stats, arena.usage());
+    report_parse_errors(stdout, path, document->get_errors(), {});
+    return 0;
+  }
+
+  const char *compile_error = nullptr;
+  if (options.compile_query && !query->compile(compile_error)) {
+    fprintf(stderr, "%s, using the interpreter\n", compile_error);
+  }
 
-  parser.set_new_input(file);
-  auto json = parse_json(parser, arena);
+  bool text = options.output == OutputFormat::TEXT;
+  if (text) {
+    printf("\n<<Json>>\n");
+    document->get_arena().debug_print(document->get_root());
 
-  std::istringstream expr(expression);
-  parser.set_new_input(expr);
-  auto ex = parse_expression(parser, arena);
+    printf("\n<<Expression>>\n");
+    query->get_arena().debug_print(query->get_expression());
+  }
 
-  printf("\n<<Json>>\n");
-  arena.debug_print(json);
+  report_parse_errors(text ? stdout : stderr, path, document->get_errors(),
+                      query->get_errors());
 
-  printf("\n<<Expression>>\n");
-  arena.debug_print(ex);
+  if (options.dedup && text) {
+    const DedupStats &saved = document->get_arena().get_dedup_stats();
+    printf("\n<<Dedup>>\n");
+    printf("nodes: %zu (%zu bytes)\n", saved.nodes,
+           saved.nodes * sizeof(AstNode));
+    printf("strings: %zu bytes\n", saved.string_bytes);
+  }
 
-  parser.report_errors(path);
+  if (text) {
+    printf("\n<<Eval>>\n");
+  }
 
-  printf("\n<<Eval>>\n");
-  Evaluator ev(arena, json);
+  EvalContext context(parallel);
+  for (size_t i = 0; i < options.params.size(); i++) {
+    context.bind(i + 1, parse_param(options.params[i]));
+  }
+  context.set_budget(options.budget);
+  std::optional<Profile> profile;
+  if (options.analyze || options.trace != nullptr) {
+    profile.emplace(query->get_expression(), query->get_arena(),
+                    options.trace != nullptr);
+    context.set_profile(&*profile);
+  }
+  ResultView result = context.evaluate(*query, *document);
+  if (text) {
+    result.debug_print();
+  } else {
+    std::string encoded;
+    if (result.encode(options.output, encoded)) {
+      fwrite(encoded.data(), 1, encoded.size(), stdout);
+    }
+  }
 
-  Value v = eval(ex, ev);
-  v.debug_print(arena);
+  FILE *errors = text ? stdout : stderr;
+  if (!context.get_errors().empty()) {
+    fprintf(errors, "\n<<Errors>>\n");
+  }
+  for (const EvalError &error : context.get_errors()) {
+    fprintf(errors, "%s\n", error.message);
+  }
 
-  ev.report_errors();
-  return 0;
+  if (options.analyze) {
+    fprintf(errors, "\n<<Analyze>>\n");
+    print_plan(errors, query->get_expression(), query->get_arena(),
+               &*profile);
+  }
+  const char *trace_error = nullptr;
+  if (options.trace != nullptr &&
+      !profile->write_trace(options.trace, trace_error)) {
+    fprintf(stderr, "%s '%s'\n", trace_error, options.trace);
+    return 1;
+  }
+  return text || result.ok() ? 0 : 1;
 }
@@ -0,0 +1,107 @@
+#include "optimize.h"
+#include "eval.h"
+
+#include <vector>
+
+static bool is_constant(AstNode node) {
+  switch (node.get_kind()) {
+  case NodeKind::STRING:
+  case NodeKind::NUMBER:
+  case NodeKind::BOOLEAN:
+  case NodeKind::NIL:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Functions whose result only depends on their arguments
+static bool is_foldable(NodeKind kind) {
+  switch (kind) {
+  case NodeKind::Add:
+  case NodeKind::Sub:
+  case NodeKind::Mul:
+  case NodeKind::Div:
+  case NodeKind::Eq:
+  case NodeKind::Ne:
+  case NodeKind::Lt:
+  case NodeKind::Le:
+  case NodeKind::Gt:
+  case NodeKind::Ge:
+  case NodeKind::And:
+  case NodeKind::Or:
+  case NodeKind::Max:
+  case NodeKind::Min:
+  case NodeKind::Sum:
+  case NodeKind::Size:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static std::optional<AstNode> constant_node(Value &value, Arena &arena) {
+  switch (value.get_kind()) {
+  case ValueKind::NUMBER:
+    return AstNode::number(value.get_data().number);
+  case ValueKind::BOOLEAN:
+    return AstNode::boolean(value.get_data().boolean);
+  case ValueKind::NIL:
+    return AstNode::nil();
+  case ValueKind::STRING: {
+    StringIndex start = arena.string_position();
+    for (char c : value.get_data().string) {
+      arena.string_push(c);
+    }
+    return arena.finish_string(start);
+  }
+  default:
+    return {};
+  }
+}
+
+static AstNode optimize(AstNode expression, Arena &arena, bool &changed) {
+  NodeKind kind = expression.get_kind();
+  if (!kind_is_function(kind) || !kind_is_array_like(kind)) {
+    return expression;
+  }
+
+  // copied out, pushing new nodes can move the arena
+  std::span<AstNode> args = arena.as_array_like(expression).value();
+  std::vector<AstNode> children(args.begin(), args.end());
+
+  bool children_changed = false;
+  bool all_constant = true;
+  for (AstNode &child : children) {
+    child = optimize(child, arena, children_changed);
+    all_constant = all_constant && is_constant(child);
+  }
+
+  if (children_changed) {
+    NodeIndex start = arena.nodes_push(children[0]);
+    for (size_t i = 1; i < children.size(); i++) {
+      arena.nodes_push(children[i]);
+    }
+    expression = AstNode::function(kind, start, children.size());
+    changed = true;
+  }
+
+  if (all_constant && is_foldable(kind)) {
+    Evaluator ev(arena, AstNode::nil());
+    Value value = eval(expression, ev);
+    if (ev.errors.empty()) {
+      std::optional<AstNode> folded = constant_node(value, arena);
+      if (folded.has_value()) {
+        changed = true;
+        return *folded;
+      }
+    }
+  }
+
+  return expression;
+}
+
+AstNode optimize_expression(AstNode expression, Arena &arena) {
+  bool changed = false;
+  return optimize(expression, arena, changed);
+}
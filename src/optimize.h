@@ -0,0 +1,9 @@
+#pragma once
+
+#include "ast.h"
+
+// Rewrites an expression into an equivalent one which is cheaper to evaluate,
+// currently subexpressions which don't depend on the document or on
+// parameters are evaluated up front. Rewritten nodes are appended to the
+// arena, the original expression is left as is.
+AstNode optimize_expression(AstNode expression, Arena &arena);
@@ -1,4 +1,7 @@
 #include "parser.h"
+#include "cpu.h"
+
+#include <cstring>
 
 int Parser::next() {
   if (current == '\n') {
@@ -9,10 +12,27 @@ int Parser::next() {
   }
 
   int prev = current;
-  current = file->get();
+  current = read();
   return prev;
 }
 
+bool Parser::refill() {
+  while (source != nullptr) {
+    std::span<const char> chunk = source->next_chunk();
+    if (chunk.empty()) {
+      if (source->error() != nullptr) {
+        error(source->error());
+      }
+      source = nullptr;
+      break;
+    }
+    cursor = chunk.data();
+    end = chunk.data() + chunk.size();
+    return true;
+  }
+  return false;
+}
+
 int Parser::eat(char c) {
   int peek = current;
   if (peek == c) {
@@ -25,17 +45,27 @@ int Parser::eat(char c) {
 bool Parser::at(char c) const { return current == c; }
 
 void Parser::consume_whitespace() {
-  while (true) {
-    switch (current) {
-    case ' ':
-    case '\n':
-    case '\r':
-    case '\t':
-      next();
-      continue;
-    default:
-      return;
+  size_t (*skip_whitespace)(const char *, size_t) = kernels().skip_whitespace;
+  while (current == ' ' || current == '\n' || current == '\r' ||
+         current == '\t') {
+    // the current byte and the rest of the run in this chunk
+    const char *run_end = cursor + skip_whitespace(cursor, end - cursor);
+    if (current == '\n') {
+      line++;
+      column = 0;
+    } else {
+      column++;
+    }
+    const char *line_start = cursor;
+    while (const void *newline =
+               memchr(line_start, '\n', run_end - line_start)) {
+      line++;
+      column = 0;
+      line_start = (const char *)newline + 1;
     }
+    column += (int)(run_end - line_start);
+    cursor = run_end;
+    current = read();
   }
 }
 
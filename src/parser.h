@@ -1,34 +1,62 @@
 #pragma once
 
-#include <istream>
+#include "input.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <string_view>
 #include <vector>
 
-class Parser {
-  struct ParseError {
-    int line;
-    int column;
-    const char *message;
-  };
+struct ParseError {
+  int line;
+  int column;
+  const char *message;
+};
 
-  std::istream *file;
+class Parser {
+  InputSource *source;
+  // the unread part of the current chunk
+  const char *cursor;
+  const char *end;
   int current;
   int line;
   int column;
   std::vector<ParseError> errors;
 
-public:
-  Parser() : file(nullptr), current(0), line(0), column(0) {}
-  Parser(std::istream &input) : file(&input), line(0), column(0) {
-    current = file->get();
+  // Fetches the next chunk, returns false at the end of input
+  bool refill();
+
+  int read() {
+    if (cursor == end && !refill()) {
+      return EOF;
+    }
+    return (unsigned char)*cursor++;
   }
 
-  void set_new_input(std::istream &input) {
-    file = &input;
-    current = file->get();
+public:
+  Parser()
+      : source(nullptr), cursor(nullptr), end(nullptr), current(EOF), line(0),
+        column(0) {}
+  Parser(InputSource &input) : Parser() { set_new_input(input); }
+
+  void set_new_input(InputSource &input) {
+    source = &input;
+    cursor = nullptr;
+    end = nullptr;
+    current = read();
   }
 
   int peek() const { return current; }
 
+  // The current byte and the rest of the chunk it is in, empty at the end of
+  // input. Looking at them doesn't consume anything.
+  std::string_view buffered() const {
+    if (current == EOF) {
+      return {};
+    }
+    return std::string_view(cursor - 1, end);
+  }
+
   int next();
 
   template <typename F> int try_consume(F fun) {
@@ -40,11 +68,69 @@ public:
     return 0;
   }
 
+  // Consumes a byte of binary input, which has no lines
+  int next_byte() {
+    int prev = current;
+    if (prev != EOF) {
+      column++;
+      current = read();
+    }
+    return prev;
+  }
+
+  // Consumes `n` bytes of binary input, passing them to `fun` as a pointer
+  // and a length, in as few pieces as the input buffers allow. Returns false
+  // if the input ends first.
+  template <typename F> bool consume_bytes(size_t n, F fun) {
+    while (n > 0) {
+      if (current == EOF) {
+        return false;
+      }
+      char c = (char)current;
+      fun(&c, (size_t)1);
+      n--;
+      size_t len = std::min(n, (size_t)(end - cursor));
+      if (len > 0) {
+        fun(cursor, len);
+        cursor += len;
+        n -= len;
+      }
+      column += (int)(1 + len);
+      current = read();
+    }
+    return true;
+  }
+
+  // Consumes the run of bytes from the current one which `scan` accepts,
+  // passing them to `fun` as a pointer and a length. `scan(chars, len)`
+  // returns the length of the accepted prefix, like the kernels of cpu.h, and
+  // must not accept newlines.
+  template <typename S, typename F> void consume_run(S scan, F fun) {
+    while (current != EOF) {
+      // the current byte is the last one read from the chunk
+      const char *start = cursor - 1;
+      size_t len = scan(start, (size_t)(end - start));
+      if (len == 0) {
+        return;
+      }
+      fun(start, len);
+      column += (int)len;
+      cursor = start + len;
+      bool rest = cursor < end;
+      current = read();
+      if (rest) {
+        return;
+      }
+    }
+  }
+
   int eat(char c);
   bool at(char c) const;
 
   void consume_whitespace();
 
   void error(const char *message);
+  const std::vector<ParseError> &get_errors() const { return errors; }
+  void clear_errors() { errors.clear(); }
   void report_errors(const char *filename);
 };
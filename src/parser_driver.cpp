@@ -1,43 +1,158 @@
 #include "parser_driver.h"
+#include "cpu.h"
 
 #include <cassert>
 #include <charconv>
 #include <climits>
+#include <cmath>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <optional>
 
-void hex_escape(Parser &p, Arena &arena);
+void unicode_escape(Parser &p, Arena &arena);
 AstNode string(Parser &p, Arena &arena);
 AstNode number(Parser &p, Arena &arena);
 std::optional<AstNode> json_value(Parser &p, Arena &arena);
 AstNode json_array(Parser &p, Arena &arena);
 AstNode json_object(Parser &p, Arena &arena);
 
-// u[0-9abcdf]{4}
-void hex_escape(Parser &p, Arena &arena) {
-  uint8_t value = 0;
-  for (int j = 0; j < 2; j++) {
-    for (int i = 0; i < 2; i++) {
-      int c = p.peek();
+int hex_digit(int c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  } else if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  } else if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  return -1;
+}
 
-      if (c >= '0' && c <= '9')
-        c -= '0';
-      else if (c >= 'A' && c <= 'F')
-        c -= 'A' - 10;
-      else if (c >= 'a' && c <= 'f')
-        c -= 'a' - 10;
-      else {
-        p.error("Expected hexadecimal");
-        return;
-      }
+void string_push_utf8(Arena &arena, uint32_t code_point) {
+  if (code_point < 0x80) {
+    arena.string_push((char)code_point);
+  } else if (code_point < 0x800) {
+    arena.string_push((char)(0xc0 | code_point >> 6));
+    arena.string_push((char)(0x80 | (code_point & 0x3f)));
+  } else if (code_point < 0x10000) {
+    arena.string_push((char)(0xe0 | code_point >> 12));
+    arena.string_push((char)(0x80 | (code_point >> 6 & 0x3f)));
+    arena.string_push((char)(0x80 | (code_point & 0x3f)));
+  } else {
+    arena.string_push((char)(0xf0 | code_point >> 18));
+    arena.string_push((char)(0x80 | (code_point >> 12 & 0x3f)));
+    arena.string_push((char)(0x80 | (code_point >> 6 & 0x3f)));
+    arena.string_push((char)(0x80 | (code_point & 0x3f)));
+  }
+}
+
+uint32_t combine_surrogates(uint32_t high, uint32_t low) {
+  return 0x10000 + ((high - 0xd800) << 10 | (low - 0xdc00));
+}
+
+// [0-9a-fA-F]{4}
+static std::optional<uint32_t> hex_unit(Parser &p) {
+  uint32_t unit = 0;
+  for (int i = 0; i < 4; i++) {
+    int digit = hex_digit(p.peek());
+    if (digit < 0) {
+      p.error("Expected hexadecimal");
+      return {};
+    }
+    p.next();
+    unit = unit << 4 | digit;
+  }
+  return unit;
+}
+
+// The digits of a \u escape. A high surrogate has to be followed by an
+// escaped low one, together they stand for a code point past U+FFFF.
+// Surrogates without their other half become U+FFFD.
+void unicode_escape(Parser &p, Arena &arena) {
+  std::optional<uint32_t> unit = hex_unit(p);
+  while (unit.has_value()) {
+    if (is_low_surrogate(*unit)) {
+      p.error("Unpaired surrogate");
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+      return;
+    }
+    if (!is_high_surrogate(*unit)) {
+      string_push_utf8(arena, *unit);
+      return;
+    }
+    if (!p.eat('\\')) {
+      p.error("Unpaired surrogate");
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+      return;
+    }
+    if (!p.eat('u')) {
+      p.error("Unpaired surrogate");
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+      arena.string_push(unescape(p.next()));
+      return;
+    }
+    std::optional<uint32_t> low = hex_unit(p);
+    if (low.has_value() && is_low_surrogate(*low)) {
+      string_push_utf8(arena, combine_surrogates(*unit, *low));
+      return;
+    }
+    if (low.has_value()) {
+      p.error("Unpaired surrogate");
+    }
+    string_push_utf8(arena, REPLACEMENT_CHARACTER);
+    unit = low;
+  }
+}
 
-      p.next();
-      value <<= 4;
-      value |= static_cast<uint8_t>(c);
+// A sequence of non ascii bytes the string kernel stopped at, because it's
+// invalid or continues in the next chunk. Invalid sequences become U+FFFD, a
+// byte which can't continue the sequence isn't part of it.
+static void utf8_sequence(Parser &p, Arena &arena) {
+  Utf8Lead lead = utf8_lead(p.peek());
+  if (lead.len == 0) {
+    p.error("Invalid UTF-8");
+    p.next();
+    string_push_utf8(arena, REPLACEMENT_CHARACTER);
+    return;
+  }
+  StringIndex start = arena.string_position();
+  arena.string_push((char)p.next());
+  int lower = lead.lower;
+  int upper = lead.upper;
+  for (int i = 1; i < lead.len; i++) {
+    int c = p.peek();
+    if (c < lower || c > upper) {
+      p.error("Invalid UTF-8");
+      arena.string_truncate(start);
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+      return;
     }
-    arena.string_push(static_cast<char>(value));
+    arena.string_push((char)p.next());
+    lower = 0x80;
+    upper = 0xbf;
+  }
+}
+
+char unescape(int c) {
+  switch (c) {
+  case '"':
+    return '"';
+  case '/':
+    return '/';
+  case '\\':
+    return '\\';
+  case 'b':
+    return '\b';
+  case 'f':
+    return '\f';
+  case 'n':
+    return '\n';
+  case 'r':
+    return '\r';
+  case 't':
+    return '\t';
+  default:
+    return '\\';
   }
 }
 
@@ -47,45 +162,30 @@ AstNode string(Parser &p, Arena &arena) {
   }
 
   StringIndex start = arena.string_position();
+  size_t (*scan_string)(const char *, size_t) = kernels().scan_string;
+  auto append = [&](const char *chars, size_t len) {
+    arena.string_append(chars, len);
+  };
   while (true) {
+    // valid UTF-8 up to the next quote, escape or control character
+    p.consume_run(scan_string, append);
+    if (p.peek() >= 0x80) {
+      utf8_sequence(p, arena);
+      continue;
+    }
     int c = p.next();
     switch (c) {
     case '\\': {
-      char escaped = c;
-      switch (p.next()) {
-      case '"':
-      case '/':
-        escaped = '/';
-        break;
-      case '\\':
-        escaped = '\\';
-        break;
-      case 'b':
-        escaped = '\b';
-        break;
-      case 'f':
-        escaped = '\f';
-        break;
-      case 'n':
-        escaped = '\n';
-        break;
-      case 'r':
-        escaped = '\r';
-        break;
-      case 't':
-        escaped = '\t';
-        break;
-      case 'u':
-        hex_escape(p, arena);
-        continue;
+      int escaped = p.next();
+      if (escaped == 'u') {
+        unicode_escape(p, arena);
+      } else {
+        arena.string_push(unescape(escaped));
       }
-      arena.string_push(escaped);
       continue;
     }
-    case '"': {
-      StringIndex end = arena.string_position();
-      return AstNode::string(start, end.raw() - start.raw());
-    }
+    case '"':
+      return arena.finish_string(start);
     case EOF:
       p.error("Expected end of string");
       return AstNode::error();
@@ -117,6 +217,10 @@ AstNode number(Parser &p, Arena &arena) {
   // and will reset it back when we're done
   // make sure that no one else is addings strings to the arena!!!
   StringIndex start = arena.string_position();
+  size_t (*count_digits)(const char *, size_t) = kernels().count_digits;
+  auto append = [&](const char *chars, size_t len) {
+    arena.string_append(chars, len);
+  };
   {
     char c;
     // '-'
@@ -132,11 +236,11 @@ AstNode number(Parser &p, Arena &arena) {
     }
 
     // [0-9]*
-    while ((c = p.try_consume(isdigit))) {
-      arena.string_push(c);
-    }
+    p.consume_run(count_digits, append);
 
     if ((c = p.eat('.'))) {
+      arena.string_push(c);
+
       // [0-9]
       if ((c = p.try_consume(isdigit))) {
         arena.string_push(c);
@@ -145,9 +249,7 @@ AstNode number(Parser &p, Arena &arena) {
       }
 
       // [0-9]*
-      while ((c = p.try_consume(isdigit))) {
-        arena.string_push(c);
-      }
+      p.consume_run(count_digits, append);
     }
 
     auto match_e = [](int c) { return c == 'e' || c == 'E'; };
@@ -167,12 +269,20 @@ AstNode number(Parser &p, Arena &arena) {
       }
 
       // [0-9]*
-      while ((c = p.try_consume(isdigit))) {
-        arena.string_push(c);
-      }
+      p.consume_run(count_digits, append);
     }
   }
 
+  std::optional<double> value = take_number(arena, start);
+  if (value.has_value()) {
+    return AstNode::number(*value);
+  } else {
+    p.error("Invalid number");
+    return AstNode::error();
+  }
+}
+
+std::optional<double> take_number(Arena &arena, StringIndex start) {
   StringIndex end = arena.string_position();
   std::string_view view = arena.get_string_between(start, end);
 
@@ -182,17 +292,28 @@ AstNode number(Parser &p, Arena &arena) {
   arena.string_truncate(start);
 
   if (consumed == view.size()) {
-    return AstNode::number(value);
-  } else {
-    p.error("Invalid number");
-    return AstNode::error();
+    return value;
+  }
+  return {};
+}
+
+std::optional<AstNode> json_keyword(std::string_view word) {
+  if (word == "true") {
+    return AstNode::boolean(true);
+  } else if (word == "false") {
+    return AstNode::boolean(false);
+  } else if (word == "null") {
+    return AstNode::nil();
   }
+  return {};
 }
 
 AstNode identifier_or_keyword(Parser &p, Arena &arena, bool is_expression) {
   StringIndex start = arena.string_position();
+  // letters, then letters and underscores like in `sort_by`
+  auto is_identifier = [](int c) { return isalpha(c) || c == '_'; };
   int c;
-  while ((c = p.try_consume(isalpha))) {
+  while ((c = p.try_consume(is_identifier))) {
     arena.string_push(c);
   }
 
@@ -216,6 +337,18 @@ AstNode identifier_or_keyword(Parser &p, Arena &arena, bool is_expression) {
     node = AstNode::empty_function(NodeKind::Max);
   } else if (is_expression && std::strcmp(str, "size") == 0) {
     node = AstNode::empty_function(NodeKind::Size);
+  } else if (is_expression && std::strcmp(str, "sum") == 0) {
+    node = AstNode::empty_function(NodeKind::Sum);
+  } else if (is_expression && std::strcmp(str, "distinct") == 0) {
+    node = AstNode::empty_function(NodeKind::Distinct);
+  } else if (is_expression && std::strcmp(str, "sort") == 0) {
+    node = AstNode::empty_function(NodeKind::Sort);
+  } else if (is_expression && std::strcmp(str, "sort_by") == 0) {
+    node = AstNode::empty_function(NodeKind::SortBy);
+  } else if (is_expression && std::strcmp(str, "topk") == 0) {
+    node = AstNode::empty_function(NodeKind::TopK);
+  } else if (is_expression && std::strcmp(str, "bottomk") == 0) {
+    node = AstNode::empty_function(NodeKind::BottomK);
   } else {
     if (is_expression) {
       node = AstNode::identifier(start, (end.raw() - start.raw()) - 1);
@@ -295,8 +428,7 @@ AstNode json_array(Parser &p, Arena &arena) {
     p.error("Expected closing ]");
   }
 
-  auto pair = arena.node_stack_finish(start);
-  return AstNode::array(pair.first, pair.second);
+  return arena.finish_container(NodeKind::ARRAY, start);
 }
 
 AstNode json_object(Parser &p, Arena &arena) {
@@ -339,11 +471,10 @@ AstNode json_object(Parser &p, Arena &arena) {
     p.error("Expected closing ]");
   }
 
-  auto pair = arena.node_stack_finish(start);
-  return AstNode::object(pair.first, pair.second);
+  return arena.finish_container(NodeKind::OBJECT, start);
 }
 
-AstNode parse_json(Parser &p, Arena &arena) {
+AstNode parse_json_recursive(Parser &p, Arena &arena) {
   auto node = json_value(p, arena);
   if (node.has_value()) {
     return node.value();
@@ -353,6 +484,598 @@ AstNode parse_json(Parser &p, Arena &arena) {
   }
 }
 
+// Same grammar, results and errors as parse_json_recursive(), with the
+// containers being parsed kept on an explicit stack. Their children are
+// collected on the node stack of the arena just like the recursive version.
+AstNode parse_json(Parser &p, Arena &arena, ParseOptions options) {
+  struct Frame {
+    NodeKind kind;
+    NodeStackIndex start;
+  };
+  enum class State {
+    // a value, or nothing if the container ends
+    Value,
+    // `value` is complete, or missing
+    AfterValue,
+    // the next key of an object, or its end
+    Key,
+    CloseArray,
+    CloseObject,
+  };
+
+  std::vector<Frame> frames;
+  std::optional<AstNode> value;
+  State state = State::Value;
+
+  while (true) {
+    switch (state) {
+    case State::Value: {
+      p.consume_whitespace();
+      int c = p.peek();
+      if (c == '[' || c == '{') {
+        if (frames.size() >= options.max_depth) {
+          p.error("Maximum nesting depth exceeded");
+          arena.node_stack_truncate(frames.empty()
+                                        ? arena.node_stack_position()
+                                        : frames[0].start);
+          return AstNode::error();
+        }
+        p.next();
+        bool object = c == '{';
+        frames.push_back({object ? NodeKind::OBJECT : NodeKind::ARRAY,
+                          arena.node_stack_position()});
+        state = object ? State::Key : State::Value;
+        continue;
+      }
+
+      if (c == '"') {
+        value = string(p, arena);
+      } else if (c == '-' || ('0' <= c && c <= '9')) {
+        value = number(p, arena);
+      } else if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')) {
+        value = identifier_or_keyword(p, arena, false);
+      } else {
+        value.reset();
+      }
+      state = State::AfterValue;
+      continue;
+    }
+
+    case State::AfterValue:
+      if (frames.empty()) {
+        if (!value.has_value()) {
+          p.error("Invalid json");
+          return AstNode::error();
+        }
+        return *value;
+      }
+      if (frames.back().kind == NodeKind::ARRAY) {
+        if (!value.has_value()) {
+          state = State::CloseArray;
+          continue;
+        }
+        arena.node_stack_push(*value);
+        p.consume_whitespace();
+        state = p.eat(',') ? State::Value : State::CloseArray;
+        continue;
+      }
+      if (!value.has_value()) {
+        p.error("Expected value");
+        value = AstNode::error();
+      }
+      arena.node_stack_push(*value);
+      p.consume_whitespace();
+      state = p.eat(',') ? State::Key : State::CloseObject;
+      continue;
+
+    case State::Key:
+      p.consume_whitespace();
+      if (!p.at('"')) {
+        state = State::CloseObject;
+        continue;
+      }
+      arena.node_stack_push(string(p, arena));
+      if (!p.eat(':')) {
+        p.error("Expected :");
+      }
+      state = State::Value;
+      continue;
+
+    case State::CloseArray:
+      p.consume_whitespace();
+      if (!p.eat(']')) {
+        p.error("Expected closing ]");
+      }
+      value = arena.finish_container(NodeKind::ARRAY, frames.back().start);
+      frames.pop_back();
+      state = State::AfterValue;
+      continue;
+
+    case State::CloseObject:
+      p.consume_whitespace();
+      if (!p.eat('}')) {
+        p.error("Expected closing ]");
+      }
+      value = arena.finish_container(NodeKind::OBJECT, frames.back().start);
+      frames.pop_back();
+      state = State::AfterValue;
+      continue;
+    }
+  }
+}
+
+namespace {
+
+// One item of a binary format, a complete value or the start of a container
+// whose children follow
+struct BinaryItem {
+  enum class Type {
+    Value,
+    Array,
+    Map,
+    // the end of a container of indefinite length
+    Break,
+  };
+
+  Type type;
+  AstNode value;
+  // elements, or pairs for maps
+  size_t len;
+  bool indefinite;
+};
+
+} // namespace
+
+// Big endian unsigned integer of `bytes` bytes
+static bool read_uint(Parser &p, int bytes, uint64_t &out) {
+  out = 0;
+  for (int i = 0; i < bytes; i++) {
+    int c = p.next_byte();
+    if (c == EOF) {
+      p.error("Unexpected end of input");
+      return false;
+    }
+    out = out << 8 | (uint64_t)c;
+  }
+  return true;
+}
+
+static bool read_bytes(Parser &p, Arena &arena, uint64_t len) {
+  bool complete = p.consume_bytes(
+      len, [&](const char *chars, size_t n) { arena.string_append(chars, n); });
+  if (!complete) {
+    p.error("Unexpected end of input");
+  }
+  return complete;
+}
+
+static double float_from_bits(uint32_t bits) {
+  float value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+static double double_from_bits(uint64_t bits) {
+  double value;
+  std::memcpy(&value, &bits, sizeof(value));
+  return value;
+}
+
+// IEEE 754 binary16
+static double half_from_bits(uint64_t bits) {
+  int exponent = (int)(bits >> 10) & 0x1f;
+  double mantissa = (double)(bits & 0x3ff);
+  double value;
+  if (exponent == 0) {
+    value = std::ldexp(mantissa, -24);
+  } else if (exponent == 31) {
+    value = mantissa == 0 ? INFINITY : NAN;
+  } else {
+    value = std::ldexp(mantissa + 1024, exponent - 25);
+  }
+  return bits & 0x8000 ? -value : value;
+}
+
+// Larger containers grow with the input instead of being reserved up front, so
+// a bogus length in a short input can't allocate much
+constexpr size_t MAX_RESERVED = 1 << 16;
+
+// Builds the nodes from the items of a binary format. Containers with a known
+// size get their slots in the arena reserved and filled in place. Indefinite
+// lengths, deduplication, which works on whole child lists, and huge lengths
+// go through the node stack like json.
+template <typename Decode>
+static AstNode parse_binary(Parser &p, Arena &arena, ParseOptions options,
+                            Decode decode) {
+  struct Frame {
+    NodeKind kind;
+    // children, two per pair of a map
+    size_t len;
+    size_t filled;
+    bool indefinite;
+    bool reserved;
+    NodeIndex start;
+    NodeStackIndex stack_start;
+  };
+
+  std::vector<Frame> frames;
+  auto fail = [&]() {
+    if (!frames.empty()) {
+      arena.node_stack_truncate(frames[0].stack_start);
+    }
+    return AstNode::error();
+  };
+  auto finish = [&](Frame &frame) {
+    if (frame.reserved) {
+      return arena.finish_reserved(frame.kind, frame.start, frame.len);
+    }
+    return arena.finish_container(frame.kind, frame.stack_start);
+  };
+
+  while (true) {
+    AstNode value;
+    if (!frames.empty() && !frames.back().indefinite &&
+        frames.back().filled == frames.back().len) {
+      value = finish(frames.back());
+      frames.pop_back();
+    } else {
+      BinaryItem item;
+      if (!decode(p, arena, item)) {
+        return fail();
+      }
+      if (item.type == BinaryItem::Type::Break) {
+        if (frames.empty() || !frames.back().indefinite ||
+            frames.back().filled % 2 != 0) {
+          p.error("Unexpected break");
+          return fail();
+        }
+        value = finish(frames.back());
+        frames.pop_back();
+      } else if (item.type != BinaryItem::Type::Value) {
+        if (frames.size() >= options.max_depth) {
+          p.error("Maximum nesting depth exceeded");
+          return fail();
+        }
+        bool map = item.type == BinaryItem::Type::Map;
+        Frame frame{map ? NodeKind::OBJECT : NodeKind::ARRAY,
+                    map ? item.len * 2 : item.len,
+                    0,
+                    item.indefinite,
+                    false,
+                    {},
+                    arena.node_stack_position()};
+        frame.reserved = !item.indefinite && !arena.get_options().dedup &&
+                         frame.len <= MAX_RESERVED;
+        if (frame.reserved) {
+          frame.start = arena.nodes_reserve(frame.len);
+        }
+        frames.push_back(frame);
+        continue;
+      } else {
+        value = item.value;
+      }
+    }
+
+    if (frames.empty()) {
+      return value;
+    }
+    Frame &parent = frames.back();
+    if (parent.kind == NodeKind::OBJECT && parent.filled % 2 == 0 &&
+        value.get_kind() != NodeKind::STRING) {
+      p.error("Expected string key");
+      value = AstNode::error();
+    }
+    if (parent.reserved) {
+      arena.nodes_set(parent.start.raw() + parent.filled, value);
+    } else {
+      arena.node_stack_push(value);
+    }
+    parent.filled++;
+  }
+}
+
+// The strings of indefinite length are a sequence of definite chunks of the
+// same major type, ended by a break
+static bool cbor_chunks(Parser &p, Arena &arena, int major) {
+  while (true) {
+    int initial = p.next_byte();
+    if (initial == 0xff) {
+      return true;
+    }
+    uint64_t len;
+    int info = initial & 0x1f;
+    if (initial == EOF || initial >> 5 != major || info > 27) {
+      p.error(initial == EOF ? "Unexpected end of input"
+                             : "Invalid CBOR string chunk");
+      return false;
+    }
+    if (info < 24) {
+      len = (uint64_t)info;
+    } else if (!read_uint(p, 1 << (info - 24), len)) {
+      return false;
+    }
+    if (!read_bytes(p, arena, len)) {
+      return false;
+    }
+  }
+}
+
+static bool cbor_item(Parser &p, Arena &arena, BinaryItem &item) {
+  item = {BinaryItem::Type::Value, AstNode::error(), 0, false};
+  while (true) {
+    int initial = p.next_byte();
+    if (initial == EOF) {
+      p.error("Unexpected end of input");
+      return false;
+    }
+    int major = initial >> 5;
+    int info = initial & 0x1f;
+
+    uint64_t argument = 0;
+    if (info < 24) {
+      argument = (uint64_t)info;
+    } else if (info <= 27) {
+      if (!read_uint(p, 1 << (info - 24), argument)) {
+        return false;
+      }
+    } else if (info == 31 && major >= 2 && major != 6) {
+      item.indefinite = true;
+    } else {
+      p.error("Invalid CBOR");
+      return false;
+    }
+
+    switch (major) {
+    case 0:
+      item.value = AstNode::number((double)argument);
+      return true;
+    case 1:
+      item.value = AstNode::number(-1 - (double)argument);
+      return true;
+    case 2:
+    case 3: {
+      StringIndex start = arena.string_position();
+      bool ok = item.indefinite ? cbor_chunks(p, arena, major)
+                                : read_bytes(p, arena, argument);
+      if (!ok) {
+        return false;
+      }
+      item.value = arena.finish_string(start);
+      item.indefinite = false;
+      return true;
+    }
+    case 4:
+    case 5:
+      item.type = major == 4 ? BinaryItem::Type::Array : BinaryItem::Type::Map;
+      item.len = (size_t)argument;
+      return true;
+    case 6:
+      // tags only annotate the value which follows
+      continue;
+    default:
+      break;
+    }
+
+    switch (info) {
+    case 20:
+    case 21:
+      item.value = AstNode::boolean(info == 21);
+      return true;
+    case 22:
+    case 23:
+      // null and undefined
+      item.value = AstNode::nil();
+      return true;
+    case 25:
+      item.value = AstNode::number(half_from_bits(argument));
+      return true;
+    case 26:
+      item.value = AstNode::number(float_from_bits((uint32_t)argument));
+      return true;
+    case 27:
+      item.value = AstNode::number(double_from_bits(argument));
+      return true;
+    case 31:
+      item.type = BinaryItem::Type::Break;
+      return true;
+    default:
+      p.error("Unsupported CBOR simple value");
+      return false;
+    }
+  }
+}
+
+AstNode parse_cbor(Parser &p, Arena &arena, ParseOptions options) {
+  return parse_binary(p, arena, options, cbor_item);
+}
+
+static bool msgpack_item(Parser &p, Arena &arena, BinaryItem &item) {
+  item = {BinaryItem::Type::Value, AstNode::error(), 0, false};
+  int type = p.next_byte();
+  if (type == EOF) {
+    p.error("Unexpected end of input");
+    return false;
+  }
+
+  uint64_t value = 0;
+  auto bytes = [&](int len_bytes) {
+    uint64_t len;
+    if (!read_uint(p, len_bytes, len)) {
+      return false;
+    }
+    StringIndex start = arena.string_position();
+    if (!read_bytes(p, arena, len)) {
+      return false;
+    }
+    item.value = arena.finish_string(start);
+    return true;
+  };
+  auto container = [&](BinaryItem::Type container_type, int len_bytes) {
+    item.type = container_type;
+    if (!read_uint(p, len_bytes, value)) {
+      return false;
+    }
+    item.len = (size_t)value;
+    return true;
+  };
+
+  if (type <= 0x7f) {
+    item.value = AstNode::number(type);
+    return true;
+  } else if (type >= 0xe0) {
+    item.value = AstNode::number((int8_t)type);
+    return true;
+  } else if (type <= 0x8f) {
+    item.type = BinaryItem::Type::Map;
+    item.len = (size_t)(type & 0x0f);
+    return true;
+  } else if (type <= 0x9f) {
+    item.type = BinaryItem::Type::Array;
+    item.len = (size_t)(type & 0x0f);
+    return true;
+  } else if (type <= 0xbf) {
+    StringIndex start = arena.string_position();
+    if (!read_bytes(p, arena, (uint64_t)(type & 0x1f))) {
+      return false;
+    }
+    item.value = arena.finish_string(start);
+    return true;
+  }
+
+  switch (type) {
+  case 0xc0:
+    item.value = AstNode::nil();
+    return true;
+  case 0xc2:
+  case 0xc3:
+    item.value = AstNode::boolean(type == 0xc3);
+    return true;
+  case 0xc4:
+  case 0xc5:
+  case 0xc6:
+    // bin 8, 16, 32
+    return bytes(1 << (type - 0xc4));
+  case 0xca:
+    if (!read_uint(p, 4, value)) {
+      return false;
+    }
+    item.value = AstNode::number(float_from_bits((uint32_t)value));
+    return true;
+  case 0xcb:
+    if (!read_uint(p, 8, value)) {
+      return false;
+    }
+    item.value = AstNode::number(double_from_bits(value));
+    return true;
+  case 0xcc:
+  case 0xcd:
+  case 0xce:
+  case 0xcf:
+    if (!read_uint(p, 1 << (type - 0xcc), value)) {
+      return false;
+    }
+    item.value = AstNode::number((double)value);
+    return true;
+  case 0xd0:
+  case 0xd1:
+  case 0xd2:
+  case 0xd3: {
+    int bytes = 1 << (type - 0xd0);
+    if (!read_uint(p, bytes, value)) {
+      return false;
+    }
+    // sign extend
+    int shift = 64 - bytes * 8;
+    item.value = AstNode::number((double)((int64_t)(value << shift) >> shift));
+    return true;
+  }
+  case 0xd9:
+  case 0xda:
+  case 0xdb:
+    // str 8, 16, 32
+    return bytes(1 << (type - 0xd9));
+  case 0xdc:
+  case 0xdd:
+    return container(BinaryItem::Type::Array, type == 0xdc ? 2 : 4);
+  case 0xde:
+  case 0xdf:
+    return container(BinaryItem::Type::Map, type == 0xde ? 2 : 4);
+  default:
+    p.error("Unsupported MessagePack type");
+    return false;
+  }
+}
+
+AstNode parse_msgpack(Parser &p, Arena &arena, ParseOptions options) {
+  return parse_binary(p, arena, options, msgpack_item);
+}
+
+namespace {
+
+// How the start of the input reads in a binary format
+enum class Fit {
+  Invalid,
+  // valid as far as it goes, the rest of the document isn't buffered yet
+  Truncated,
+  Complete,
+};
+
+} // namespace
+
+template <typename Decode>
+static Fit try_decode(std::string_view start, Decode decode) {
+  StringSource input(start);
+  Parser p(input);
+  Arena scratch;
+  parse_binary(p, scratch, {}, decode);
+  const std::vector<ParseError> &errors = p.get_errors();
+  if (errors.empty()) {
+    // a document is a single item
+    return p.peek() == EOF ? Fit::Complete : Fit::Invalid;
+  }
+  if (p.peek() == EOF &&
+      std::strcmp(errors[0].message, "Unexpected end of input") == 0) {
+    return Fit::Truncated;
+  }
+  return Fit::Invalid;
+}
+
+InputFormat detect_format(std::string_view start) {
+  int first = start.empty() ? EOF : (unsigned char)start[0];
+  if ((first >= 0xa0 && first <= 0xbf) || first == 0xd9) {
+    return InputFormat::CBOR;
+  }
+  if (first >= 0xdc && first <= 0xdf) {
+    return InputFormat::MSGPACK;
+  }
+  if (first >= 0x80 && first <= 0x9f) {
+    // CBOR arrays, MessagePack maps and arrays. MessagePack unless only CBOR
+    // can read the document, which is usually clear after a few items since
+    // MessagePack map keys have to be strings.
+    if (try_decode(start, msgpack_item) == Fit::Invalid &&
+        try_decode(start, cbor_item) != Fit::Invalid) {
+      return InputFormat::CBOR;
+    }
+    return InputFormat::MSGPACK;
+  }
+  return InputFormat::JSON;
+}
+
+AstNode parse_document(Parser &p, Arena &arena, ParseOptions options) {
+  InputFormat format = options.format;
+  if (format == InputFormat::AUTO) {
+    format = detect_format(p.buffered());
+  }
+  switch (format) {
+  case InputFormat::CBOR:
+    return parse_cbor(p, arena, options);
+  case InputFormat::MSGPACK:
+    return parse_msgpack(p, arena, options);
+  default:
+    return parse_json(p, arena, options);
+  }
+}
+
 std::optional<AstNode> expression_pratt(Parser &p, Arena &arena,
                                         int max_precedence);
 
@@ -385,11 +1108,31 @@ std::pair<NodeIndex, size_t> function_arguments(Parser &p, Arena &arena) {
   return arena.node_stack_finish(start);
 }
 
+// param
+//     '$' [0-9]+
+AstNode param(Parser &p) {
+  p.eat('$');
+  size_t index = 0;
+  int c;
+  bool any = false;
+  while ((c = p.try_consume(isdigit))) {
+    index = index * 10 + (size_t)(c - '0');
+    any = true;
+  }
+  if (!any || index == 0) {
+    p.error("Expected parameter number starting from 1");
+    return AstNode::error();
+  }
+  return AstNode::param(index);
+}
+
 std::optional<AstNode> expression_atom(Parser &p, Arena &arena) {
   p.consume_whitespace();
   switch (p.peek()) {
   case '"':
     return string(p, arena);
+  case '$':
+    return param(p);
   case '(': {
     p.eat('(');
     AstNode inner = parse_expression(p, arena);
@@ -418,7 +1161,13 @@ std::optional<AstNode> expression_atom(Parser &p, Arena &arena) {
       switch (node.get_kind()) {
       case NodeKind::Min:
       case NodeKind::Max:
-      case NodeKind::Size: {
+      case NodeKind::Size:
+      case NodeKind::Sum:
+      case NodeKind::Distinct:
+      case NodeKind::Sort:
+      case NodeKind::SortBy:
+      case NodeKind::TopK:
+      case NodeKind::BottomK: {
         std::pair<NodeIndex, size_t> array = function_arguments(p, arena);
         return AstNode::function(node.get_kind(), array.first, array.second);
       }
@@ -453,6 +1202,73 @@ AstNode expression_pratt_expect(Parser &p, Arena &arena, int max_precedence) {
   }
 }
 
+// subscript
+//     '[' expression ']'
+// filter
+//     '[' '?' expression ']'
+// slice
+//     '[' '*' ']'
+//     '[' expression? ':' expression? (':' expression?)? ']'
+//
+// Slices are stored as (Slice base start end step) with NIL for the missing
+// bounds, `[*]` is a slice with all bounds missing.
+AstNode subscript_or_slice(Parser &p, Arena &arena, AstNode left) {
+  p.eat('[');
+  p.consume_whitespace();
+
+  AstNode bounds[3] = {AstNode::nil(), AstNode::nil(), AstNode::nil()};
+  bool is_slice = false;
+
+  if (p.eat('*')) {
+    is_slice = true;
+  } else if (p.eat('?')) {
+    AstNode predicate = parse_expression(p, arena);
+    p.consume_whitespace();
+    if (!p.eat(']')) {
+      p.error("Expected ]");
+    }
+    NodeIndex args = arena.nodes_push(left);
+    arena.nodes_push(predicate);
+    return AstNode::function(NodeKind::Filter, args, 2);
+  } else {
+    std::optional<AstNode> first = expression_pratt(p, arena, INT_MAX);
+    p.consume_whitespace();
+    if (p.eat(':')) {
+      is_slice = true;
+      bounds[0] = first.value_or(AstNode::nil());
+      for (int i = 1; i < 3; i++) {
+        std::optional<AstNode> bound = expression_pratt(p, arena, INT_MAX);
+        bounds[i] = bound.value_or(AstNode::nil());
+        p.consume_whitespace();
+        if (i == 1 && !p.eat(':')) {
+          break;
+        }
+      }
+    } else if (first.has_value()) {
+      bounds[0] = first.value();
+    } else {
+      p.error("Expected expression");
+      bounds[0] = AstNode::error();
+    }
+  }
+
+  p.consume_whitespace();
+  if (!p.eat(']')) {
+    p.error("Expected ]");
+  }
+
+  NodeIndex args = arena.nodes_push(left);
+  if (is_slice) {
+    for (AstNode bound : bounds) {
+      arena.nodes_push(bound);
+    }
+    return AstNode::function(NodeKind::Slice, args, 4);
+  } else {
+    arena.nodes_push(bounds[0]);
+    return AstNode::function(NodeKind::Subscript, args, 2);
+  }
+}
+
 std::optional<AstNode> expression_pratt(Parser &p, Arena &arena,
                                         int max_precedence) {
   std::optional<AstNode> atom = expression_atom(p, arena);
@@ -462,20 +1278,15 @@ std::optional<AstNode> expression_pratt(Parser &p, Arena &arena,
 
   AstNode left = atom.value();
   while (true) {
-    NodeKind function;
+    NodeKind function = NodeKind::ERROR;
     AstNode right;
 
     p.consume_whitespace();
     switch (p.peek()) {
     case /* 2 */ '[':
       if (max_precedence > 2) {
-        p.eat('[');
-        function = NodeKind::Subscript;
-        right = parse_expression(p, arena);
-        if (!p.eat(']')) {
-          p.error("Expected ]");
-        }
-        break;
+        left = subscript_or_slice(p, arena, left);
+        continue;
       } else {
         goto end;
       }
@@ -484,7 +1295,12 @@ std::optional<AstNode> expression_pratt(Parser &p, Arena &arena,
     case /* 3 */ '/':
     case /* 4 */ '+':
     case /* 4 */ '-':
-    case /* 5 */ '=': {
+    case /* 5 */ '=':
+    case /* 5 */ '!':
+    case /* 5 */ '<':
+    case /* 5 */ '>':
+    case /* 6 */ '&':
+    case /* 7 */ '|': {
       int precedence = 0;
       switch (p.peek()) {
       case '.':
@@ -511,9 +1327,60 @@ std::optional<AstNode> expression_pratt(Parser &p, Arena &arena,
         function = NodeKind::Eq;
         precedence = 5;
         break;
+      case '!':
+        function = NodeKind::Ne;
+        precedence = 5;
+        break;
+      case '<':
+        function = NodeKind::Lt;
+        precedence = 5;
+        break;
+      case '>':
+        function = NodeKind::Gt;
+        precedence = 5;
+        break;
+      case '&':
+        function = NodeKind::And;
+        precedence = 6;
+        break;
+      case '|':
+        function = NodeKind::Or;
+        precedence = 7;
+        break;
       }
       if (max_precedence > precedence) {
-        p.next();
+        int first = p.next();
+        // second character of two character operators
+        switch (first) {
+        case '=':
+          p.eat('=');
+          break;
+        case '!':
+          if (!p.eat('=')) {
+            p.error("Expected !=");
+          }
+          break;
+        case '<':
+          if (p.eat('=')) {
+            function = NodeKind::Le;
+          }
+          break;
+        case '>':
+          if (p.eat('=')) {
+            function = NodeKind::Ge;
+          }
+          break;
+        case '&':
+          if (!p.eat('&')) {
+            p.error("Expected &&");
+          }
+          break;
+        case '|':
+          if (!p.eat('|')) {
+            p.error("Expected ||");
+          }
+          break;
+        }
         right = expression_pratt_expect(p, arena, precedence);
         break;
       } else {
@@ -3,6 +3,76 @@
 #include "ast.h"
 #include "parser.h"
 
-AstNode parse_json(Parser &p, Arena &arena);
+#include <cstdint>
+#include <optional>
+#include <string_view>
+
+enum class InputFormat {
+  // detected from the start of the input, see detect_format()
+  AUTO,
+  JSON,
+  CBOR,
+  MSGPACK,
+};
+
+struct ParseOptions {
+  // containers nested deeper are an error, the parser doesn't recurse so
+  // this is only there to bound the memory of hostile input
+  size_t max_depth = 100000;
+  InputFormat format = InputFormat::AUTO;
+};
+
+// Guesses the format of a document from its start, the bytes the parser has
+// buffered. Text is json, CBOR documents are recognized by a map or the
+// self-describe tag at the start and MessagePack ones by a map or an array.
+// CBOR arrays start with the same bytes as MessagePack maps and arrays, those
+// documents are decoded as both and taken as CBOR if only CBOR can read them.
+InputFormat detect_format(std::string_view start);
+
+// Parses a document of the format in the options
+AstNode parse_document(Parser &p, Arena &arena, ParseOptions options = {});
+
+AstNode parse_json(Parser &p, Arena &arena, ParseOptions options = {});
+
+// The straightforward recursive descent parser, which recurses for every
+// level of nesting and has no depth limit. Kept as the reference for
+// parse_json().
+AstNode parse_json_recursive(Parser &p, Arena &arena);
+
+// RFC 8949 CBOR and MessagePack, decoded into the same nodes as json. Byte
+// strings become strings, integers become numbers like in json, and map keys
+// have to be strings. The sizes of containers come first, so their children
+// are written straight to their place in the arena.
+AstNode parse_cbor(Parser &p, Arena &arena, ParseOptions options = {});
+AstNode parse_msgpack(Parser &p, Arena &arena, ParseOptions options = {});
 
 AstNode parse_expression(Parser &p, Arena &arena);
+
+// Pieces of the json grammar shared with PushParser and the streaming scanner
+
+// A json string starting at the opening quote
+AstNode string(Parser &p, Arena &arena);
+
+// The character `\c` stands for, except for \u escapes
+char unescape(int c);
+// The value of a hexadecimal digit, -1 for other characters
+int hex_digit(int c);
+
+// Invalid UTF-8 and unpaired surrogates are replaced by this
+constexpr uint32_t REPLACEMENT_CHARACTER = 0xfffd;
+
+inline bool is_high_surrogate(uint32_t unit) {
+  return unit >= 0xd800 && unit <= 0xdbff;
+}
+inline bool is_low_surrogate(uint32_t unit) {
+  return unit >= 0xdc00 && unit <= 0xdfff;
+}
+// The code point a pair of UTF-16 surrogates stands for
+uint32_t combine_surrogates(uint32_t high, uint32_t low);
+// Appends the code point encoded as UTF-8
+void string_push_utf8(Arena &arena, uint32_t code_point);
+// Converts the text of a number the string arena holds from `start` on, which
+// is dropped again
+std::optional<double> take_number(Arena &arena, StringIndex start);
+// true, false and null
+std::optional<AstNode> json_keyword(std::string_view word);
@@ -0,0 +1,307 @@
+#include "patch.h"
+#include "sequence.h"
+
+// RFC 6901, `/a~1b/0` is ["a/b", "0"]
+static bool parse_pointer(std::string_view pointer,
+                          std::vector<std::string> &tokens) {
+  if (pointer.empty()) {
+    return true;
+  }
+  if (pointer[0] != '/') {
+    return false;
+  }
+  std::string token;
+  for (size_t i = 1; i <= pointer.size(); i++) {
+    if (i == pointer.size() || pointer[i] == '/') {
+      tokens.push_back(std::move(token));
+      token.clear();
+    } else if (pointer[i] == '~') {
+      if (i + 1 == pointer.size()) {
+        return false;
+      }
+      char escaped = pointer[++i];
+      if (escaped == '0') {
+        token.push_back('~');
+      } else if (escaped == '1') {
+        token.push_back('/');
+      } else {
+        return false;
+      }
+    } else {
+      token.push_back(pointer[i]);
+    }
+  }
+  return true;
+}
+
+bool parse_patch(AstNode patch, Arena &arena,
+                 std::vector<PatchOperation> &operations,
+                 const char *&error) {
+  if (patch.get_kind() != NodeKind::ARRAY) {
+    error = "Patch must be an array of operations";
+    return false;
+  }
+
+  std::span<AstNode> elements = arena.as_array_like(patch).value();
+  for (AstNode element : elements) {
+    std::optional<AstNode> op = find_field(element, "op", arena);
+    std::optional<AstNode> path = find_field(element, "path", arena);
+    if (!op.has_value() || op->get_kind() != NodeKind::STRING ||
+        !path.has_value() || path->get_kind() != NodeKind::STRING) {
+      error = "Patch operation needs an \"op\" and a \"path\"";
+      return false;
+    }
+
+    PatchOperation operation{};
+    std::string_view name = arena.as_string_like(*op).value();
+    if (name == "add") {
+      operation.kind = PatchOperation::Kind::Add;
+    } else if (name == "remove") {
+      operation.kind = PatchOperation::Kind::Remove;
+    } else if (name == "replace") {
+      operation.kind = PatchOperation::Kind::Replace;
+    } else {
+      error = "Unsupported patch operation";
+      return false;
+    }
+
+    if (!parse_pointer(arena.as_string_like(*path).value(), operation.path)) {
+      error = "Invalid json pointer in patch";
+      return false;
+    }
+
+    if (operation.kind != PatchOperation::Kind::Remove) {
+      std::optional<AstNode> value = find_field(element, "value", arena);
+      if (!value.has_value()) {
+        error = "Patch operation needs a \"value\"";
+        return false;
+      }
+      operation.value = *value;
+    }
+    operations.push_back(std::move(operation));
+  }
+  return true;
+}
+
+// Array indices are decimal without leading zeros
+static std::optional<size_t> parse_index(const std::string &token) {
+  if (token.empty() || token.size() > 18 ||
+      (token[0] == '0' && token.size() > 1)) {
+    return {};
+  }
+  size_t index = 0;
+  for (char c : token) {
+    if (c < '0' || c > '9') {
+      return {};
+    }
+    index = index * 10 + (size_t)(c - '0');
+  }
+  return index;
+}
+
+namespace {
+
+struct Patcher {
+  Arena &arena;
+  Arena &patch_arena;
+  // The position of the child a token refers to, for objects the position of
+  // the value
+  std::optional<size_t> child_slot(AstNode container,
+                                   const std::string &token) {
+    if (container.get_kind() == NodeKind::OBJECT) {
+      std::span<AstNode> children = arena.as_array_like(container).value();
+      for (size_t i = 0; i < children.size(); i += 2) {
+        if (children[i].get_kind() == NodeKind::STRING &&
+            arena.as_string_like(children[i]).value() == token) {
+          return i + 1;
+        }
+      }
+      return {};
+    }
+    if (container.get_kind() == NodeKind::ARRAY) {
+      std::optional<size_t> index = parse_index(token);
+      if (index.has_value() && *index < container.get_data()) {
+        return index;
+      }
+    }
+    return {};
+  }
+
+  AstNode child(AstNode container, size_t slot) {
+    return arena.as_array_like(container).value()[slot];
+  }
+
+  // A copy of the container with `remove` children at `at` replaced by
+  // `insert`
+  AstNode splice(AstNode container, size_t at, size_t remove,
+                 std::initializer_list<AstNode> insert) {
+    NodeStackIndex start = arena.node_stack_position();
+    size_t len = container.get_data();
+    for (size_t i = 0; i < at; i++) {
+      arena.node_stack_push(child(container, i));
+    }
+    for (AstNode node : insert) {
+      arena.node_stack_push(node);
+    }
+    for (size_t i = at + remove; i < len; i++) {
+      arena.node_stack_push(child(container, i));
+    }
+
+    return arena.finish_container(container.get_kind(), start);
+  }
+
+  AstNode key(const std::string &name) {
+    StringIndex start = arena.string_position();
+    for (char c : name) {
+      arena.string_push(c);
+    }
+    return arena.finish_string(start);
+  }
+
+  std::optional<AstNode> apply(const PatchOperation &operation, AstNode root,
+                               const char *&error);
+};
+
+// What copy_tree() appends for a value of the patch
+void value_cost(Arena &arena, AstNode node, PatchCost &cost) {
+  std::vector<AstNode> pending{node};
+  while (!pending.empty()) {
+    AstNode next = pending.back();
+    pending.pop_back();
+    if (next.get_kind() == NodeKind::STRING) {
+      // inline strings take no bytes
+      cost.bytes += next.is_inline() ? 0 : next.get_data();
+    } else if (next.get_kind() == NodeKind::OBJECT ||
+               next.get_kind() == NodeKind::ARRAY) {
+      std::span<AstNode> children = arena.as_array_like(next).value();
+      cost.nodes += children.size();
+      pending.insert(pending.end(), children.begin(), children.end());
+    }
+  }
+}
+
+std::optional<AstNode> Patcher::apply(const PatchOperation &operation,
+                                      AstNode root, const char *&error) {
+  using Kind = PatchOperation::Kind;
+
+  AstNode value{};
+  if (operation.kind != Kind::Remove) {
+    value = arena.copy_tree(patch_arena, operation.value);
+  }
+
+  if (operation.path.empty()) {
+    if (operation.kind == Kind::Remove) {
+      error = "Can't remove the root of the document";
+      return {};
+    }
+    return value;
+  }
+
+  // the containers leading to the parent of the target, and which of their
+  // children is on the path
+  std::vector<std::pair<AstNode, size_t>> ancestors;
+  AstNode parent = root;
+  for (size_t i = 0; i + 1 < operation.path.size(); i++) {
+    std::optional<size_t> slot = child_slot(parent, operation.path[i]);
+    if (!slot.has_value()) {
+      error = "Patch path not found";
+      return {};
+    }
+    ancestors.push_back({parent, *slot});
+    parent = child(parent, *slot);
+  }
+
+  const std::string &last = operation.path.back();
+  std::optional<size_t> slot = child_slot(parent, last);
+  bool insert = operation.kind == Kind::Add &&
+                parent.get_kind() == NodeKind::ARRAY;
+  AstNode changed;
+  if (slot.has_value() && !insert) {
+    if (operation.kind != Kind::Remove) {
+      changed = splice(parent, *slot, 1, {value});
+    } else if (parent.get_kind() == NodeKind::OBJECT) {
+      // the key goes along with the value
+      changed = splice(parent, *slot - 1, 2, {});
+    } else {
+      changed = splice(parent, *slot, 1, {});
+    }
+  } else if (operation.kind != Kind::Add) {
+    error = "Patch path not found";
+    return {};
+  } else if (parent.get_kind() == NodeKind::OBJECT) {
+    changed = splice(parent, parent.get_data(), 0, {key(last), value});
+  } else {
+    // adding to an array inserts before the element, `-` appends
+    std::optional<size_t> index =
+        last == "-" ? parent.get_data() : parse_index(last);
+    if (!insert || !index.has_value() || *index > parent.get_data()) {
+      error = "Patch path not found";
+      return {};
+    }
+    changed = splice(parent, *index, 0, {value});
+  }
+
+  // copy the path back up to the root
+  for (size_t i = ancestors.size(); i-- > 0;) {
+    changed = splice(ancestors[i].first, ancestors[i].second, 1, {changed});
+  }
+  return changed;
+}
+
+} // namespace
+
+PatchCost patch_cost(const std::vector<PatchOperation> &operations,
+                     Arena &patch_arena, AstNode root, Arena &arena) {
+  Patcher patcher{arena, patch_arena};
+  PatchCost cost{0, 0};
+  // nodes of the values added by the operations so far
+  size_t added = 0;
+  for (size_t i = 0; i < operations.size(); i++) {
+    const PatchOperation &operation = operations[i];
+    PatchCost value{0, 0};
+    if (operation.kind != PatchOperation::Kind::Remove) {
+      value_cost(patch_arena, operation.value, value);
+    }
+
+    // The containers on the path are copied. Each earlier operation grew them
+    // by at most a pair, and the part of the path which isn't in the original
+    // document runs through values added earlier.
+    size_t path = 0;
+    AstNode node = root;
+    for (const std::string &token : operation.path) {
+      if (node.get_kind() != NodeKind::OBJECT &&
+          node.get_kind() != NodeKind::ARRAY) {
+        break;
+      }
+      path += node.get_data();
+      std::optional<size_t> slot = patcher.child_slot(node, token);
+      if (!slot.has_value()) {
+        break;
+      }
+      node = patcher.child(node, *slot);
+    }
+
+    cost.nodes += path + operation.path.size() * 2 * i + added + value.nodes +
+                  2;
+    cost.bytes += value.bytes + (operation.path.empty()
+                                     ? 0
+                                     : operation.path.back().size());
+    added += value.nodes + 2;
+  }
+  return cost;
+}
+
+std::optional<AstNode>
+apply_patch(const std::vector<PatchOperation> &operations, Arena &patch_arena,
+            AstNode root, Arena &arena, const char *&error) {
+  Patcher patcher{arena, patch_arena};
+  AstNode current = root;
+  for (const PatchOperation &operation : operations) {
+    std::optional<AstNode> next = patcher.apply(operation, current, error);
+    if (!next.has_value()) {
+      return {};
+    }
+    current = *next;
+  }
+  return current;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// JSON Patch (RFC 6902) applied directly to an arena.
+//
+// Nodes are never modified in place. The containers on the path to a changed
+// value are copied to the end of the arena with the change applied, and the
+// copies point to the same children as the originals for everything else. A
+// patch costs the size of those containers and of the new values, not the
+// size of the document, and readers holding the old root still see the old
+// document. The old ranges become garbage, which nothing keeps track of: the
+// owner of the arena compacts it once it has grown enough, see Document.
+
+#include "ast.h"
+
+#include <optional>
+#include <string>
+#include <vector>
+
+struct PatchOperation {
+  enum class Kind {
+    Add,
+    Remove,
+    Replace,
+  };
+
+  Kind kind;
+  // the unescaped reference tokens of the json pointer
+  std::vector<std::string> path;
+  // Add, Replace: a json value in the arena of the patch
+  AstNode value;
+};
+
+// Reads the operations of a patch document. Only add, remove and replace are
+// supported. Returns false and sets `error` if the patch isn't valid.
+bool parse_patch(AstNode patch, Arena &arena,
+                 std::vector<PatchOperation> &operations, const char *&error);
+
+struct PatchCost {
+  size_t nodes;
+  size_t bytes;
+};
+
+// An upper bound of the nodes and string bytes apply_patch() appends to the
+// arena, without modifying anything
+PatchCost patch_cost(const std::vector<PatchOperation> &operations,
+                     Arena &patch_arena, AstNode root, Arena &arena);
+
+// Applies all the operations or none of them and returns the new root, on
+// error the root is empty and `error` is set.
+std::optional<AstNode>
+apply_patch(const std::vector<PatchOperation> &operations, Arena &patch_arena,
+            AstNode root, Arena &arena, const char *&error);
@@ -0,0 +1,206 @@
+#include "profile.h"
+#include "eval.h"
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+Profile::Key Profile::key(AstNode node) {
+  static_assert(sizeof(AstNode) == sizeof(Key));
+  Key key;
+  std::memcpy(key.words, &node, sizeof(node));
+  return key;
+}
+
+void Profile::add_nodes(AstNode expression, Arena &query) {
+  NodeKind kind = expression.get_kind();
+  if (!kind_is_function(kind)) {
+    return;
+  }
+  NodeProfile &node = nodes[key(expression)];
+  node.label = function_name(kind);
+  if (kind == NodeKind::Identifier) {
+    node.label += " ";
+    node.label += query.as_string_like(expression).value();
+  }
+  if (!kind_is_array_like(kind)) {
+    return;
+  }
+  std::span<AstNode> args = query.as_array_like(expression).value();
+  for (size_t i = 0; i < args.size(); i++) {
+    // the name of a field is never evaluated
+    if (kind == NodeKind::Field && i == 1 &&
+        args[i].get_kind() == NodeKind::Identifier) {
+      continue;
+    }
+    add_nodes(args[i], query);
+  }
+}
+
+Profile::Profile(AstNode expression, Arena &query, bool trace)
+    : origin(now()), tracing(trace) {
+  add_nodes(expression, query);
+}
+
+NodeProfile *Profile::find(AstNode node) {
+  if (!kind_is_function(node.get_kind())) {
+    return nullptr;
+  }
+  auto it = nodes.find(key(node));
+  return it == nodes.end() ? nullptr : &it->second;
+}
+
+uint64_t Profile::now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Small thread numbers for the trace, in the order threads first record
+static size_t thread_number() {
+  static std::atomic<size_t> next{1};
+  thread_local size_t number = next.fetch_add(1);
+  return number;
+}
+
+void Profile::trace(const NodeProfile *node, uint64_t start, uint64_t end) {
+  if (!tracing) {
+    return;
+  }
+  size_t thread = thread_number();
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  if (events.size() >= TRACE_LIMIT) {
+    dropped++;
+    return;
+  }
+  events.push_back({node, start, end, thread});
+}
+
+static void write_json_string(FILE *out, std::string_view text) {
+  fputc('"', out);
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+bool Profile::write_trace(const char *path, const char *&error) {
+  FILE *out = fopen(path, "w");
+  if (out == nullptr) {
+    error = "Can't write the trace";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  fprintf(out, "{\"traceEvents\":[");
+  for (size_t i = 0; i < events.size(); i++) {
+    const TraceEvent &event = events[i];
+    fprintf(out, "%s\n{\"name\":", i > 0 ? "," : "");
+    write_json_string(out, event.node->label);
+    // microseconds since the profile was set up
+    fprintf(out,
+            ",\"cat\":\"eval\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+            "\"pid\":1,\"tid\":%zu}",
+            (event.start - origin) / 1e3, (event.end - event.start) / 1e3,
+            event.thread);
+  }
+  fprintf(out,
+          "\n],\"displayTimeUnit\":\"ns\","
+          "\"otherData\":{\"dropped\":%zu}}\n",
+          dropped);
+
+  if (fclose(out) != 0) {
+    error = "Can't write the trace";
+    return false;
+  }
+  return true;
+}
+
+ProfileScope::ProfileScope(Evaluator &ev, NodeProfile *node)
+    : ev(ev), node(node), parent(ev.profile_node), start(Profile::now()) {
+  ev.flush_profile();
+  ev.profile_node = node;
+}
+
+ProfileScope::~ProfileScope() {
+  uint64_t end = Profile::now();
+  ev.flush_profile();
+  ev.profile_node = parent;
+  node->nanoseconds.fetch_add(end - start, std::memory_order_relaxed);
+  ev.profile->trace(node, start, end);
+}
+
+static void print_indent(FILE *out, int depth) {
+  for (int i = 0; i < depth; i++) {
+    fprintf(out, "  ");
+  }
+}
+
+static void print_plan_impl(FILE *out, AstNode node, Arena &query,
+                            Profile *profile, int depth) {
+  print_indent(out, depth);
+  NodeKind kind = node.get_kind();
+  switch (kind) {
+  case NodeKind::ERROR:
+    fprintf(out, "Error\n");
+    return;
+  case NodeKind::STRING: {
+    std::string_view text = query.as_string_like(node).value();
+    fprintf(out, "\"%.*s\"\n", (int)text.size(), text.data());
+    return;
+  }
+  case NodeKind::NUMBER:
+    fprintf(out, "%g\n", node.get_value().number);
+    return;
+  case NodeKind::BOOLEAN:
+    fprintf(out, "%s\n", node.get_value().boolean ? "true" : "false");
+    return;
+  case NodeKind::NIL:
+    fprintf(out, "null\n");
+    return;
+  case NodeKind::OBJECT:
+  case NodeKind::ARRAY:
+    // constants folded by the optimizer
+    fprintf(out, "%s\n", kind == NodeKind::OBJECT ? "{Object}" : "[Array]");
+    return;
+  case NodeKind::Identifier: {
+    std::string_view name = query.as_string_like(node).value();
+    fprintf(out, "%.*s", (int)name.size(), name.data());
+    break;
+  }
+  case NodeKind::Param:
+    fprintf(out, "$%zu", node.get_data());
+    break;
+  default:
+    fprintf(out, "(%s)", function_name(kind));
+    break;
+  }
+
+  NodeProfile *stats = profile != nullptr ? profile->find(node) : nullptr;
+  if (stats != nullptr && stats->calls > 0) {
+    fprintf(out, "  calls=%zu time=%.3fms visited=%zu allocated=%zu",
+            stats->calls.load(), stats->nanoseconds / 1e6,
+            stats->visited.load(), stats->allocated.load());
+  } else if (stats != nullptr) {
+    fprintf(out, "  never executed");
+  }
+  fprintf(out, "\n");
+
+  if (kind_is_array_like(kind)) {
+    std::span<AstNode> args = query.as_array_like(node).value();
+    for (AstNode arg : args) {
+      print_plan_impl(out, arg, query, profile, depth + 1);
+    }
+  }
+}
+
+void print_plan(FILE *out, AstNode expression, Arena &query,
+                Profile *profile) {
+  print_plan_impl(out, expression, query, profile, 0);
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+// Per node profile of an evaluation, the EXPLAIN ANALYZE of expressions.
+//
+// Every function node of the query gets its counters up front, so the lookup
+// table is only read while the evaluation runs and parallel tasks just bump
+// atomics. Times are inclusive and summed over the threads which evaluated
+// the node, so nodes below a parallel aggregation can add up to more than
+// the wall time of their parent.
+
+#include "ast.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+struct Evaluator;
+
+struct NodeProfile {
+  std::atomic<size_t> calls{0};
+  std::atomic<uint64_t> nanoseconds{0};
+  // elements, keys and subscripts looked at, by map lookups, subscripts and
+  // the steps of sequences
+  std::atomic<size_t> visited{0};
+  // strings and lists created for results
+  std::atomic<size_t> allocated{0};
+  // the name in traces, like "Field" or "Identifier price"
+  std::string label;
+};
+
+// Counts which a thread collects for the current node, they are added to the
+// node once it's done or the thread leaves it
+struct ProfileCounters {
+  size_t visited = 0;
+  size_t allocated = 0;
+};
+
+class Profile {
+  struct Key {
+    uint64_t words[2];
+
+    bool operator==(const Key &other) const {
+      return words[0] == other.words[0] && words[1] == other.words[1];
+    }
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key &key) const {
+      return key.words[0] * 0x9e3779b97f4a7c15 ^ key.words[1];
+    }
+  };
+
+  struct TraceEvent {
+    const NodeProfile *node;
+    uint64_t start;
+    uint64_t end;
+    size_t thread;
+  };
+
+  std::unordered_map<Key, NodeProfile, KeyHash> nodes;
+  uint64_t origin;
+
+  bool tracing;
+  std::mutex trace_mutex;
+  std::vector<TraceEvent> events;
+  size_t dropped = 0;
+
+  static Key key(AstNode node);
+  void add_nodes(AstNode expression, Arena &query);
+
+public:
+  // traces stop recording past this many events
+  static constexpr size_t TRACE_LIMIT = 1000000;
+
+  // Sets up the counters for the nodes of the expression, the trace events
+  // are only kept if `trace` is set
+  Profile(AstNode expression, Arena &query, bool trace = false);
+  Profile(const Profile &) = delete;
+  Profile &operator=(const Profile &) = delete;
+
+  // nullptr for literals and nodes of other expressions, they aren't profiled
+  NodeProfile *find(AstNode node);
+
+  // nanoseconds on a monotonic clock
+  static uint64_t now();
+
+  void trace(const NodeProfile *node, uint64_t start, uint64_t end);
+
+  // Chrome trace event format, viewable in chrome://tracing or Perfetto.
+  // Returns false and sets `error` if the file can't be written.
+  bool write_trace(const char *path, const char *&error);
+};
+
+// Attributes the work of `ev` to `node` from construction to destruction, and
+// to the node it was attributed to before afterwards. Calls aren't counted.
+class ProfileScope {
+  Evaluator &ev;
+  NodeProfile *node;
+  NodeProfile *parent;
+  uint64_t start;
+
+public:
+  ProfileScope(Evaluator &ev, NodeProfile *node);
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+  ~ProfileScope();
+};
+
+// Prints the expression tree one node per line, with the counters of
+// `profile` next to each function node if it's given
+void print_plan(FILE *out, AstNode expression, Arena &query,
+                Profile *profile);
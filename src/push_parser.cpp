@@ -0,0 +1,391 @@
+#include "push_parser.h"
+#include "cpu.h"
+
+#include <cstdio>
+
+static bool is_whitespace(int c) {
+  return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static bool is_digit(int c) { return '0' <= c && c <= '9'; }
+
+static bool is_alpha(int c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+
+PushParser::PushParser(Arena &arena, ParseOptions options)
+    : arena(arena), options(options), state(State::Value),
+      root(AstNode::error()), in_key(false), hex_digits(0), hex_value(0),
+      high_surrogate(0), utf8_remaining(0), utf8_lower(0), utf8_upper(0),
+      line(0), column(0) {}
+
+void PushParser::error(const char *message) {
+  errors.push_back(ParseError{line, column, message});
+}
+
+void PushParser::feed(std::span<const char> chunk) {
+  for (char byte : chunk) {
+    int c = (unsigned char)byte;
+    while (!step(c)) {
+    }
+    if (c == '\n') {
+      line++;
+      column = 0;
+    } else {
+      column++;
+    }
+  }
+}
+
+AstNode PushParser::finish() {
+  while (state != State::Done) {
+    step(EOF);
+  }
+  return root;
+}
+
+void PushParser::end_string(AstNode node) {
+  if (in_key) {
+    arena.node_stack_push(node);
+    state = State::Colon;
+  } else {
+    value = node;
+    state = State::AfterValue;
+  }
+}
+
+void PushParser::end_number() {
+  std::optional<double> number = take_number(arena, token_start);
+  if (number.has_value()) {
+    value = AstNode::number(*number);
+  } else {
+    error("Invalid number");
+    value = AstNode::error();
+  }
+  state = State::AfterValue;
+}
+
+// The same states as parse_json(), split up further wherever parse_json()
+// looks at the next character
+bool PushParser::step(int c) {
+  switch (state) {
+  case State::Value:
+    if (is_whitespace(c)) {
+      return true;
+    }
+    if (c == '[' || c == '{') {
+      if (frames.size() >= options.max_depth) {
+        error("Maximum nesting depth exceeded");
+        arena.node_stack_truncate(frames.empty() ? arena.node_stack_position()
+                                                 : frames[0].start);
+        root = AstNode::error();
+        state = State::Done;
+        return true;
+      }
+      bool object = c == '{';
+      frames.push_back({object ? NodeKind::OBJECT : NodeKind::ARRAY,
+                        arena.node_stack_position()});
+      state = object ? State::Key : State::Value;
+      return true;
+    }
+    token_start = arena.string_position();
+    if (c == '"') {
+      in_key = false;
+      state = State::String;
+      return true;
+    } else if (c == '-' || is_digit(c)) {
+      state = State::Number;
+    } else if (is_alpha(c)) {
+      state = State::Keyword;
+    } else {
+      value.reset();
+      state = State::AfterValue;
+    }
+    return false;
+
+  case State::AfterValue:
+    if (frames.empty()) {
+      if (value.has_value()) {
+        root = *value;
+      } else {
+        error("Invalid json");
+      }
+      state = State::Done;
+      return false;
+    }
+    if (frames.back().kind == NodeKind::ARRAY) {
+      if (!value.has_value()) {
+        state = State::CloseArray;
+        return false;
+      }
+      arena.node_stack_push(*value);
+      state = State::ArrayComma;
+      return false;
+    }
+    if (!value.has_value()) {
+      error("Expected value");
+      value = AstNode::error();
+    }
+    arena.node_stack_push(*value);
+    state = State::ObjectComma;
+    return false;
+
+  case State::ArrayComma:
+  case State::ObjectComma:
+    if (is_whitespace(c)) {
+      return true;
+    }
+    if (c == ',') {
+      state = state == State::ArrayComma ? State::Value : State::Key;
+      return true;
+    }
+    state = state == State::ArrayComma ? State::CloseArray : State::CloseObject;
+    return false;
+
+  case State::Key:
+    if (is_whitespace(c)) {
+      return true;
+    }
+    if (c != '"') {
+      state = State::CloseObject;
+      return false;
+    }
+    token_start = arena.string_position();
+    in_key = true;
+    state = State::String;
+    return true;
+
+  case State::Colon:
+    state = State::Value;
+    if (c == ':') {
+      return true;
+    }
+    error("Expected :");
+    return false;
+
+  case State::CloseArray:
+  case State::CloseObject: {
+    if (is_whitespace(c)) {
+      return true;
+    }
+    bool object = state == State::CloseObject;
+    bool closed = c == (object ? '}' : ']');
+    if (!closed) {
+      error("Expected closing ]");
+    }
+    value = arena.finish_container(object ? NodeKind::OBJECT : NodeKind::ARRAY,
+                                   frames.back().start);
+    frames.pop_back();
+    state = State::AfterValue;
+    return closed;
+  }
+
+  case State::String:
+    if (c == '\\') {
+      state = State::Escape;
+    } else if (c == '"') {
+      end_string(arena.finish_string(token_start));
+    } else if (c == EOF) {
+      error("Expected end of string");
+      end_string(AstNode::error());
+      return false;
+    } else if (c >= 0x80) {
+      Utf8Lead lead = utf8_lead(c);
+      if (lead.len == 0) {
+        error("Invalid UTF-8");
+        string_push_utf8(arena, REPLACEMENT_CHARACTER);
+        return true;
+      }
+      utf8_start = arena.string_position();
+      arena.string_push((char)c);
+      utf8_remaining = lead.len - 1;
+      utf8_lower = lead.lower;
+      utf8_upper = lead.upper;
+      state = State::Utf8;
+    } else {
+      arena.string_push((char)c);
+    }
+    return true;
+
+  case State::Utf8:
+    if (c < utf8_lower || c > utf8_upper) {
+      error("Invalid UTF-8");
+      arena.string_truncate(utf8_start);
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+      state = State::String;
+      return false;
+    }
+    arena.string_push((char)c);
+    utf8_lower = 0x80;
+    utf8_upper = 0xbf;
+    if (--utf8_remaining == 0) {
+      state = State::String;
+    }
+    return true;
+
+  case State::Escape:
+    if (c == 'u') {
+      hex_digits = 0;
+      hex_value = 0;
+      state = State::Hex;
+    } else {
+      arena.string_push(unescape(c));
+      state = State::String;
+    }
+    // the end of input is left to the string
+    return c != EOF;
+
+  case State::Hex: {
+    int digit = hex_digit(c);
+    if (digit < 0) {
+      error("Expected hexadecimal");
+      if (high_surrogate != 0) {
+        high_surrogate = 0;
+        string_push_utf8(arena, REPLACEMENT_CHARACTER);
+      }
+      state = State::String;
+      return false;
+    }
+    hex_value = hex_value << 4 | digit;
+    hex_digits++;
+    if (hex_digits == 4) {
+      state = State::Unit;
+    }
+    return true;
+  }
+
+  // like unicode_escape(), which looks at the character after the digits
+  // before it decides
+  case State::Unit:
+    if (high_surrogate != 0) {
+      uint32_t high = high_surrogate;
+      high_surrogate = 0;
+      if (is_low_surrogate(hex_value)) {
+        string_push_utf8(arena, combine_surrogates(high, hex_value));
+        state = State::String;
+        return false;
+      }
+      error("Unpaired surrogate");
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+    }
+    if (is_low_surrogate(hex_value)) {
+      error("Unpaired surrogate");
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+    } else if (!is_high_surrogate(hex_value)) {
+      string_push_utf8(arena, hex_value);
+    } else if (c == '\\') {
+      high_surrogate = hex_value;
+      state = State::SurrogateEscape;
+      return true;
+    } else {
+      error("Unpaired surrogate");
+      string_push_utf8(arena, REPLACEMENT_CHARACTER);
+    }
+    state = State::String;
+    return false;
+
+  case State::SurrogateEscape:
+    if (c == 'u') {
+      hex_digits = 0;
+      hex_value = 0;
+      state = State::Hex;
+      return true;
+    }
+    error("Unpaired surrogate");
+    string_push_utf8(arena, REPLACEMENT_CHARACTER);
+    high_surrogate = 0;
+    arena.string_push(unescape(c));
+    state = State::String;
+    return c != EOF;
+
+  case State::Number:
+    state = State::IntegerFirst;
+    if (c == '-') {
+      arena.string_push('-');
+      return true;
+    }
+    return false;
+
+  case State::IntegerFirst:
+  case State::FractionFirst:
+  case State::ExponentFirst: {
+    State next = state == State::IntegerFirst    ? State::Integer
+                 : state == State::FractionFirst ? State::Fraction
+                                                 : State::Exponent;
+    state = next;
+    if (is_digit(c)) {
+      arena.string_push((char)c);
+      return true;
+    }
+    error("Expected digit");
+    return false;
+  }
+
+  case State::Integer:
+    if (is_digit(c)) {
+      arena.string_push((char)c);
+      return true;
+    }
+    if (c == '.') {
+      arena.string_push('.');
+      state = State::FractionFirst;
+      return true;
+    }
+    state = State::ExponentMark;
+    return false;
+
+  case State::Fraction:
+    if (is_digit(c)) {
+      arena.string_push((char)c);
+      return true;
+    }
+    state = State::ExponentMark;
+    return false;
+
+  case State::ExponentMark:
+    if (c == 'e' || c == 'E') {
+      arena.string_push((char)c);
+      state = State::ExponentSign;
+      return true;
+    }
+    end_number();
+    return false;
+
+  case State::ExponentSign:
+    state = State::ExponentFirst;
+    if (c == '+' || c == '-') {
+      arena.string_push((char)c);
+      return true;
+    }
+    return false;
+
+  case State::Exponent:
+    if (is_digit(c)) {
+      arena.string_push((char)c);
+      return true;
+    }
+    end_number();
+    return false;
+
+  case State::Keyword: {
+    if (is_alpha(c)) {
+      arena.string_push((char)c);
+      return true;
+    }
+    std::optional<AstNode> keyword = json_keyword(
+        arena.get_string_between(token_start, arena.string_position()));
+    arena.string_truncate(token_start);
+    if (!keyword.has_value()) {
+      error("Expected null or boolean");
+      keyword = AstNode::error();
+    }
+    value = *keyword;
+    state = State::AfterValue;
+    return false;
+  }
+
+  case State::Done:
+    return true;
+  }
+  return true;
+}
@@ -0,0 +1,105 @@
+#pragma once
+
+// Json parser for input which arrives in pieces, e.g. from a socket.
+//
+// feed() parses as far as the bytes it's given go and remembers where it
+// stopped, a chunk can end anywhere, in the middle of a string or a number as
+// well, so nothing has to be buffered until the document is complete. The
+// arena and the errors end up the same as with parse_json().
+
+#include "parser.h"
+#include "parser_driver.h"
+
+#include <optional>
+#include <span>
+#include <vector>
+
+class PushParser {
+  enum class State {
+    // a value, or nothing if the container ends
+    Value,
+    // `value` is complete, or missing
+    AfterValue,
+    ArrayComma,
+    ObjectComma,
+    // the next key of an object, or its end
+    Key,
+    Colon,
+    CloseArray,
+    CloseObject,
+    String,
+    // the rest of a multibyte UTF-8 sequence
+    Utf8,
+    // the character after a backslash
+    Escape,
+    // the digits of \uXXXX
+    Hex,
+    // the character after the digits
+    Unit,
+    // the character after the backslash which follows a high surrogate
+    SurrogateEscape,
+    Number,
+    IntegerFirst,
+    Integer,
+    FractionFirst,
+    Fraction,
+    // the `e` of the exponent, or the end of the number
+    ExponentMark,
+    ExponentSign,
+    ExponentFirst,
+    Exponent,
+    Keyword,
+    // the root is complete, the rest of the input is ignored
+    Done,
+  };
+
+  struct Frame {
+    NodeKind kind;
+    NodeStackIndex start;
+  };
+
+  Arena &arena;
+  ParseOptions options;
+  State state;
+  std::vector<Frame> frames;
+  std::optional<AstNode> value;
+  AstNode root;
+
+  // the string, number or keyword being read
+  StringIndex token_start;
+  bool in_key;
+  int hex_digits;
+  uint32_t hex_value;
+  // waiting for its low surrogate
+  uint32_t high_surrogate;
+  StringIndex utf8_start;
+  int utf8_remaining;
+  // the range of the next byte of the sequence
+  int utf8_lower;
+  int utf8_upper;
+
+  int line;
+  int column;
+  std::vector<ParseError> errors;
+
+  // Returns false if `c` still has to be looked at in the next state, EOF is
+  // the end of input
+  bool step(int c);
+  void end_string(AstNode node);
+  void end_number();
+  void error(const char *message);
+
+public:
+  PushParser(Arena &arena, ParseOptions options = {});
+
+  // The chunk only has to stay valid during the call
+  void feed(std::span<const char> chunk);
+
+  // Marks the end of input, returns the root like parse_json()
+  AstNode finish();
+
+  // Whether the root value is complete, later input is ignored
+  bool done() const { return state == State::Done; }
+
+  const std::vector<ParseError> &get_errors() const { return errors; }
+};
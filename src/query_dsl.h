@@ -0,0 +1,220 @@
+#pragma once
+
+// Compile time specialized path queries.
+//
+//   Value value = JE_QUERY("a.b[2].c").eval(arena, root);
+//
+// The expression is parsed by the compiler, every field and subscript step
+// becomes its own inlined function with the key and its length baked in, so
+// there is no dispatch on NodeKind for the query itself. Only paths made of
+// identifiers and constant subscripts are accepted, anything else fails to
+// compile. The results are the same as parsing the expression at runtime
+// with parse_expression() and evaluating it with eval().
+
+#include "eval.h"
+
+#include <array>
+#include <cstring>
+#include <optional>
+#include <string_view>
+#include <utility>
+
+template <size_t N> struct FixedString {
+  char data[N];
+
+  constexpr FixedString(const char (&string)[N]) {
+    for (size_t i = 0; i < N; i++) {
+      data[i] = string[i];
+    }
+  }
+
+  constexpr std::string_view view() const { return {data, N - 1}; }
+};
+
+struct QueryStep {
+  enum class Kind {
+    Field,
+    Index,
+  };
+
+  Kind kind;
+  // Field, position of the key in the expression
+  size_t start;
+  size_t len;
+  // Index
+  size_t index;
+};
+
+template <size_t N> struct ParsedPath {
+  std::array<QueryStep, N> steps;
+  bool ok;
+};
+
+namespace query_dsl {
+
+constexpr bool is_alpha(char c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+}
+// same as the runtime parser, identifiers start with a letter followed by
+// letters and underscores
+constexpr bool is_identifier(char c) { return is_alpha(c) || c == '_'; }
+constexpr bool is_digit(char c) { return '0' <= c && c <= '9'; }
+
+// Parses `identifier ('.' identifier | '[' number ']')*`, with `steps` set to
+// nullptr it only counts the steps. Returns the number of steps, or SIZE_MAX if
+// the path isn't valid.
+constexpr size_t parse_steps(std::string_view path, QueryStep *steps) {
+  size_t count = 0;
+  size_t i = 0;
+  auto skip_whitespace = [&]() {
+    while (i < path.size() && (path[i] == ' ' || path[i] == '\t' ||
+                               path[i] == '\n' || path[i] == '\r')) {
+      i++;
+    }
+  };
+  auto identifier = [&]() {
+    skip_whitespace();
+    size_t start = i;
+    if (i == path.size() || !is_alpha(path[i])) {
+      return false;
+    }
+    while (i < path.size() && is_identifier(path[i])) {
+      i++;
+    }
+    if (steps != nullptr) {
+      steps[count] = {QueryStep::Kind::Field, start, i - start, 0};
+    }
+    count++;
+    return true;
+  };
+
+  if (!identifier()) {
+    return SIZE_MAX;
+  }
+
+  while (true) {
+    skip_whitespace();
+    if (i == path.size()) {
+      return count;
+    }
+
+    if (path[i] == '.') {
+      i++;
+      if (!identifier()) {
+        return SIZE_MAX;
+      }
+    } else if (path[i] == '[') {
+      i++;
+      skip_whitespace();
+      size_t start = i;
+      size_t index = 0;
+      while (i < path.size() && is_digit(path[i])) {
+        index = index * 10 + (size_t)(path[i] - '0');
+        i++;
+      }
+      skip_whitespace();
+      if (i == start || i == path.size() || path[i] != ']') {
+        return SIZE_MAX;
+      }
+      i++;
+      if (steps != nullptr) {
+        steps[count] = {QueryStep::Kind::Index, 0, 0, index};
+      }
+      count++;
+    } else {
+      return SIZE_MAX;
+    }
+  }
+}
+
+constexpr size_t count_steps(std::string_view path) {
+  size_t count = parse_steps(path, nullptr);
+  return count == SIZE_MAX ? 0 : count;
+}
+
+template <size_t N> constexpr ParsedPath<N> parse_path(std::string_view path) {
+  ParsedPath<N> parsed{};
+  parsed.ok = N > 0 && parse_steps(path, parsed.steps.data()) == N;
+  return parsed;
+}
+
+static_assert(count_steps("a.b[2].c") == 4);
+static_assert(count_steps("a [ 10 ] . b") == 3);
+static_assert(count_steps("unit_name.b") == 2);
+static_assert(count_steps("_a") == 0);
+static_assert(count_steps("a.b[x]") == 0);
+static_assert(count_steps("size(a)") == 0);
+
+} // namespace query_dsl
+
+template <FixedString Path> struct Query {
+  static constexpr size_t step_count = query_dsl::count_steps(Path.view());
+  static constexpr ParsedPath<step_count> parsed =
+      query_dsl::parse_path<step_count>(Path.view());
+
+  static_assert(parsed.ok, "JE_QUERY only supports paths made of identifiers "
+                           "and constant subscripts");
+
+  template <size_t I>
+  static std::optional<AstNode> step(Arena &arena, AstNode node) {
+    constexpr QueryStep s = parsed.steps[I];
+
+    if constexpr (s.kind == QueryStep::Kind::Field) {
+      constexpr std::string_view key = Path.view().substr(s.start, s.len);
+      if (node.get_kind() != NodeKind::OBJECT) {
+        return {};
+      }
+      std::span<AstNode> children = arena.as_array_like(node).value();
+      if constexpr (key.size() <= INLINE_STRING_MAX) {
+        // short keys are stored inline, a node compare finds them
+        AstNode wanted = AstNode::inline_string(key);
+        for (size_t i = 0; i < children.size(); i += 2) {
+          if (children[i].same_bytes(wanted)) {
+            return children[i + 1];
+          }
+        }
+        return {};
+      }
+      for (size_t i = 0; i < children.size(); i += 2) {
+        const AstNode &child = children[i];
+        // the length check rejects most keys without touching the strings
+        if (child.get_kind() == NodeKind::STRING &&
+            child.get_data() == key.size() &&
+            std::memcmp(arena.as_string_like(child)->data(), key.data(),
+                        key.size()) == 0) {
+          return children[i + 1];
+        }
+      }
+      return {};
+    } else {
+      if (node.get_kind() != NodeKind::ARRAY || s.index >= node.get_data()) {
+        return {};
+      }
+      return arena.as_array_like(node).value()[s.index];
+    }
+  }
+
+  template <size_t... I>
+  static std::optional<AstNode> walk(Arena &arena, AstNode root,
+                                     std::index_sequence<I...>) {
+    std::optional<AstNode> node = root;
+    // stops at the first step which fails
+    ((node = step<I>(arena, *node)).has_value() && ...);
+    return node;
+  }
+
+  // The node at the end of the path
+  static std::optional<AstNode> find(Arena &arena, AstNode root) {
+    return walk(arena, root, std::make_index_sequence<step_count>());
+  }
+
+  static Value eval(Arena &arena, AstNode root) {
+    std::optional<AstNode> node = find(arena, root);
+    if (!node.has_value()) {
+      return Value::error();
+    }
+    return from_json(*node, arena);
+  }
+};
+
+#define JE_QUERY(path) (Query<FixedString(path)>{})
@@ -0,0 +1,204 @@
+#include "sequence.h"
+
+#include <algorithm>
+#include <cmath>
+
+bool is_sequence_expression(AstNode expression, Arena &arena) {
+  switch (expression.get_kind()) {
+  case NodeKind::Slice:
+  case NodeKind::Filter:
+    return true;
+  case NodeKind::Field:
+  case NodeKind::Subscript:
+    return is_sequence_expression(arena.as_array_like(expression).value()[0],
+                                  arena);
+  default:
+    return false;
+  }
+}
+
+std::optional<AstNode> find_field(AstNode object, std::string_view key,
+                                  Arena &arena, size_t *compared) {
+  if (object.get_kind() != NodeKind::OBJECT) {
+    return {};
+  }
+
+  auto children = arena.as_array_like(object).value();
+  auto found = [&](size_t i) {
+    if (compared != nullptr) {
+      *compared += i / 2 + 1;
+    }
+    return children[i + 1];
+  };
+  // a short key is only ever stored inline, so comparing the nodes is enough
+  if (key.size() <= INLINE_STRING_MAX) {
+    AstNode wanted = AstNode::inline_string(key);
+    for (size_t i = 0; i < children.size(); i += 2) {
+      if (children[i].same_bytes(wanted)) {
+        return found(i);
+      }
+    }
+  } else {
+    for (size_t i = 0; i < children.size(); i += 2) {
+      const AstNode &child = children[i];
+      if (child.get_kind() == NodeKind::STRING &&
+          arena.as_string_like(child).value() == key) {
+        return found(i);
+      }
+    }
+  }
+  if (compared != nullptr) {
+    *compared += children.size() / 2;
+  }
+  return {};
+}
+
+// Evaluates an optional integer operand of a pipeline step, NIL means the
+// operand is missing.
+static bool eval_integer(AstNode expression, Evaluator &ev,
+                         std::optional<ptrdiff_t> &out) {
+  if (expression.get_kind() == NodeKind::NIL) {
+    out = {};
+    return true;
+  }
+
+  Value value = eval(expression, ev);
+  if (value.get_kind() != ValueKind::NUMBER) {
+    ev.error("Slice bounds and subscripts must be numbers");
+    return false;
+  }
+  double number = std::floor(value.get_data().number);
+  if (std::isnan(number)) {
+    ev.error("Slice bounds and subscripts must be numbers");
+    return false;
+  }
+  // past the end either way, and casting doubles out of range is undefined
+  number = std::clamp(number, (double)-PTRDIFF_MAX, (double)PTRDIFF_MAX);
+  out = number >= (double)PTRDIFF_MAX ? PTRDIFF_MAX : (ptrdiff_t)number;
+  return true;
+}
+
+std::optional<Pipeline> compile_pipeline(AstNode sequence, Evaluator &ev) {
+  Pipeline pipeline;
+  AstNode node = sequence;
+
+  while (true) {
+    auto args = ev.query.as_array_like(node).value();
+    PipelineStep step{};
+
+    switch (node.get_kind()) {
+    case NodeKind::Field: {
+      step.kind = PipelineStep::Kind::Field;
+      if (args[1].get_kind() != NodeKind::Identifier) {
+        ev.error("Field access expected identifier");
+        return {};
+      }
+      step.key = ev.query.as_string_like(args[1]).value();
+      break;
+    }
+    case NodeKind::Subscript: {
+      step.kind = PipelineStep::Kind::Index;
+      std::optional<ptrdiff_t> index;
+      if (!eval_integer(args[1], ev, index)) {
+        return {};
+      }
+      if (!index.has_value() || *index < 0) {
+        ev.error("Subscript expected non-negative number");
+        return {};
+      }
+      step.index = (size_t)*index;
+      break;
+    }
+    case NodeKind::Slice: {
+      step.kind = PipelineStep::Kind::Slice;
+      std::optional<ptrdiff_t> stride;
+      if (!eval_integer(args[1], ev, step.start) ||
+          !eval_integer(args[2], ev, step.end) ||
+          !eval_integer(args[3], ev, stride)) {
+        return {};
+      }
+      step.step = stride.value_or(1);
+      if (step.step == 0) {
+        ev.error("Slice step cannot be zero");
+        return {};
+      }
+      break;
+    }
+    case NodeKind::Filter: {
+      step.kind = PipelineStep::Kind::Filter;
+      step.filter = compile_filter(args[1], ev);
+      step.node = node;
+      pipeline.steps.push_back(std::move(step));
+
+      // the steps are reversed at the end, the filter iterates the whole array
+      step = PipelineStep{};
+      step.kind = PipelineStep::Kind::Slice;
+      step.step = 1;
+      break;
+    }
+    default:
+      assert(0 && "Not a sequence expression");
+    }
+
+    pipeline.steps.push_back(std::move(step));
+
+    if ((node.get_kind() == NodeKind::Slice ||
+         node.get_kind() == NodeKind::Filter) &&
+        !is_sequence_expression(args[0], ev.query)) {
+      pipeline.source = args[0];
+      break;
+    }
+    node = args[0];
+  }
+
+  std::reverse(pipeline.steps.begin(), pipeline.steps.end());
+  return pipeline;
+}
+
+// Same semantics as python slices
+SliceBounds resolve_slice(const PipelineStep &step, size_t len) {
+  ptrdiff_t length = (ptrdiff_t)len;
+  auto clamp = [&](std::optional<ptrdiff_t> bound, ptrdiff_t missing,
+                   ptrdiff_t lowest, ptrdiff_t highest) {
+    if (!bound.has_value()) {
+      return missing;
+    }
+    ptrdiff_t value = *bound < 0 ? *bound + length : *bound;
+    return std::clamp(value, lowest, highest);
+  };
+
+  // the counts are rounded up without adding the stride, which can be as
+  // large as PTRDIFF_MAX
+  SliceBounds bounds{0, step.step, 0};
+  if (step.step > 0) {
+    ptrdiff_t start = clamp(step.start, 0, 0, length);
+    ptrdiff_t end = clamp(step.end, length, 0, length);
+    bounds.start = start;
+    if (end > start) {
+      bounds.count = (size_t)(1 + (end - start - 1) / step.step);
+    }
+  } else {
+    ptrdiff_t start = clamp(step.start, length - 1, -1, length - 1);
+    ptrdiff_t end = clamp(step.end, -1, -1, length - 1);
+    bounds.start = start;
+    if (start > end) {
+      bounds.count = (size_t)(1 + (start - end - 1) / -step.step);
+    }
+  }
+  return bounds;
+}
+
+std::optional<PipelineSource> pipeline_source(const Pipeline &pipeline,
+                                              Evaluator &ev) {
+  Value source = eval(pipeline.source, ev);
+  if (source.get_kind() != ValueKind::JSON ||
+      source.get_data().json.get_kind() != NodeKind::ARRAY) {
+    ev.error("Slice can only be applied on json arrays");
+    return {};
+  }
+
+  std::span<AstNode> elements =
+      ev.arena.as_array_like(source.get_data().json).value();
+  return PipelineSource{elements,
+                        resolve_slice(pipeline.steps[0], elements.size())};
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include "eval.h"
+#include "filter.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+// Projections like `a.b[*].c`, `a.b[1:10:2][0]` or `a.items[? price > 10]`
+// evaluate to lazy sequences, the Value only holds the expression. Consumers
+// such as `max` or `size` compile it into a flat pipeline of steps which is
+// then run once per element of the source array, without building any
+// intermediate arrays.
+
+struct PipelineStep {
+  enum class Kind {
+    Field,
+    Index,
+    Slice,
+    // always directly follows a Slice, which iterates the filtered array
+    Filter,
+  };
+
+  Kind kind;
+  // Field
+  std::string_view key;
+  // Index
+  size_t index;
+  // Slice
+  std::optional<ptrdiff_t> start;
+  std::optional<ptrdiff_t> end;
+  ptrdiff_t step;
+  // Filter
+  FilterProgram filter;
+  // Filter, the node the batches are profiled under
+  AstNode node;
+};
+
+// The indices selected by a slice from an array of a specific length
+struct SliceBounds {
+  ptrdiff_t start;
+  ptrdiff_t step;
+  size_t count;
+
+  size_t at(size_t i) const { return (size_t)(start + (ptrdiff_t)i * step); }
+};
+
+struct Pipeline {
+  // the expression producing the array iterated by the first step
+  AstNode source;
+  // steps[0] is always a Slice
+  std::vector<PipelineStep> steps;
+};
+
+// Whether the expression produces a sequence, this is a property of the syntax
+// tree so it can be checked without evaluating anything.
+bool is_sequence_expression(AstNode expression, Arena &arena);
+
+// Evaluates the slice bounds and subscripts of the projection, they are
+// relative to the document root so they only need to be computed once.
+std::optional<Pipeline> compile_pipeline(AstNode sequence, Evaluator &ev);
+
+SliceBounds resolve_slice(const PipelineStep &step, size_t len);
+
+// The value of the first `key` of the object. The keys compared are added to
+// `compared` if it's given.
+std::optional<AstNode> find_field(AstNode object, std::string_view key,
+                                  Arena &arena, size_t *compared = nullptr);
+
+template <typename F>
+void run_pipeline(const Pipeline &pipeline, size_t step, AstNode current,
+                  Evaluator &ev, F &callback);
+
+// Runs the steps following the Slice at `step` on the selected elements
+// [begin, end). When the next step is a filter, the elements are filtered a
+// batch at a time before going further.
+template <typename F>
+void run_slice(const Pipeline &pipeline, size_t step,
+               std::span<AstNode> elements, SliceBounds bounds, size_t begin,
+               size_t end, Evaluator &ev, F &callback) {
+  size_t next = step + 1;
+  if (next < pipeline.steps.size() &&
+      pipeline.steps[next].kind == PipelineStep::Kind::Filter) {
+    const PipelineStep &filter = pipeline.steps[next];
+    NodeProfile *profile =
+        ev.profile != nullptr ? ev.profile->find(filter.node) : nullptr;
+    AstNode batch[FILTER_BATCH];
+    uint8_t mask[FILTER_BATCH];
+    for (size_t i = begin; i < end; i += FILTER_BATCH) {
+      size_t len = std::min(FILTER_BATCH, end - i);
+      for (size_t j = 0; j < len; j++) {
+        batch[j] = elements[bounds.at(i + j)];
+        mask[j] = 1;
+      }
+      if (!ev.step(len)) {
+        return;
+      }
+      {
+        std::optional<ProfileScope> scope;
+        if (profile != nullptr) {
+          // every element of the batch is a call of the filter, as if the
+          // predicate was evaluated per element
+          profile->calls.fetch_add(len, std::memory_order_relaxed);
+          scope.emplace(ev, profile);
+        }
+        ev.pending.visited += len;
+        filter_batch(filter.filter, std::span(batch, len), mask, ev);
+      }
+      for (size_t j = 0; j < len; j++) {
+        if (mask[j]) {
+          run_pipeline(pipeline, next + 1, batch[j], ev, callback);
+        }
+      }
+    }
+    return;
+  }
+
+  ev.pending.visited += end - begin;
+  for (size_t i = begin; i < end;) {
+    // the budget is charged a block of elements at a time
+    size_t block = std::min(end, i + BudgetState::BUDGET_INTERVAL);
+    if (!ev.step(block - i)) {
+      return;
+    }
+    for (; i < block; i++) {
+      run_pipeline(pipeline, next, elements[bounds.at(i)], ev, callback);
+    }
+  }
+}
+
+// Runs the steps starting at `step` on a json node, calling `callback` for
+// every node that comes out of the end. Elements for which a step doesn't
+// apply (missing field, index out of range, ...) are skipped.
+template <typename F>
+void run_pipeline(const Pipeline &pipeline, size_t step, AstNode current,
+                  Evaluator &ev, F &callback) {
+  Arena &arena = ev.arena;
+  for (; step < pipeline.steps.size(); step++) {
+    const PipelineStep &s = pipeline.steps[step];
+    switch (s.kind) {
+    case PipelineStep::Kind::Field: {
+      std::optional<AstNode> value =
+          find_field(current, s.key, arena, &ev.pending.visited);
+      if (!value.has_value()) {
+        return;
+      }
+      current = *value;
+      break;
+    }
+    case PipelineStep::Kind::Index: {
+      if (current.get_kind() != NodeKind::ARRAY ||
+          s.index >= current.get_data()) {
+        return;
+      }
+      ev.pending.visited++;
+      current = arena.as_array_like(current).value()[s.index];
+      break;
+    }
+    case PipelineStep::Kind::Slice: {
+      if (current.get_kind() != NodeKind::ARRAY) {
+        return;
+      }
+      std::span<AstNode> elements = arena.as_array_like(current).value();
+      SliceBounds bounds = resolve_slice(s, elements.size());
+      run_slice(pipeline, step, elements, bounds, 0, bounds.count, ev,
+                callback);
+      return;
+    }
+    case PipelineStep::Kind::Filter:
+      assert(0 && "Filters are handled by run_slice");
+      return;
+    }
+  }
+  callback(current);
+}
+
+struct PipelineSource {
+  std::span<AstNode> elements;
+  SliceBounds bounds;
+};
+
+// Evaluates the source of the pipeline and returns the elements selected by
+// its first slice, the remaining steps are applied with
+// `run_slice(pipeline, 0, ...)`. Returns an empty optional when the source
+// isn't an array.
+std::optional<PipelineSource> pipeline_source(const Pipeline &pipeline,
+                                              Evaluator &ev);
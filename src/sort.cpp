@@ -0,0 +1,287 @@
+#include "sort.h"
+
+#include <algorithm>
+#include <cmath>
+
+static const char *KEY_ERROR = "Sort keys must be all numbers or all strings";
+
+namespace {
+
+template <typename Key> struct Entry {
+  Key key;
+  // position of the element, equal keys keep the order of the elements
+  size_t index;
+};
+
+// Whether `a` comes before `b` in the result
+template <typename Key> struct Before {
+  bool descending;
+
+  bool operator()(const Entry<Key> &a, const Entry<Key> &b) const {
+    if (a.key < b.key) {
+      return !descending;
+    }
+    if (b.key < a.key) {
+      return descending;
+    }
+    return a.index < b.index;
+  }
+};
+
+} // namespace
+
+// The elements of an array, a sequence or a list. They are moved into
+// `storage` unless they are the children of a json array.
+static bool elements_of(Value &value, Evaluator &ev,
+                        std::vector<AstNode> &storage,
+                        std::span<const AstNode> &elements) {
+  if (value.get_kind() == ValueKind::JSON &&
+      value.get_data().json.get_kind() == NodeKind::ARRAY) {
+    elements = ev.arena.as_array_like(value.get_data().json).value();
+    return true;
+  }
+  if (value.get_kind() == ValueKind::SEQUENCE) {
+    if (!collect_sequence(value.get_data().sequence, ev, storage)) {
+      return false;
+    }
+  } else if (value.get_kind() == ValueKind::LIST) {
+    storage = std::move(value.get_data().list);
+  } else {
+    ev.error("Only arrays can be sorted");
+    return false;
+  }
+  elements = storage;
+  return true;
+}
+
+// Keeps the first k entries by `before` in `heap`, a max-heap whose top is
+// the last of them
+template <typename E, typename Less>
+static void push_bounded(std::vector<E> &heap, const E &entry, size_t k,
+                         Less before) {
+  if (heap.size() < k) {
+    heap.push_back(entry);
+    std::push_heap(heap.begin(), heap.end(), before);
+  } else if (k > 0 && before(entry, heap.front())) {
+    std::pop_heap(heap.begin(), heap.end(), before);
+    heap.back() = entry;
+    std::push_heap(heap.begin(), heap.end(), before);
+  }
+}
+
+// The first k elements ordered by the keys from `key_of(i, key)`, which
+// returns false if the key of element i isn't of the Key kind. All of them
+// are sorted when k isn't below their number, otherwise every chunk keeps
+// its first k in a bounded heap and the heaps are merged.
+template <typename Key, typename KeyOf>
+static Value order(std::span<const AstNode> elements, KeyOf key_of,
+                   size_t k, bool descending, Evaluator &ev) {
+  using E = Entry<Key>;
+  Before<Key> before{descending};
+  size_t len = elements.size();
+
+  std::vector<E> entries;
+  if (k >= len) {
+    entries.resize(len);
+    for (size_t i = 0; i < len; i++) {
+      entries[i].index = i;
+      if (!key_of(i, entries[i].key)) {
+        ev.error(KEY_ERROR);
+        return Value::error();
+      }
+    }
+    parallel_sort(ev.parallel, entries, before);
+  } else {
+    struct Partial {
+      std::vector<E> heap;
+      bool invalid = false;
+    };
+    auto map = [&](size_t begin, size_t end) {
+      Partial partial;
+      partial.heap.reserve(std::min(k, end - begin));
+      for (size_t i = begin; i < end; i++) {
+        E entry{{}, i};
+        if (!key_of(i, entry.key)) {
+          partial.invalid = true;
+          break;
+        }
+        push_bounded(partial.heap, entry, k, before);
+      }
+      return partial;
+    };
+    auto combine = [&](Partial &acc, Partial &next) {
+      acc.invalid = acc.invalid || next.invalid;
+      for (const E &entry : next.heap) {
+        push_bounded(acc.heap, entry, k, before);
+      }
+    };
+    Partial result = parallel_reduce<Partial>(ev.parallel, len, map, combine);
+    if (result.invalid) {
+      ev.error(KEY_ERROR);
+      return Value::error();
+    }
+    entries = std::move(result.heap);
+    std::sort_heap(entries.begin(), entries.end(), before);
+  }
+
+  std::vector<AstNode> nodes;
+  nodes.reserve(entries.size());
+  for (const E &entry : entries) {
+    nodes.push_back(elements[entry.index]);
+  }
+  ev.allocate(nodes.size() * sizeof(AstNode));
+  return Value::list(std::move(nodes));
+}
+
+// Orders the elements by themselves, or by `keys` if they are given. The
+// kind of the first key decides whether they are numbers or strings.
+static Value order_by_kind(std::span<const AstNode> elements,
+                           const std::vector<Value> *keys, size_t k,
+                           bool descending, Evaluator &ev) {
+  // one step per element, charged up front
+  if (!ev.step(elements.size())) {
+    return Value::error();
+  }
+  ev.pending.visited += elements.size();
+  if (elements.empty()) {
+    return Value::list({});
+  }
+
+  if (keys != nullptr) {
+    if (keys->front().get_kind() == ValueKind::STRING) {
+      auto key_of = [&](size_t i, std::string_view &key) {
+        const Value &value = (*keys)[i];
+        if (value.get_kind() != ValueKind::STRING) {
+          return false;
+        }
+        key = value.get_data().string;
+        return true;
+      };
+      return order<std::string_view>(elements, key_of, k, descending, ev);
+    }
+    auto key_of = [&](size_t i, double &key) {
+      const Value &value = (*keys)[i];
+      if (value.get_kind() != ValueKind::NUMBER ||
+          std::isnan(value.get_data().number)) {
+        return false;
+      }
+      key = value.get_data().number;
+      return true;
+    };
+    return order<double>(elements, key_of, k, descending, ev);
+  }
+
+  if (elements.front().get_kind() == NodeKind::STRING) {
+    auto key_of = [&](size_t i, std::string_view &key) {
+      // a reference, short strings are viewed in the node
+      const AstNode &node = elements[i];
+      if (node.get_kind() != NodeKind::STRING) {
+        return false;
+      }
+      key = ev.arena.as_string_like(node).value();
+      return true;
+    };
+    return order<std::string_view>(elements, key_of, k, descending, ev);
+  }
+  auto key_of = [&](size_t i, double &key) {
+    const AstNode &node = elements[i];
+    if (node.get_kind() != NodeKind::NUMBER) {
+      return false;
+    }
+    key = node.get_value().number;
+    return true;
+  };
+  return order<double>(elements, key_of, k, descending, ev);
+}
+
+// Evaluates `key` with every element as the root, errors such as a missing
+// field leave an ERROR key behind
+static bool eval_keys(AstNode key, std::span<const AstNode> elements,
+                      Evaluator &ev, std::vector<Value> &keys) {
+  keys.resize(elements.size());
+  auto map = [&](size_t begin, size_t end) {
+    Evaluator chunk = ev.fork();
+    for (size_t i = begin; i < end && !chunk.over_budget; i++) {
+      Evaluator local(ev.query, ev.arena, elements[i]);
+      local.params = ev.params;
+      local.profile = ev.profile;
+      local.profile_node = chunk.profile_node;
+      local.budget = ev.budget;
+      keys[i] = eval(key, local);
+      local.flush_profile();
+      // a budget running out is the only error which isn't about the key
+      for (const EvalError &error : local.errors) {
+        if (error.kind != EvalError::Kind::Runtime) {
+          chunk.errors.push_back(error);
+        }
+      }
+      chunk.step(local.budget_steps);
+      chunk.allocate(local.budget_bytes);
+    }
+    chunk.flush_profile();
+    chunk.flush_budget();
+    return std::move(chunk.errors);
+  };
+  auto combine = [](std::vector<EvalError> &acc,
+                    std::vector<EvalError> &next) {
+    acc.insert(acc.end(), next.begin(), next.end());
+  };
+
+  std::vector<EvalError> errors = parallel_reduce<std::vector<EvalError>>(
+      ev.parallel, elements.size(), map, combine);
+  ev.errors.insert(ev.errors.end(), errors.begin(), errors.end());
+  return errors.empty();
+}
+
+Value builtin_sort(AstNode expression, Evaluator &ev) {
+  auto args = ev.query.as_array_like(expression).value();
+  bool by = expression.get_kind() == NodeKind::SortBy;
+  if (args.size() != (by ? 2 : 1)) {
+    ev.error(by ? "sort_by expects an array and a key"
+                : "sort expects one argument");
+    return Value::error();
+  }
+
+  Value value = eval(args[0], ev);
+  std::vector<AstNode> storage;
+  std::span<const AstNode> elements;
+  if (!elements_of(value, ev, storage, elements)) {
+    return Value::error();
+  }
+
+  if (!by) {
+    return order_by_kind(elements, nullptr, SIZE_MAX, false, ev);
+  }
+  std::vector<Value> keys;
+  if (!eval_keys(args[1], elements, ev, keys)) {
+    return Value::error();
+  }
+  return order_by_kind(elements, &keys, SIZE_MAX, false, ev);
+}
+
+Value builtin_topk(AstNode expression, Evaluator &ev) {
+  auto args = ev.query.as_array_like(expression).value();
+  if (args.size() != 2) {
+    ev.error("topk and bottomk expect an array and a count");
+    return Value::error();
+  }
+
+  Value count = eval(args[1], ev);
+  if (count.get_kind() != ValueKind::NUMBER ||
+      !(count.get_data().number >= 0)) {
+    ev.error("The count of topk and bottomk must be a number from 0");
+    return Value::error();
+  }
+  // counts past the number of elements sort all of them
+  double number = std::floor(count.get_data().number);
+  size_t k = number < (double)SIZE_MAX ? (size_t)number : SIZE_MAX;
+
+  Value value = eval(args[0], ev);
+  std::vector<AstNode> storage;
+  std::span<const AstNode> elements;
+  if (!elements_of(value, ev, storage, elements)) {
+    return Value::error();
+  }
+  bool descending = expression.get_kind() == NodeKind::TopK;
+  return order_by_kind(elements, nullptr, k, descending, ev);
+}
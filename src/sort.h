@@ -0,0 +1,21 @@
+#pragma once
+
+// sort, sort_by, topk and bottomk.
+//
+// Elements are ordered by a key which is either the element itself or the
+// result of a key expression evaluated with the element as the root, like the
+// predicate of a filter. Keys have to be all numbers or all strings, equal
+// keys keep the order of the elements. The results are lists of the nodes of
+// the document, nothing is copied out of the arena.
+//
+// Sorts of more elements than the sequential cutoff run on the thread pool.
+// topk and bottomk keep a heap of the k best elements per chunk instead of
+// sorting everything, which is O(n log k).
+
+#include "eval.h"
+
+// Sort and SortBy
+Value builtin_sort(AstNode expression, Evaluator &ev);
+
+// TopK and BottomK
+Value builtin_topk(AstNode expression, Evaluator &ev);
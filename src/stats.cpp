@@ -0,0 +1,191 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <vector>
+
+void Histogram::add(size_t value) { counts[std::bit_width(value)]++; }
+
+void Histogram::merge(const Histogram &other) {
+  for (size_t i = 0; i < BUCKETS; i++) {
+    counts[i] += other.counts[i];
+  }
+}
+
+size_t DocumentStats::values() const {
+  size_t total = 0;
+  for (size_t count : kinds) {
+    total += count;
+  }
+  return total;
+}
+
+void DocumentStats::merge(const DocumentStats &other) {
+  for (size_t i = 0; i < std::size(kinds); i++) {
+    kinds[i] += other.kinds[i];
+  }
+  max_depth = std::max(max_depth, other.max_depth);
+  depth_sum += other.depth_sum;
+  object_width.merge(other.object_width);
+  array_length.merge(other.array_length);
+  string_length.merge(other.string_length);
+  for (auto &[key, count] : other.keys) {
+    keys[key] += count;
+  }
+}
+
+static void walk(AstNode root, size_t root_depth, Arena &arena,
+                 const ParallelOptions &parallel, DocumentStats &stats);
+
+// The children of a container at `depth`, on the thread pool if there are
+// enough of them
+static void walk_children(AstNode node, size_t depth, Arena &arena,
+                          const ParallelOptions &parallel,
+                          DocumentStats &stats) {
+  std::span<AstNode> children = arena.as_array_like(node).value();
+  bool object = node.get_kind() == NodeKind::OBJECT;
+  // objects are walked by pairs, the keys are counted here
+  size_t step = object ? 2 : 1;
+  auto map = [&](size_t begin, size_t end) {
+    DocumentStats partial;
+    for (size_t i = begin; i < end; i++) {
+      if (object) {
+        partial.keys[arena.as_string_like(children[2 * i]).value()]++;
+      }
+      walk(children[step * i + step - 1], depth + 1, arena, parallel,
+           partial);
+    }
+    return partial;
+  };
+  auto combine = [](DocumentStats &acc, const DocumentStats &next) {
+    acc.merge(next);
+  };
+  stats.merge(parallel_reduce<DocumentStats>(
+      parallel, children.size() / step, map, combine));
+}
+
+static void walk(AstNode root, size_t root_depth, Arena &arena,
+                 const ParallelOptions &parallel, DocumentStats &stats) {
+  struct Pending {
+    AstNode node;
+    size_t depth;
+  };
+  std::vector<Pending> stack{{root, root_depth}};
+  size_t cutoff = std::max<size_t>(parallel.sequential_cutoff, 1);
+
+  while (!stack.empty()) {
+    auto [node, depth] = stack.back();
+    stack.pop_back();
+
+    NodeKind kind = node.get_kind();
+    stats.kinds[(size_t)kind]++;
+    stats.max_depth = std::max(stats.max_depth, depth);
+    stats.depth_sum += depth;
+
+    switch (kind) {
+    case NodeKind::STRING:
+      stats.string_length.add(node.get_data());
+      break;
+    case NodeKind::OBJECT:
+    case NodeKind::ARRAY: {
+      size_t len = node.get_data();
+      if (kind == NodeKind::OBJECT) {
+        len /= 2;
+        stats.object_width.add(len);
+      } else {
+        stats.array_length.add(len);
+      }
+      if (parallel.pool != nullptr && len > cutoff) {
+        walk_children(node, depth, arena, parallel, stats);
+        break;
+      }
+
+      std::span<AstNode> children = arena.as_array_like(node).value();
+      for (size_t i = 0; i < children.size(); i++) {
+        if (kind == NodeKind::OBJECT && i % 2 == 0) {
+          stats.keys[arena.as_string_like(children[i]).value()]++;
+          continue;
+        }
+        stack.push_back({children[i], depth + 1});
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+}
+
+DocumentStats document_stats(Arena &arena, AstNode root,
+                             const ParallelOptions &parallel) {
+  DocumentStats stats;
+  walk(root, 0, arena, parallel, stats);
+  return stats;
+}
+
+static void print_histogram(FILE *out, const char *name,
+                            const Histogram &histogram) {
+  fprintf(out, "%s:\n", name);
+  for (size_t i = 0; i < Histogram::BUCKETS; i++) {
+    size_t count = histogram.counts[i];
+    if (count == 0) {
+      continue;
+    }
+    if (i <= 1) {
+      fprintf(out, "  %-24zu %zu\n", i, count);
+    } else {
+      size_t low = (size_t)1 << (i - 1);
+      size_t high = i == 64 ? SIZE_MAX : ((size_t)1 << i) - 1;
+      char range[48];
+      snprintf(range, sizeof(range), "%zu-%zu", low, high);
+      fprintf(out, "  %-24s %zu\n", range, count);
+    }
+  }
+}
+
+void print_stats(FILE *out, const DocumentStats &stats,
+                 const ArenaUsage &usage, size_t top_keys) {
+  static const char *kind_names[] = {"error",  "string", "number", "boolean",
+                                     "object", "array",  "null"};
+  size_t values = stats.values();
+
+  fprintf(out, "values: %zu\n", values);
+  for (size_t i = 0; i < std::size(kind_names); i++) {
+    if (stats.kinds[i] > 0) {
+      fprintf(out, "  %-24s %zu\n", kind_names[i], stats.kinds[i]);
+    }
+  }
+  fprintf(out, "depth: max %zu, average %.2f\n", stats.max_depth,
+          values > 0 ? (double)stats.depth_sum / values : 0.0);
+  print_histogram(out, "object width", stats.object_width);
+  print_histogram(out, "array length", stats.array_length);
+  print_histogram(out, "string length", stats.string_length);
+
+  size_t occurrences = 0;
+  std::vector<std::pair<std::string_view, size_t>> keys;
+  keys.reserve(stats.keys.size());
+  for (auto &[key, count] : stats.keys) {
+    occurrences += count;
+    keys.push_back({key, count});
+  }
+  size_t shown = std::min(top_keys, keys.size());
+  // the most common first, ties by name so the output is stable
+  auto order = [](const auto &a, const auto &b) {
+    return a.second != b.second ? a.second > b.second : a.first < b.first;
+  };
+  std::partial_sort(keys.begin(), keys.begin() + shown, keys.end(), order);
+  fprintf(out, "keys: %zu distinct, %zu in total\n", keys.size(),
+          occurrences);
+  for (size_t i = 0; i < shown; i++) {
+    fprintf(out, "  %-24.*s %zu\n", (int)keys[i].first.size(),
+            keys[i].first.data(), keys[i].second);
+  }
+
+  fprintf(out, "arena bytes (used / reserved):\n");
+  fprintf(out, "  %-24s %zu / %zu\n", "nodes", usage.nodes,
+          usage.nodes_reserved);
+  fprintf(out, "  %-24s %zu / %zu\n", "strings", usage.strings,
+          usage.strings_reserved);
+  fprintf(out, "  %-24s %zu\n", "hashes", usage.hashes);
+  fprintf(out, "  %-24s %zu\n", "node stack", usage.node_stack_reserved);
+}
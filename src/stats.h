@@ -0,0 +1,49 @@
+#pragma once
+
+// The shape of a parsed document, to pick settings like the sequential cutoff
+// or arena sizes for the documents at hand.
+//
+// The tree is walked once without recursion. Containers longer than the
+// sequential cutoff have their children split over the thread pool, so wide
+// documents are walked in parallel, and the partial statistics are merged.
+// Subtrees shared by deduplication count once for every place they appear.
+
+#include "ast.h"
+#include "thread_pool.h"
+
+#include <cstdio>
+#include <string_view>
+#include <unordered_map>
+
+// Counts in power of two buckets, bucket i holds [2^(i-1), 2^i) and bucket 0
+// holds zeros
+struct Histogram {
+  static constexpr size_t BUCKETS = 65;
+  size_t counts[BUCKETS] = {};
+
+  void add(size_t value);
+  void merge(const Histogram &other);
+};
+
+struct DocumentStats {
+  // values of each json kind, keys of objects aren't included
+  size_t kinds[(size_t)NodeKind::_FUNCTIONS_START] = {};
+  size_t max_depth = 0;
+  // over all values, the root is at depth 0
+  size_t depth_sum = 0;
+  Histogram object_width;
+  Histogram array_length;
+  Histogram string_length;
+  // occurrences of each key
+  std::unordered_map<std::string_view, size_t> keys;
+
+  size_t values() const;
+  void merge(const DocumentStats &other);
+};
+
+DocumentStats document_stats(Arena &arena, AstNode root,
+                             const ParallelOptions &parallel);
+
+// `top_keys` is how many of the most common keys are listed
+void print_stats(FILE *out, const DocumentStats &stats,
+                 const ArenaUsage &usage, size_t top_keys = 10);
@@ -0,0 +1,435 @@
+#include "stream.h"
+
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct PathStep {
+  // an index if set, a field name otherwise
+  bool is_index;
+  std::string key;
+  size_t index;
+};
+
+struct PathNode {
+  // the whole value is needed
+  bool leaf = false;
+  std::map<std::string, size_t, std::less<>> fields;
+  std::map<size_t, size_t> indices;
+  // children which haven't been found yet
+  size_t pending = 0;
+
+  // found in the document, either the parsed value or a container on the
+  // way to other values
+  bool found = false;
+  AstNode value;
+  NodeKind kind = NodeKind::ERROR;
+};
+
+struct PathTrie {
+  // the root of the document is the first node
+  std::vector<PathNode> nodes{1};
+
+  void add(const std::vector<PathStep> &steps) {
+    size_t node = 0;
+    for (const PathStep &step : steps) {
+      if (nodes[node].leaf) {
+        // the whole value is parsed anyway
+        return;
+      }
+      size_t next = nodes.size();
+      auto inserted =
+          step.is_index
+              ? nodes[node].indices.insert({step.index, next}).second
+              : nodes[node].fields.insert({step.key, next}).second;
+      if (inserted) {
+        nodes[node].pending++;
+        nodes.emplace_back();
+      } else {
+        next = step.is_index ? nodes[node].indices[step.index]
+                             : nodes[node].fields.find(step.key)->second;
+      }
+      node = next;
+    }
+    // anything below is part of the value
+    nodes[node].leaf = true;
+    nodes[node].pending = 0;
+  }
+};
+
+} // namespace
+
+// A chain of fields and constant subscripts starting at the root, `a.b[2].c`
+static bool constant_path(AstNode node, Arena &query,
+                          std::vector<PathStep> &steps) {
+  switch (node.get_kind()) {
+  case NodeKind::Identifier:
+    steps.push_back({false, std::string(query.as_string_like(node).value()),
+                     0});
+    return true;
+  case NodeKind::Field: {
+    std::span<AstNode> args = query.as_array_like(node).value();
+    if (args.size() != 2 || (args[1].get_kind() != NodeKind::Identifier &&
+                             args[1].get_kind() != NodeKind::STRING) ||
+        !constant_path(args[0], query, steps)) {
+      return false;
+    }
+    steps.push_back({false, std::string(query.as_string_like(args[1]).value()),
+                     0});
+    return true;
+  }
+  case NodeKind::Subscript: {
+    std::span<AstNode> args = query.as_array_like(node).value();
+    if (args.size() != 2 || args[1].get_kind() != NodeKind::NUMBER) {
+      return false;
+    }
+    double index = args[1].get_value().number;
+    if (!(index >= 0 && index < 1e15) ||
+        !constant_path(args[0], query, steps)) {
+      return false;
+    }
+    // the evaluator truncates the index as well
+    steps.push_back({true, {}, (size_t)index});
+    return true;
+  }
+  default:
+    return false;
+  }
+}
+
+// Adds the paths the expression reads to the trie, returns false if it reads
+// the document in some other way
+static bool collect_paths(AstNode expression, Arena &query, PathTrie &trie) {
+  std::vector<PathStep> steps;
+  if (constant_path(expression, query, steps)) {
+    trie.add(steps);
+    return true;
+  }
+
+  NodeKind kind = expression.get_kind();
+  if (kind == NodeKind::Slice || kind == NodeKind::Filter) {
+    return false;
+  }
+  if (!kind_is_function(kind)) {
+    return kind != NodeKind::Identifier;
+  }
+
+  std::span<AstNode> args = query.as_array_like(expression).value();
+  for (size_t i = 0; i < args.size(); i++) {
+    // the name of a field of a computed value
+    if (kind == NodeKind::Field && i == 1 &&
+        args[i].get_kind() == NodeKind::Identifier) {
+      continue;
+    }
+    if (!collect_paths(args[i], query, trie)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool streamable(AstNode expression, Arena &query) {
+  PathTrie trie;
+  return collect_paths(expression, query, trie);
+}
+
+// Skips the rest of `depth` open containers, or a whole value if it's 0
+static void skip(Parser &p, size_t depth) {
+  p.consume_whitespace();
+  while (true) {
+    int c = p.peek();
+    switch (c) {
+    case EOF:
+      if (depth > 0) {
+        p.error("Expected closing ]");
+      }
+      return;
+    case '"':
+      p.next();
+      while (true) {
+        int s = p.next();
+        if (s == '\\') {
+          p.next();
+        } else if (s == '"') {
+          break;
+        } else if (s == EOF) {
+          p.error("Expected end of string");
+          return;
+        }
+      }
+      if (depth == 0) {
+        return;
+      }
+      continue;
+    case '[':
+    case '{':
+      depth++;
+      break;
+    case ']':
+    case '}':
+      if (depth == 0) {
+        return;
+      }
+      depth--;
+      p.next();
+      if (depth == 0) {
+        return;
+      }
+      continue;
+    case ',':
+    case ' ':
+    case '\n':
+    case '\r':
+    case '\t':
+      if (depth == 0) {
+        return;
+      }
+      break;
+    default:
+      break;
+    }
+    p.next();
+  }
+}
+
+namespace {
+
+struct Scanner {
+  Parser &p;
+  PathTrie &trie;
+  Arena &arena;
+  // keys are read here and dropped right away
+  Arena keys;
+  ParseOptions options;
+
+  struct Frame {
+    size_t node;
+    NodeKind kind;
+    // elements seen so far
+    size_t count;
+  };
+  std::vector<Frame> frames;
+
+  // The value at the cursor belongs to `node`
+  void visit(size_t node) {
+    p.consume_whitespace();
+    int c = p.peek();
+    PathNode &path = trie.nodes[node];
+    path.found = true;
+    if (path.leaf || (c != '[' && c != '{')) {
+      path.value = parse_json(p, arena, options);
+      path.kind = path.value.get_kind();
+      if (!frames.empty()) {
+        trie.nodes[frames.back().node].pending--;
+      }
+      return;
+    }
+    p.next();
+    path.kind = c == '{' ? NodeKind::OBJECT : NodeKind::ARRAY;
+    frames.push_back({node, path.kind, 0});
+  }
+
+  void close() {
+    frames.pop_back();
+    if (!frames.empty()) {
+      trie.nodes[frames.back().node].pending--;
+    }
+  }
+
+  // The child of the current container the value at the cursor belongs to, or
+  // nothing if it isn't needed
+  std::optional<size_t> next_child() {
+    Frame &frame = frames.back();
+    PathNode &path = trie.nodes[frame.node];
+    std::optional<size_t> child;
+    if (frame.kind == NodeKind::OBJECT) {
+      StringIndex start = keys.string_position();
+      AstNode key = string(p, keys);
+      if (key.get_kind() == NodeKind::STRING) {
+        auto it = path.fields.find(keys.as_string_like(key).value());
+        if (it != path.fields.end()) {
+          child = it->second;
+        }
+      }
+      keys.string_truncate(start);
+      if (!p.eat(':')) {
+        p.error("Expected :");
+      }
+    } else {
+      auto it = path.indices.find(frame.count);
+      if (it != path.indices.end()) {
+        child = it->second;
+      }
+    }
+    frame.count++;
+    // only the first of duplicate keys counts, like in find_field()
+    if (child.has_value() && trie.nodes[*child].found) {
+      child.reset();
+    }
+    return child;
+  }
+
+  void run() {
+    visit(0);
+    while (!frames.empty()) {
+      Frame &frame = frames.back();
+      if (trie.nodes[frame.node].pending == 0) {
+        // everything below is found, the rest doesn't matter
+        if (frames.size() == 1) {
+          return;
+        }
+        skip(p, 1);
+        close();
+        continue;
+      }
+
+      char end = frame.kind == NodeKind::OBJECT ? '}' : ']';
+      p.consume_whitespace();
+      if (frame.count > 0 && !p.eat(',')) {
+        if (!p.eat(end)) {
+          p.error("Expected closing ]");
+        }
+        close();
+        continue;
+      }
+      p.consume_whitespace();
+      if (p.at(end) || (frame.kind == NodeKind::OBJECT && !p.at('"'))) {
+        if (!p.eat(end)) {
+          p.error("Expected closing ]");
+        }
+        close();
+        continue;
+      }
+
+      std::optional<size_t> child = next_child();
+      if (child.has_value()) {
+        visit(*child);
+      } else {
+        skip(p, 0);
+      }
+    }
+  }
+
+  // The sparse document below `node`, which was found
+  AstNode build(size_t node) {
+    PathNode &path = trie.nodes[node];
+    if (path.leaf || (path.kind != NodeKind::OBJECT &&
+                      path.kind != NodeKind::ARRAY)) {
+      return path.value;
+    }
+
+    NodeStackIndex start = arena.node_stack_position();
+    if (path.kind == NodeKind::OBJECT) {
+      for (auto &[key, child] : path.fields) {
+        if (!trie.nodes[child].found) {
+          continue;
+        }
+        StringIndex key_start = arena.string_position();
+        for (char c : key) {
+          arena.string_push(c);
+        }
+        arena.node_stack_push(arena.finish_string(key_start));
+        arena.node_stack_push(build(child));
+      }
+    } else {
+      // only the elements found, remap_paths() points the subscripts at them
+      for (auto &[index, child] : path.indices) {
+        if (trie.nodes[child].found) {
+          arena.node_stack_push(build(child));
+        }
+      }
+    }
+    return arena.finish_container(path.kind, start);
+  }
+};
+
+} // namespace
+
+// The position of element `index` among the elements of the array `path`
+// which were found, or past all of them if it wasn't found
+static size_t found_position(PathTrie &trie, const PathNode &path,
+                             size_t index) {
+  size_t position = 0;
+  for (auto &[other, child] : path.indices) {
+    if (other == index && trie.nodes[child].found) {
+      return position;
+    }
+    position += trie.nodes[child].found;
+  }
+  return position;
+}
+
+// Follows a constant path through the trie, pointing each subscript into a
+// sparse array at the position of its element. Returns the trie node of the
+// path, nothing below a leaf, where the values are whole.
+static std::optional<size_t> remap_path(AstNode node, Arena &query,
+                                        PathTrie &trie) {
+  std::optional<size_t> parent;
+  std::span<AstNode> args;
+  if (node.get_kind() == NodeKind::Identifier) {
+    parent = 0;
+  } else {
+    args = query.as_array_like(node).value();
+    parent = remap_path(args[0], query, trie);
+  }
+  if (!parent.has_value() || trie.nodes[*parent].leaf) {
+    return {};
+  }
+  PathNode &path = trie.nodes[*parent];
+
+  if (node.get_kind() == NodeKind::Subscript) {
+    size_t index = (size_t)args[1].get_value().number;
+    auto it = path.indices.find(index);
+    if (path.found && path.kind == NodeKind::ARRAY) {
+      args[1] = AstNode::number((double)found_position(trie, path, index));
+    }
+    return it != path.indices.end() ? std::optional(it->second)
+                                    : std::nullopt;
+  }
+  AstNode name = node.get_kind() == NodeKind::Identifier ? node : args[1];
+  auto it = path.fields.find(query.as_string_like(name).value());
+  return it != path.fields.end() ? std::optional(it->second) : std::nullopt;
+}
+
+// Rewrites the subscripts of every path collect_paths() added
+static void remap_paths(AstNode expression, Arena &query, PathTrie &trie) {
+  std::vector<PathStep> steps;
+  if (constant_path(expression, query, steps)) {
+    remap_path(expression, query, trie);
+    return;
+  }
+  NodeKind kind = expression.get_kind();
+  if (!kind_is_function(kind)) {
+    return;
+  }
+  std::span<AstNode> args = query.as_array_like(expression).value();
+  for (size_t i = 0; i < args.size(); i++) {
+    if (kind == NodeKind::Field && i == 1 &&
+        args[i].get_kind() == NodeKind::Identifier) {
+      continue;
+    }
+    remap_paths(args[i], query, trie);
+  }
+}
+
+AstNode stream_paths(Parser &p, AstNode expression, Arena &query,
+                     Arena &arena, ParseOptions options) {
+  PathTrie trie;
+  bool ok = collect_paths(expression, query, trie);
+  assert(ok && "Expression isn't streamable");
+  (void)ok;
+  if (trie.nodes[0].pending == 0) {
+    // the document isn't read at all
+    return AstNode::nil();
+  }
+
+  Scanner scanner{p, trie, arena, {}, options, {}};
+  scanner.run();
+  remap_paths(expression, query, trie);
+  return scanner.build(0);
+}
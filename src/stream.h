@@ -0,0 +1,36 @@
+#pragma once
+
+// Streaming evaluation of queries which only read fixed paths.
+//
+// An expression like `a.b[2].c + max(x.y)` only looks at a few fixed places
+// of the document. Instead of parsing all of it, the document is scanned once
+// while a trie of those paths is matched against the keys and indices on the
+// way down. The values at the ends of the paths are parsed into the arena and
+// everything else is skipped without being stored, so memory depends on the
+// nesting depth and the size of the matches rather than on the document.
+// Scanning stops as soon as every path is either found or known to be
+// missing, the rest of the input isn't read.
+//
+// The matches are put together into a sparse document which only has the
+// containers on the paths, and of the arrays only the elements found. The
+// constant subscripts of the query are rewritten to the positions of their
+// elements in those arrays, or past their end for elements which don't
+// exist, so memory is bounded by the matches rather than by the largest
+// subscript. The query only reads along its paths, so the rewritten query
+// gives the same results and errors on the sparse document as the original
+// one on the whole document. Skipped values are only checked for matching
+// brackets and closed strings.
+
+#include "parser_driver.h"
+
+// Whether the expression reads the document only through fixed paths, made
+// of fields and constant subscripts. Wildcards, slices and filters need the
+// whole document.
+bool streamable(AstNode expression, Arena &query);
+
+// Scans the json in `p` for the paths of the expression, which must be
+// streamable, and returns the root of the sparse document in `arena`. The
+// subscripts of the expression are rewritten in `query`, which has to be a
+// copy only used with this document.
+AstNode stream_paths(Parser &p, AstNode expression, Arena &query,
+                     Arena &arena, ParseOptions options = {});
@@ -0,0 +1,136 @@
+#include "thread_pool.h"
+
+// index of the queue owned by the current thread, or SIZE_MAX for threads
+// outside of any pool
+static thread_local ThreadPool *current_pool = nullptr;
+static thread_local size_t current_queue = SIZE_MAX;
+
+ThreadPool::ThreadPool(size_t threads) : queued(0), stopping(false) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  for (size_t i = 0; i < threads + 1; i++) {
+    queues.push_back(std::make_unique<Queue>());
+  }
+  for (size_t i = 0; i < threads; i++) {
+    workers.emplace_back([this, i]() { worker_main(i); });
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard lock(sleep_mutex);
+    stopping = true;
+  }
+  sleep_cv.notify_all();
+  for (std::thread &worker : workers) {
+    worker.join();
+  }
+}
+
+void ThreadPool::submit(Task task) {
+  size_t index = queues.size() - 1;
+  if (current_pool == this) {
+    index = current_queue;
+  }
+
+  // count the task before it becomes visible, so that whoever takes it can't
+  // decrement the counter below zero
+  {
+    std::lock_guard lock(sleep_mutex);
+    queued++;
+  }
+  {
+    std::lock_guard lock(queues[index]->mutex);
+    queues[index]->tasks.push_back(std::move(task));
+  }
+  sleep_cv.notify_one();
+}
+
+std::optional<ThreadPool::Task> ThreadPool::pop(size_t queue) {
+  Queue &q = *queues[queue];
+  std::lock_guard lock(q.mutex);
+  if (q.tasks.empty()) {
+    return {};
+  }
+  Task task = std::move(q.tasks.back());
+  q.tasks.pop_back();
+  return task;
+}
+
+std::optional<ThreadPool::Task> ThreadPool::steal(size_t thief) {
+  size_t count = queues.size();
+  for (size_t offset = 1; offset <= count; offset++) {
+    Queue &q = *queues[(thief + offset) % count];
+    std::lock_guard lock(q.mutex);
+    if (!q.tasks.empty()) {
+      Task task = std::move(q.tasks.front());
+      q.tasks.pop_front();
+      return task;
+    }
+  }
+  return {};
+}
+
+bool ThreadPool::run_one() {
+  std::optional<Task> task;
+  if (current_pool == this) {
+    task = pop(current_queue);
+  }
+  if (!task.has_value()) {
+    size_t thief = current_pool == this ? current_queue : queues.size() - 1;
+    task = steal(thief);
+  }
+  if (!task.has_value()) {
+    return false;
+  }
+
+  queued--;
+  (*task)();
+  return true;
+}
+
+void ThreadPool::worker_main(size_t index) {
+  current_pool = this;
+  current_queue = index;
+
+  while (true) {
+    if (run_one()) {
+      continue;
+    }
+
+    std::unique_lock lock(sleep_mutex);
+    sleep_cv.wait(lock, [this]() { return stopping || queued > 0; });
+    if (stopping && queued == 0) {
+      return;
+    }
+  }
+}
+
+void TaskGroup::run(ThreadPool::Task task) {
+  pending++;
+  pool.submit([this, task = std::move(task)]() {
+    task();
+    // under the lock, wait() can't return and destroy the group before the
+    // notification is done
+    std::lock_guard lock(mutex);
+    if (--pending == 0) {
+      done.notify_all();
+    }
+  });
+}
+
+// Tasks are only added by the thread which waits, so once none of them is
+// left in the queues the rest are running on other threads
+void TaskGroup::wait() {
+  while (pending > 0) {
+    if (pool.run_one()) {
+      continue;
+    }
+    std::unique_lock lock(mutex);
+    done.wait(lock, [this]() { return pending == 0; });
+  }
+  // the last task may still hold the lock after setting pending to zero
+  std::lock_guard lock(mutex);
+}
@@ -0,0 +1,187 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+// A small work-stealing thread pool.
+//
+// Every worker owns a deque, it pushes and pops its own tasks at the back and
+// steals from the front of the other deques when it runs dry. Threads which
+// don't belong to the pool submit into a separate injection queue.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  // 0 threads means std::thread::hardware_concurrency()
+  explicit ThreadPool(size_t threads = 0);
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool &) = delete;
+  ThreadPool &operator=(const ThreadPool &) = delete;
+
+  size_t size() const { return workers.size(); }
+
+  void submit(Task task);
+
+  // Runs one queued task on the calling thread, returns false if there was
+  // nothing to run. Used by threads waiting on a TaskGroup to help out
+  // instead of blocking.
+  bool run_one();
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::optional<Task> pop(size_t queue);
+  std::optional<Task> steal(size_t thief);
+  void worker_main(size_t index);
+
+  // queues[0..size()) belong to workers, the last one is the injection queue
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+
+  std::mutex sleep_mutex;
+  std::condition_variable sleep_cv;
+  std::atomic<size_t> queued;
+  bool stopping;
+};
+
+// Tracks a batch of tasks submitted to a pool, wait() participates in running
+// them so it is safe to call from inside a worker. Once there is nothing left
+// to run, it sleeps until the tasks running on other threads are done.
+class TaskGroup {
+  ThreadPool &pool;
+  std::atomic<size_t> pending;
+  // signalled when pending drops to zero
+  std::mutex mutex;
+  std::condition_variable done;
+
+public:
+  TaskGroup(ThreadPool &pool) : pool(pool), pending(0) {}
+  ~TaskGroup() { wait(); }
+
+  void run(ThreadPool::Task task);
+  void wait();
+};
+
+struct ParallelOptions {
+  ThreadPool *pool = nullptr;
+  // ranges at most this long are processed sequentially on the calling thread
+  size_t sequential_cutoff = 1 << 14;
+};
+
+// Splits [0, len) into chunks, maps every chunk with `map(begin, end)` and
+// folds the chunk results in order with `combine(accumulator, next)`.
+//
+// The result is the same as `map(0, len)` as long as `combine` is
+// associative.
+template <typename T, typename Map, typename Combine>
+T parallel_reduce(const ParallelOptions &options, size_t len, Map map,
+                  Combine combine) {
+  ThreadPool *pool = options.pool;
+  size_t cutoff = std::max<size_t>(options.sequential_cutoff, 1);
+  if (pool == nullptr || pool->size() < 2 || len <= cutoff) {
+    return map(0, len);
+  }
+
+  // a few chunks per thread so that stealing can even out uneven elements
+  size_t grain = std::max(cutoff, len / (pool->size() * 4));
+  size_t chunks = (len + grain - 1) / grain;
+
+  std::vector<std::optional<T>> results(chunks);
+  {
+    TaskGroup group(*pool);
+    for (size_t i = 0; i < chunks; i++) {
+      group.run([&, i]() {
+        size_t begin = i * grain;
+        size_t end = std::min(len, begin + grain);
+        results[i].emplace(map(begin, end));
+      });
+    }
+    group.wait();
+  }
+
+  T accumulator = std::move(*results[0]);
+  for (size_t i = 1; i < chunks; i++) {
+    combine(accumulator, *results[i]);
+  }
+  return accumulator;
+}
+
+// Sorts `items` with `less`. Large ranges are split into one chunk per
+// thread, the chunks are sorted on the thread pool and then merged in pairs,
+// each level of merges running in parallel.
+//
+// Like std::sort, elements which are equivalent under `less` can end up in
+// any order.
+template <typename T, typename Less>
+void parallel_sort(const ParallelOptions &options, std::vector<T> &items,
+                   Less less) {
+  ThreadPool *pool = options.pool;
+  size_t len = items.size();
+  size_t cutoff = std::max<size_t>(options.sequential_cutoff, 1);
+  if (pool == nullptr || pool->size() < 2 || len <= cutoff) {
+    std::sort(items.begin(), items.end(), less);
+    return;
+  }
+
+  size_t grain = std::max(cutoff, (len + pool->size() - 1) / pool->size());
+  // the start of every chunk, followed by the end of the last one
+  std::vector<size_t> bounds;
+  for (size_t begin = 0; begin < len; begin += grain) {
+    bounds.push_back(begin);
+  }
+  bounds.push_back(len);
+  {
+    TaskGroup group(*pool);
+    for (size_t i = 0; i + 1 < bounds.size(); i++) {
+      group.run([&, i]() {
+        std::sort(items.begin() + bounds[i], items.begin() + bounds[i + 1],
+                  less);
+      });
+    }
+    group.wait();
+  }
+
+  // merges go back and forth between the items and the buffer
+  std::vector<T> buffer(len);
+  std::vector<T> *from = &items;
+  std::vector<T> *to = &buffer;
+  while (bounds.size() > 2) {
+    size_t chunks = bounds.size() - 1;
+    std::vector<size_t> merged;
+    {
+      TaskGroup group(*pool);
+      for (size_t i = 0; i < chunks; i += 2) {
+        // an odd chunk out is merged with nothing, which copies it
+        size_t begin = bounds[i];
+        size_t middle = bounds[i + 1];
+        size_t end = bounds[std::min(i + 2, chunks)];
+        merged.push_back(begin);
+        group.run([=]() {
+          std::merge(from->begin() + begin, from->begin() + middle,
+                     from->begin() + middle, from->begin() + end,
+                     to->begin() + begin, less);
+        });
+      }
+      group.wait();
+    }
+    merged.push_back(len);
+    bounds = std::move(merged);
+    std::swap(from, to);
+  }
+  if (from != &items) {
+    items.swap(buffer);
+  }
+}
@@ -0,0 +1,61 @@
+// Evaluates JE_QUERY paths and the same expressions parsed at runtime on a
+// document, and reports the paths where they disagree.
+
+#include "json_eval.h"
+
+#include <cstdio>
+
+static int checked = 0;
+static int failed = 0;
+
+static void check(const char *path, Value compiled, Arena &arena,
+                  AstNode root) {
+  Arena query;
+  StringSource input(path);
+  Parser parser(input);
+  AstNode expression = parse_expression(parser, query);
+  Evaluator ev(query, arena, root);
+  Value interpreted = eval(expression, ev);
+
+  bool same = compiled.get_kind() == ValueKind::ERROR
+                  ? interpreted.get_kind() == ValueKind::ERROR
+                  : Value::equal(compiled, interpreted, arena);
+  checked++;
+  if (!same) {
+    failed++;
+    printf("%s: JE_QUERY and the interpreter disagree\n", path);
+  }
+}
+
+#define CHECK(path) check(path, JE_QUERY(path).eval(arena, root), arena, root)
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: query_check <JSON FILE>\n");
+    return 2;
+  }
+  const char *error = nullptr;
+  auto document = Document::from_file(argv[1], {}, error);
+  if (document == nullptr) {
+    fprintf(stderr, "%s: %s\n", argv[1], error);
+    return 2;
+  }
+  Arena &arena = document->get_arena();
+  AstNode root = document->get_root();
+
+  CHECK("a.b[1]");
+  CHECK("a.b[2].c");
+  CHECK("a.b[3]");
+  CHECK("a.b[3][1]");
+  CHECK("items[2].price");
+  CHECK("tags[0].unit");
+  CHECK("tags[5][1].unit");
+  // missing fields, subscripts out of range and steps into scalars
+  CHECK("a.unit_name");
+  CHECK("a.b[9]");
+  CHECK("a.b[2].c.d");
+  CHECK("items[0][0]");
+
+  printf("%d of %d paths agree\n", checked - failed, checked);
+  return failed == 0 ? 0 : 1;
+}
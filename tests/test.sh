@@ -25,3 +25,212 @@ test "size(a.b)"            4
 test "size(a.b[a.b[1]].c)"  4
 # Number literals:
 test "max(a.b[0], 10, a.b[1], 15)"     15
+test "a.b[0] + 0.5"                    1.5
+# Aggregations over array elements:
+test "sum(a.b[3])"                     23
+test "max(a.b[3], 5)"                  12
+# Wildcards and slices produce sequences:
+test "max(items[*].price)"             150
+test "sum(items[1:].price)"            270
+test "size(a.b[*].c)"                  1
+test "size(items[::2])"                2
+test "size(items[0:1e300:1e300])"     1
+test "items[*].price + 1"              "Arithmetic can't be applied to a sequence"
+# Comparisons and filters:
+test "a.b[1] >= 2 && a.b[0] != 2"      true
+test "sum(items[? price > 100].id)"    5
+test "size(items[? price < 100 || id == 3])" 2
+# Deep equality, key order doesn't matter:
+test "tags[0] == tags[1]"              true
+test "size(distinct(tags))"            4
+
+# Compressed input from stdin:
+echo ">>> gzip -c tests/test.json | json_eval - a.b[1]"
+echo -n "<<< "
+gzip -c tests/test.json | ./build/src/json_eval - "a.b[1]" | tail -n 1
+echo -e "### 2\n"
+
+# Positional parameters:
+echo ">>> --param=100 items[? price > \$1].id"
+echo -n "<<< "
+./build/src/json_eval --param=100 tests/test.json 'sum(items[? price > $1].id)' | tail -n 1
+echo -e "### 5\n"
+
+# Natively compiled query, the result is the same as the interpreter's:
+echo ">>> --compile-query a.b[1] * 3 + sum(a.b[3])"
+echo -n "<<< "
+./build/src/json_eval --compile-query tests/test.json 'a.b[1] * 3 + sum(a.b[3])' 2>/dev/null | tail -n 1
+echo -e "### 29\n"
+
+# JSON Patch applied before evaluating:
+echo ">>> --patch=tests/patch.json a.b[1] + sum(items[*].id)"
+echo -n "<<< "
+./build/src/json_eval --patch=tests/patch.json tests/test.json 'a.b[1] + sum(items[*].id)' | tail -n 1
+echo -e "### 14\n"
+
+# Containers hashed while parsing give the same results:
+echo ">>> --hashes size(distinct(tags))"
+echo -n "<<< "
+./build/src/json_eval --hashes tests/test.json 'size(distinct(tags))' | tail -n 1
+echo -e "### 4\n"
+
+# Identical subtrees stored once:
+echo ">>> --dedup tags[0] == tags[1] && tags[5] == tags[6]"
+echo -n "<<< "
+./build/src/json_eval --dedup tests/test.json 'tags[0] == tags[1] && tags[5] == tags[6]' | tail -n 1
+echo -e "### true\n"
+
+# Nesting deeper than --max-depth is a parse error:
+echo ">>> --max-depth=2 size(items)"
+echo -n "<<< "
+./build/src/json_eval --max-depth=2 tests/test.json 'size(items)' | grep -c "Maximum nesting depth exceeded"
+echo -e "### 1\n"
+
+# The push parser, fed a few bytes at a time, builds the same document:
+echo ">>> --push-chunk=3 a.b[1] + sum(items[*].id)"
+echo -n "<<< "
+./build/src/json_eval --push-chunk=3 tests/test.json 'a.b[1] + sum(items[*].id)' | tail -n 1
+echo -e "### 8\n"
+
+# Fixed paths are streamed without building the whole document:
+echo ">>> --stream a.b[3][1] + items[2].price"
+echo -n "<<< "
+./build/src/json_eval --stream tests/test.json 'a.b[3][1] + items[2].price' | tail -n 1
+echo -e "### 132\n"
+
+# only the elements found are kept, the subscripts are pointed at them:
+echo '>>> --stream {"a":[0,1,2,3,4,5,6,7,8,9]} a[8] - a[3], the array and the result'
+echo -n "<<< "
+echo '{"a":[0,1,2,3,4,5,6,7,8,9]}' | ./build/src/json_eval --stream - 'a[8] - a[3]' | sed -n '5,7p;$p' | paste -sd ' '
+echo -e "###   [Array]     3     8 5\n"
+
+# CBOR and MessagePack input, detected or given with --format:
+echo ">>> tests/test.cbor a.b[1] + sum(items[*].id)"
+echo -n "<<< "
+./build/src/json_eval tests/test.cbor 'a.b[1] + sum(items[*].id)' | tail -n 1
+echo -e "### 8\n"
+
+# CBOR documents whose root is an array are told apart from MessagePack:
+echo ">>> printf '\x83\x01\x02\x03' (CBOR [1, 2, 3]) | json_eval - x"
+echo -n "<<< "
+printf '\x83\x01\x02\x03' | ./build/src/json_eval - 'x' | sed -n 3,6p | paste -sd ' '
+echo -e "### [Array]   1   2   3\n"
+
+echo ">>> --format=msgpack tests/test.msgpack size(distinct(tags))"
+echo -n "<<< "
+./build/src/json_eval --format=msgpack tests/test.msgpack 'size(distinct(tags))' | tail -n 1
+echo -e "### 4\n"
+
+# Results encoded as CBOR and MessagePack:
+echo ">>> --output=cbor a.b[3]"
+echo -n "<<< "
+./build/src/json_eval --output=cbor tests/test.json 'a.b[3]' | od -An -tx1 | sed 's/^ //'
+echo -e "### 82 0b 0c\n"
+
+echo ">>> --output=msgpack a.b[2]"
+echo -n "<<< "
+./build/src/json_eval --output=msgpack tests/test.json 'a.b[2]' | od -An -tx1 | sed 's/^ //'
+echo -e "### 81 a1 63 a4 74 65 73 74\n"
+
+# The portable kernels give the same results as the detected ones:
+echo ">>> --cpu=generic max(a.b[3]) + sum(items[*].price)"
+echo -n "<<< "
+./build/src/json_eval --cpu=generic tests/test.json 'max(a.b[3]) + sum(items[*].price)' | tail -n 1
+echo -e "### 332\n"
+
+# Every kernel variant the cpu runs skips a NaN in max the same way
+# (MessagePack {"x": [1, 2, NaN, 4, ..., 10, 100, 12, ..., 16]}):
+echo ">>> --cpu=generic|sse42|avx2|avx512 max(x) with a NaN in x"
+echo -n "<<< "
+nan='\x81\xa1x\xdc\x00\x10\x01\x02\xcb\x7f\xf8\x00\x00\x00\x00\x00\x00\x04\x05\x06\x07\x08\x09\x0a\x64\x0c\x0d\x0e\x0f\x10'
+for cpu in generic sse42 avx2 avx512; do
+    # variants the cpu can't run are left out
+    out=$(printf "$nan" | ./build/src/json_eval --cpu=$cpu - 'max(x)') && echo "$out" | tail -n 1
+done | sort -u | paste -sd ' '
+echo -e "### 100\n"
+
+# \u escapes are decoded to UTF-8, surrogate pairs included:
+echo '>>> {"s": "caf\u00e9 \ud83d\ude00 \"q\""} s'
+echo -n "<<< "
+echo '{"s": "caf\u00e9 \ud83d\ude00 \"q\""}' | ./build/src/json_eval - 's' | tail -n 1
+echo -e '### café 😀 "q"\n'
+
+# Strings have to be valid UTF-8:
+echo '>>> {"s": "\xff"} s'
+echo -n "<<< "
+printf '{"s": "\xff"}' | ./build/src/json_eval - 's' | grep -c "Invalid UTF-8"
+echo -e "### 1\n"
+
+# --analyze counts the calls of every node, the filter runs once per item:
+echo ">>> --analyze sum(items[? id + 1 > 2].price)"
+echo -n "<<< "
+./build/src/json_eval --analyze tests/test.json 'sum(items[? id + 1 > 2].price)' | grep -o "(Add)  calls=[0-9]*"
+echo -e "### (Add)  calls=3\n"
+
+# batched comparisons are counted as well:
+echo ">>> --analyze sum(items[? price > 100].id)"
+echo -n "<<< "
+./build/src/json_eval --analyze tests/test.json 'sum(items[? price > 100].id)' | grep -o "(Gt)  calls=[0-9]*"
+echo -e "### (Gt)  calls=3\n"
+
+# --stats describes the document instead of evaluating:
+echo ">>> --stats"
+echo -n "<<< "
+./build/src/json_eval --stats tests/test.json | grep "depth:"
+echo -e "### depth: max 4, average 2.62\n"
+
+# Evaluations stop once their budget runs out:
+echo ">>> --max-steps=3 a.b[3][0] + a.b[3][1]"
+echo -n "<<< "
+./build/src/json_eval --max-steps=3 tests/test.json 'a.b[3][0] + a.b[3][1]' | tail -n 1
+echo -e "### Step budget exceeded\n"
+
+echo '>>> --max-steps=2 {"a":[{"p":1},{"p":5},{"p":2}]} size(a[? p < 3])'
+echo -n "<<< "
+echo '{"a":[{"p":1},{"p":5},{"p":2}]}' | ./build/src/json_eval --max-steps=2 - 'size(a[? p < 3])' | tail -n 1
+echo -e "### Step budget exceeded\n"
+
+# Several files are evaluated on the thread pool, the results come in order:
+echo ">>> tests/test.json 'tests/*.msgpack' a.b[3][1]"
+echo -n "<<< "
+./build/src/json_eval tests/test.json 'tests/*.msgpack' 'a.b[3][1]' | paste -sd ' '
+echo -e "###  <<tests/test.json>> 12  <<tests/test.msgpack>> 12\n"
+
+# Strings up to 8 bytes are kept in their node, only the longer value takes
+# string arena bytes:
+echo '>>> {"id": "abcdefgh", "name": "abcdefghi"} --stats'
+echo -n "<<< "
+echo '{"id": "abcdefgh", "name": "abcdefghi"}' | ./build/src/json_eval --stats - | awk '/^  strings/ {print $2}'
+echo -e "### 9\n"
+
+# sort_by orders by a key of each element, topk picks the largest first:
+echo ">>> sort_by(items, 0 - price)[0].id + topk(items[*].id, 2)[1]"
+echo -n "<<< "
+./build/src/json_eval tests/test.json 'sort_by(items, 0 - price)[0].id + topk(items[*].id, 2)[1]' | tail -n 1
+echo -e "### 4\n"
+
+# With dedup, an object and an array with the same children keep their own
+# hashes:
+echo '>>> {"p":{"k":1,"z":2},"arr":["k",1,"z",2],"q":{"z":2,"k":1}} --dedup --hashes p == q'
+echo -n "<<< "
+echo '{"p":{"k":1,"z":2},"arr":["k",1,"z",2],"q":{"z":2,"k":1}}' | ./build/src/json_eval --dedup --hashes - 'p == q' | tail -n 1
+echo -e "### true\n"
+
+# Documents nested as deep as the parser allows can be printed and compared:
+echo '>>> {"a": [[[...99000 levels...]]], "b": [[[...]]]} a == b'
+echo -n "<<< "
+deep=$(printf '[%.0s' $(seq 99000))1$(printf ']%.0s' $(seq 99000))
+echo "{\"a\": $deep, \"b\": $deep}" | ./build/src/json_eval - 'a == b' | tail -n 1
+echo -e "### true\n"
+
+# JE_QUERY paths give the same results as the interpreter:
+echo ">>> query_check tests/test.json"
+echo -n "<<< "
+./build/tests/query_check tests/test.json | tail -n 1
+echo -e "### 11 of 11 paths agree\n"
+
+# Readers query snapshots of a VersionedDocument while it is being patched:
+echo ">>> versioned_check"
+echo -n "<<< "
+./build/tests/versioned_check | tail -n 1
+echo -e "### every snapshot was consistent\n"
@@ -0,0 +1,99 @@
+// Patches a VersionedDocument while reader threads keep querying snapshots of
+// it. Every patch sets `n` and `check` to the same number and appends to
+// `items`, so a reader which sees them differ saw a half applied patch. Some
+// patches add a string too large for the room left in the arena, which makes
+// the writer copy the live tree to a new arena while readers are still on the
+// old one. Run in the Debug (ASan) build this also catches versions freed
+// too early.
+
+#include "json_eval.h"
+
+#include <atomic>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+constexpr int PATCHES = 500;
+constexpr int READERS = 4;
+// patches which add a large string, forcing a copy of the live tree
+constexpr int LARGE_EVERY = 50;
+
+static std::atomic<bool> done{false};
+static std::atomic<int> inconsistent{0};
+static std::atomic<size_t> reads{0};
+
+static double number(EvalContext &context, const PreparedQuery &query,
+                     const VersionedDocument::Snapshot &snapshot) {
+  ResultView result = context.evaluate(query, snapshot);
+  return result.as_number().value_or(-1);
+}
+
+static void reader(VersionedDocument &document) {
+  auto n = PreparedQuery::prepare("n");
+  auto check = PreparedQuery::prepare("check");
+  auto items = PreparedQuery::prepare("size(items)");
+  EvalContext context;
+  double last = 0;
+  while (!done.load()) {
+    VersionedDocument::Snapshot snapshot = document.snapshot();
+    double value = number(context, *n, snapshot);
+    if (value < last || number(context, *check, snapshot) != value ||
+        number(context, *items, snapshot) != value) {
+      inconsistent++;
+    }
+    last = value;
+    reads++;
+  }
+}
+
+int main() {
+  VersionedDocument document(
+      Document::from_buffer(R"({"n": 0, "check": 0, "items": []})"));
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < READERS; i++) {
+    readers.emplace_back(reader, std::ref(document));
+  }
+
+  const Arena *arena = &document.snapshot().get_arena();
+  int copies = 0;
+  int failed = 0;
+  std::string large(64 * 1024, 'x');
+  for (int k = 1; k <= PATCHES; k++) {
+    std::string text = "[";
+    text += R"({"op": "replace", "path": "/n", "value": )" +
+            std::to_string(k) + "},";
+    text += R"({"op": "replace", "path": "/check", "value": )" +
+            std::to_string(k) + "},";
+    text += R"({"op": "add", "path": "/items/-", "value": {"id": )" +
+            std::to_string(k) + "}}";
+    if (k % LARGE_EVERY == 0) {
+      text += R"(, {"op": "add", "path": "/large", "value": ")" + large +
+              "\"}";
+    }
+    text += "]";
+
+    const char *error = nullptr;
+    if (!document.apply_patch(*Document::from_buffer(text), error)) {
+      fprintf(stderr, "patch %d: %s\n", k, error);
+      failed++;
+    }
+    const Arena *now = &document.snapshot().get_arena();
+    copies += now != arena;
+    arena = now;
+  }
+
+  done = true;
+  for (std::thread &thread : readers) {
+    thread.join();
+  }
+
+  if (failed > 0 || inconsistent > 0 || copies == 0 || reads == 0) {
+    printf("%d patches failed, %d inconsistent reads, %d copies\n", failed,
+           inconsistent.load(), copies);
+    return 1;
+  }
+  printf("every snapshot was consistent\n");
+  return 0;
+}